@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Daiki Ueno
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "loop.h"
+
+#define SIZEOF(x) (sizeof (x) / sizeof(*x))
+
+/* Maximum number of events returned by a single epoll_wait call.  */
+#define MAX_EVENTS 16
+
+struct xim_wayland_loop_source_t
+{
+  int fd;
+  uint32_t events;
+  xim_wayland_loop_fd_func_t func;
+  void *data;
+
+  /* Sources removed while dispatching are freed at the end of the
+     iteration, since they may still appear in the current batch.  */
+  bool removed;
+  struct xim_wayland_loop_source_t *next_removed;
+};
+
+struct xim_wayland_loop_timer_t
+{
+  xim_wayland_loop_timer_func_t func;
+  void *data;
+
+  uint64_t deadline;            /* 0 if not armed */
+  struct xim_wayland_loop_timer_t *prev;
+  struct xim_wayland_loop_timer_t *next;
+};
+
+struct xim_wayland_loop_signal_t
+{
+  xim_wayland_loop_signal_func_t func;
+  void *data;
+};
+
+struct xim_wayland_loop_t
+{
+  int epoll_fd;
+
+  bool running;
+  bool success;
+  bool dispatching;
+  xim_wayland_loop_source_t *removed;
+
+  /* Armed timers, sorted by deadline.  */
+  xim_wayland_loop_timer_t *timers;
+  xim_wayland_loop_source_t *timer_source;
+
+  sigset_t signal_mask;
+  struct xim_wayland_loop_signal_t signals[NSIG];
+  xim_wayland_loop_source_t *signal_source;
+
+  xim_wayland_loop_prepare_func_t prepare_func;
+  void *prepare_data;
+};
+
+uint64_t
+xim_wayland_loop_get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+dispatch_timers (xim_wayland_loop_t *loop,
+                 int fd,
+                 uint32_t events,
+                 void *data);
+
+xim_wayland_loop_t *
+xim_wayland_loop_new (void)
+{
+  xim_wayland_loop_t *loop;
+  int fd;
+
+  loop = calloc (1, sizeof (xim_wayland_loop_t));
+  if (!loop)
+    return NULL;
+
+  sigemptyset (&loop->signal_mask);
+
+  loop->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0)
+    {
+      free (loop);
+      return NULL;
+    }
+
+  fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd < 0)
+    {
+      close (loop->epoll_fd);
+      free (loop);
+      return NULL;
+    }
+
+  loop->timer_source = xim_wayland_loop_add_fd (loop, fd, EPOLLIN,
+                                                dispatch_timers, NULL);
+  if (!loop->timer_source)
+    {
+      close (fd);
+      close (loop->epoll_fd);
+      free (loop);
+      return NULL;
+    }
+
+  return loop;
+}
+
+void
+xim_wayland_loop_free (xim_wayland_loop_t *loop)
+{
+  while (loop->removed)
+    {
+      xim_wayland_loop_source_t *next = loop->removed->next_removed;
+      free (loop->removed);
+      loop->removed = next;
+    }
+
+  close (loop->timer_source->fd);
+  free (loop->timer_source);
+
+  if (loop->signal_source)
+    {
+      close (loop->signal_source->fd);
+      free (loop->signal_source);
+      sigprocmask (SIG_UNBLOCK, &loop->signal_mask, NULL);
+    }
+
+  close (loop->epoll_fd);
+  free (loop);
+}
+
+xim_wayland_loop_source_t *
+xim_wayland_loop_add_fd (xim_wayland_loop_t *loop,
+                         int fd,
+                         uint32_t events,
+                         xim_wayland_loop_fd_func_t func,
+                         void *data)
+{
+  xim_wayland_loop_source_t *source;
+  struct epoll_event event;
+
+  source = calloc (1, sizeof (xim_wayland_loop_source_t));
+  if (!source)
+    return NULL;
+
+  source->fd = fd;
+  source->events = events;
+  source->func = func;
+  source->data = data;
+
+  memset (&event, 0, sizeof (event));
+  event.events = events;
+  event.data.ptr = source;
+
+  if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+      free (source);
+      return NULL;
+    }
+
+  return source;
+}
+
+bool
+xim_wayland_loop_update_fd (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_source_t *source,
+                            uint32_t events)
+{
+  struct epoll_event event;
+
+  if (source->events == events)
+    return true;
+
+  memset (&event, 0, sizeof (event));
+  event.events = events;
+  event.data.ptr = source;
+
+  if (epoll_ctl (loop->epoll_fd, EPOLL_CTL_MOD, source->fd, &event) < 0)
+    return false;
+
+  source->events = events;
+  return true;
+}
+
+void
+xim_wayland_loop_remove_fd (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_source_t *source)
+{
+  epoll_ctl (loop->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+  if (loop->dispatching)
+    {
+      source->removed = true;
+      source->next_removed = loop->removed;
+      loop->removed = source;
+    }
+  else
+    free (source);
+}
+
+static void
+update_timer_fd (xim_wayland_loop_t *loop)
+{
+  struct itimerspec its;
+
+  memset (&its, 0, sizeof (its));
+  if (loop->timers)
+    {
+      its.it_value.tv_sec = loop->timers->deadline / 1000;
+      its.it_value.tv_nsec = (loop->timers->deadline % 1000) * 1000000;
+    }
+
+  timerfd_settime (loop->timer_source->fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static void
+unlink_timer (xim_wayland_loop_t *loop, xim_wayland_loop_timer_t *timer)
+{
+  if (timer->prev)
+    timer->prev->next = timer->next;
+  else
+    loop->timers = timer->next;
+
+  if (timer->next)
+    timer->next->prev = timer->prev;
+
+  timer->prev = timer->next = NULL;
+  timer->deadline = 0;
+}
+
+static void
+dispatch_timers (xim_wayland_loop_t *loop,
+                 int fd,
+                 uint32_t events,
+                 void *data)
+{
+  uint64_t expirations;
+  uint64_t now;
+
+  (void) events;
+  (void) data;
+
+  while (read (fd, &expirations, sizeof (expirations)) > 0)
+    ;
+
+  now = xim_wayland_loop_get_time ();
+  while (loop->timers && loop->timers->deadline <= now)
+    {
+      xim_wayland_loop_timer_t *timer = loop->timers;
+
+      unlink_timer (loop, timer);
+      timer->func (loop, timer->data);
+    }
+
+  update_timer_fd (loop);
+}
+
+xim_wayland_loop_timer_t *
+xim_wayland_loop_add_timer (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_timer_func_t func,
+                            void *data)
+{
+  xim_wayland_loop_timer_t *timer;
+
+  (void) loop;
+
+  timer = calloc (1, sizeof (xim_wayland_loop_timer_t));
+  if (!timer)
+    return NULL;
+
+  timer->func = func;
+  timer->data = data;
+
+  return timer;
+}
+
+bool
+xim_wayland_loop_timer_arm (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_timer_t *timer,
+                            uint64_t timeout)
+{
+  xim_wayland_loop_timer_t *prev;
+  uint64_t deadline;
+
+  if (timer->deadline != 0)
+    unlink_timer (loop, timer);
+
+  deadline = xim_wayland_loop_get_time () + timeout;
+  deadline = ((deadline + XIM_WAYLAND_LOOP_TIMER_SLACK - 1)
+              / XIM_WAYLAND_LOOP_TIMER_SLACK) * XIM_WAYLAND_LOOP_TIMER_SLACK;
+  if (deadline == 0)
+    deadline = XIM_WAYLAND_LOOP_TIMER_SLACK;
+
+  timer->deadline = deadline;
+
+  prev = NULL;
+  if (loop->timers && loop->timers->deadline <= deadline)
+    {
+      prev = loop->timers;
+      while (prev->next && prev->next->deadline <= deadline)
+        prev = prev->next;
+    }
+
+  timer->prev = prev;
+  if (prev)
+    {
+      timer->next = prev->next;
+      prev->next = timer;
+    }
+  else
+    {
+      timer->next = loop->timers;
+      loop->timers = timer;
+    }
+
+  if (timer->next)
+    timer->next->prev = timer;
+
+  if (loop->timers == timer)
+    update_timer_fd (loop);
+
+  return true;
+}
+
+void
+xim_wayland_loop_timer_disarm (xim_wayland_loop_t *loop,
+                               xim_wayland_loop_timer_t *timer)
+{
+  bool first;
+
+  if (timer->deadline == 0)
+    return;
+
+  first = loop->timers == timer;
+  unlink_timer (loop, timer);
+  if (first)
+    update_timer_fd (loop);
+}
+
+bool
+xim_wayland_loop_timer_is_armed (xim_wayland_loop_timer_t *timer)
+{
+  return timer->deadline != 0;
+}
+
+void
+xim_wayland_loop_remove_timer (xim_wayland_loop_t *loop,
+                               xim_wayland_loop_timer_t *timer)
+{
+  xim_wayland_loop_timer_disarm (loop, timer);
+  free (timer);
+}
+
+static void
+dispatch_signals (xim_wayland_loop_t *loop,
+                  int fd,
+                  uint32_t events,
+                  void *data)
+{
+  struct signalfd_siginfo info;
+
+  (void) events;
+  (void) data;
+
+  while (read (fd, &info, sizeof (info)) == sizeof (info))
+    {
+      struct xim_wayland_loop_signal_t *signal;
+
+      if (info.ssi_signo >= SIZEOF (loop->signals))
+        continue;
+
+      signal = &loop->signals[info.ssi_signo];
+      if (signal->func)
+        signal->func (loop, info.ssi_signo, signal->data);
+    }
+}
+
+bool
+xim_wayland_loop_add_signal (xim_wayland_loop_t *loop,
+                             int signo,
+                             xim_wayland_loop_signal_func_t func,
+                             void *data)
+{
+  int fd;
+
+  if (signo <= 0 || (size_t) signo >= SIZEOF (loop->signals))
+    return false;
+
+  sigaddset (&loop->signal_mask, signo);
+  if (sigprocmask (SIG_BLOCK, &loop->signal_mask, NULL) < 0)
+    return false;
+
+  fd = signalfd (loop->signal_source ? loop->signal_source->fd : -1,
+                 &loop->signal_mask,
+                 SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  if (!loop->signal_source)
+    {
+      loop->signal_source = xim_wayland_loop_add_fd (loop, fd, EPOLLIN,
+                                                     dispatch_signals, NULL);
+      if (!loop->signal_source)
+        {
+          close (fd);
+          return false;
+        }
+    }
+
+  loop->signals[signo].func = func;
+  loop->signals[signo].data = data;
+
+  return true;
+}
+
+void
+xim_wayland_loop_set_prepare_func (xim_wayland_loop_t *loop,
+                                   xim_wayland_loop_prepare_func_t func,
+                                   void *data)
+{
+  loop->prepare_func = func;
+  loop->prepare_data = data;
+}
+
+bool
+xim_wayland_loop_run (xim_wayland_loop_t *loop)
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  loop->running = true;
+  loop->success = true;
+
+  while (loop->running)
+    {
+      bool busy = false;
+      int i, n;
+
+      if (loop->prepare_func)
+        busy = loop->prepare_func (loop, loop->prepare_data);
+
+      if (!loop->running)
+        break;
+
+      n = epoll_wait (loop->epoll_fd, events, SIZEOF (events), busy ? 0 : -1);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return false;
+        }
+
+      loop->dispatching = true;
+      for (i = 0; i < n && loop->running; i++)
+        {
+          xim_wayland_loop_source_t *source = events[i].data.ptr;
+
+          if (source->removed)
+            continue;
+
+          source->func (loop, source->fd, events[i].events, source->data);
+        }
+      loop->dispatching = false;
+
+      while (loop->removed)
+        {
+          xim_wayland_loop_source_t *next = loop->removed->next_removed;
+          free (loop->removed);
+          loop->removed = next;
+        }
+    }
+
+  return loop->success;
+}
+
+void
+xim_wayland_loop_quit (xim_wayland_loop_t *loop, bool success)
+{
+  loop->running = false;
+  loop->success = success;
+}
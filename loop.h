@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Daiki Ueno
+ */
+
+#ifndef __XIM_WAYLAND_LOOP_H__
+#define __XIM_WAYLAND_LOOP_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* A single-threaded event loop built on epoll.  File descriptors,
+   timers and signals are all delivered through one epoll_wait call:
+   timers share a timerfd and signals share a signalfd.
+
+   File descriptors may be registered edge-triggered (EPOLLET), in
+   which case the callback must consume everything available.  */
+
+typedef struct xim_wayland_loop_t xim_wayland_loop_t;
+typedef struct xim_wayland_loop_source_t xim_wayland_loop_source_t;
+typedef struct xim_wayland_loop_timer_t xim_wayland_loop_timer_t;
+
+typedef void (* xim_wayland_loop_fd_func_t) (xim_wayland_loop_t *loop,
+                                             int fd,
+                                             uint32_t events,
+                                             void *data);
+
+typedef void (* xim_wayland_loop_timer_func_t) (xim_wayland_loop_t *loop,
+                                                void *data);
+
+typedef void (* xim_wayland_loop_signal_func_t) (xim_wayland_loop_t *loop,
+                                                 int signo,
+                                                 void *data);
+
+/* Called before the loop waits for events.  Returns true if work is
+   left over, in which case the loop only polls for new events instead
+   of waiting.  */
+typedef bool (* xim_wayland_loop_prepare_func_t) (xim_wayland_loop_t *loop,
+                                                  void *data);
+
+xim_wayland_loop_t *
+xim_wayland_loop_new (void);
+
+void
+xim_wayland_loop_free (xim_wayland_loop_t *loop);
+
+/* File descriptors.  EVENTS is a mask of EPOLL* flags.  */
+
+xim_wayland_loop_source_t *
+xim_wayland_loop_add_fd (xim_wayland_loop_t *loop,
+                         int fd,
+                         uint32_t events,
+                         xim_wayland_loop_fd_func_t func,
+                         void *data);
+
+bool
+xim_wayland_loop_update_fd (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_source_t *source,
+                            uint32_t events);
+
+void
+xim_wayland_loop_remove_fd (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_source_t *source);
+
+/* Timers.  Deadlines are rounded up to a multiple of
+   XIM_WAYLAND_LOOP_TIMER_SLACK milliseconds, so that timers expiring
+   close to each other are dispatched in a single wakeup.  */
+
+#define XIM_WAYLAND_LOOP_TIMER_SLACK 4
+
+xim_wayland_loop_timer_t *
+xim_wayland_loop_add_timer (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_timer_func_t func,
+                            void *data);
+
+/* Arms TIMER to fire once after TIMEOUT milliseconds, replacing any
+   previous deadline.  */
+bool
+xim_wayland_loop_timer_arm (xim_wayland_loop_t *loop,
+                            xim_wayland_loop_timer_t *timer,
+                            uint64_t timeout);
+
+void
+xim_wayland_loop_timer_disarm (xim_wayland_loop_t *loop,
+                               xim_wayland_loop_timer_t *timer);
+
+bool
+xim_wayland_loop_timer_is_armed (xim_wayland_loop_timer_t *timer);
+
+void
+xim_wayland_loop_remove_timer (xim_wayland_loop_t *loop,
+                               xim_wayland_loop_timer_t *timer);
+
+/* Signals.  SIGNO is blocked for the whole process and delivered
+   through the loop instead.  */
+
+bool
+xim_wayland_loop_add_signal (xim_wayland_loop_t *loop,
+                             int signo,
+                             xim_wayland_loop_signal_func_t func,
+                             void *data);
+
+void
+xim_wayland_loop_set_prepare_func (xim_wayland_loop_t *loop,
+                                   xim_wayland_loop_prepare_func_t func,
+                                   void *data);
+
+/* Returns the time of the monotonic clock in milliseconds.  */
+uint64_t
+xim_wayland_loop_get_time (void);
+
+/* Runs until xim_wayland_loop_quit() is called, and returns its
+   SUCCESS argument, or false if waiting for events fails.  */
+bool
+xim_wayland_loop_run (xim_wayland_loop_t *loop);
+
+void
+xim_wayland_loop_quit (xim_wayland_loop_t *loop, bool success);
+
+#endif
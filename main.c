@@ -24,8 +24,22 @@
 #include <string.h>
 #include <getopt.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 #include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+#include <xcb/xcbext.h>
 #include "text-client-protocol.h"
+#include "loop.h"
+#include "queue.h"
 #include "xim.h"
 
 #define SIZEOF(x) (sizeof (x) / sizeof(*x))
@@ -44,13 +58,120 @@ enum
     FOCUS_WINDOW,
     PREEDIT_ATTRIBUTES,
     STATUS_ATTRIBUTES,
+    AREA,
+    SPOT_LOCATION,
+    FONT_SET,
     LAST_IC_ATTRIBUTE
   };
 
+/* Standard extensions, negotiated per client.  */
+enum
+  {
+    EXTENSION_SET_EVENT_MASK,
+    EXTENSION_FORWARD_KEYEVENT,
+    EXTENSION_MOVE,
+    LAST_EXTENSION
+  };
+
+static const struct
+{
+  const char *name;
+  uint8_t minor_opcode;
+} extension_infos[LAST_EXTENSION] =
+  {
+    [EXTENSION_SET_EVENT_MASK] =
+    { "XIM_EXT_SET_EVENT_MASK", XCB_XIM_EXT_SET_EVENT_MASK },
+    [EXTENSION_FORWARD_KEYEVENT] =
+    { "XIM_EXT_FORWARD_KEYEVENT", XCB_XIM_EXT_FORWARD_KEYEVENT },
+    [EXTENSION_MOVE] =
+    { "XIM_EXT_MOVE", XCB_XIM_EXT_MOVE }
+  };
+
+/* Sub-attributes of preeditAttributes and statusAttributes.  */
+#define NESTED_AREA (1 << 0)
+#define NESTED_SPOT_LOCATION (1 << 1)
+#define NESTED_FONT_SET (1 << 2)
+
 typedef struct xim_wayland_input_context_t xim_wayland_input_context_t;
 typedef struct xim_wayland_input_method_t xim_wayland_input_method_t;
+typedef struct xim_wayland_client_t xim_wayland_client_t;
+typedef struct xim_wayland_window_t xim_wayland_window_t;
+typedef struct xim_wayland_seat_t xim_wayland_seat_t;
+typedef struct xim_wayland_server_seat_t xim_wayland_server_seat_t;
+typedef struct xim_wayland_server_t xim_wayland_server_t;
 typedef struct xim_wayland_t xim_wayland_t;
 
+#define QUARANTINE_ERRORS 16
+
+/* Key events are delivered to the input method by Wayland, so ask
+   clients not to forward any, neither asynchronously nor
+   synchronously.  */
+#define FORWARD_EVENT_MASK 0
+#define SYNCHRONOUS_EVENT_MASK 0
+
+/* Key events a client may still forward after XIM_SET_EVENT_MASK,
+   which were possibly sent before it was received.  Past this, the
+   client is considered to ignore the event mask.  */
+#define EVENT_MASK_GRACE 8
+
+#define MAX_TRIGGER_KEYS 8
+
+/* Flags of XIM_TRIGGER_NOTIFY.  */
+#define TRIGGER_NOTIFY_ON 0
+#define TRIGGER_NOTIFY_OFF 1
+
+/* Input method and input context IDs are CARD16 and 0 is reserved.  */
+#define ID_MAX 0xffff
+
+/* Number of IDs which must be freed after an ID before it is reused,
+   so that a late request for a destroyed object doesn't hit a new
+   one.  */
+#define ID_QUARANTINE 256
+
+struct xim_wayland_id_statistics_t
+{
+  size_t live;
+  size_t peak;
+  uint64_t allocated;
+  uint64_t reused;
+  uint64_t exhausted;
+};
+
+typedef struct xim_wayland_id_statistics_t xim_wayland_id_statistics_t;
+
+enum
+  {
+    PRIORITY_FOCUSED,
+    PRIORITY_NORMAL,
+    LAST_PRIORITY
+  };
+
+/* Time requests spent queued, in microseconds.  */
+struct xim_wayland_delay_statistics_t
+{
+  uint64_t count;
+  uint64_t total;
+  uint64_t max;
+};
+
+typedef struct xim_wayland_delay_statistics_t xim_wayland_delay_statistics_t;
+
+/* Allocator of IDs in a scope.  IDs which have never been used are
+   handed out first, and freed IDs are recycled in FIFO order.  */
+struct xim_wayland_id_allocator_t
+{
+  uint32_t next;                /* next never-used ID */
+
+  uint16_t *freed;              /* ring buffer of freed IDs */
+  size_t freed_head;
+  size_t freed_length;
+  size_t freed_size;
+
+  xim_wayland_id_statistics_t *statistics;
+};
+
+typedef struct xim_wayland_id_allocator_t xim_wayland_id_allocator_t;
+
 struct xim_wayland_styling_t
 {
   uint32_t index;
@@ -61,6 +182,25 @@ struct xim_wayland_styling_t
 
 typedef struct xim_wayland_styling_t xim_wayland_styling_t;
 
+/* Decoded value of a nested attribute.  The wire format is only
+   regenerated when a client asks for it and something has changed
+   since the last time.  */
+struct xim_wayland_nested_attributes_t
+{
+  uint16_t attribute_id;
+  uint32_t mask;                /* NESTED_* which have been set */
+  uint32_t dirty;               /* NESTED_* changed since encoding */
+
+  xcb_rectangle_t area;
+  xcb_point_t spot_location;
+  char *font_set;
+
+  xcb_xim_attribute_t *encoded;
+};
+
+typedef struct xim_wayland_nested_attributes_t
+  xim_wayland_nested_attributes_t;
+
 struct xim_wayland_input_context_t
 {
   uint16_t id;
@@ -69,51 +209,677 @@ struct xim_wayland_input_context_t
   struct wl_surface *surface;
   uint32_t serial;
 
+  /* Bumped whenever the text input is released.  Relayed events carry
+     the generation they were sent for, since a new text input may get
+     the address of the old one.  */
+  atomic_uint generation;
+
   xcb_xim_attribute_t *attrs[LAST_IC_ATTRIBUTE];
+  xim_wayland_nested_attributes_t preedit_attributes;
+  xim_wayland_nested_attributes_t status_attributes;
 
-  xim_wayland_t *xw;
+  xim_wayland_server_t *server;
 
+  bool focused;
   bool preedit_started;
 
+  /* Whether the client turned input on.  Always true in static event
+     flow; in dynamic event flow, the Wayland objects are only created
+     in between trigger keys.  */
+  bool engaged;
+
+  /* The cursor rectangle last sent to the text input, and whether an
+     update is scheduled, in which case the input context is linked to
+     the cursor list of the server.  */
+  xcb_rectangle_t cursor_rectangle;
+  bool cursor_sent;
+  bool cursor_pending;
+  struct wl_list cursor_link;
+  xim_wayland_window_t *window; /* referenced focus window */
+
+  /* Text before the caret of the client, which is at its end.  It is
+     retrieved with XIM_STR_CONVERSION once, then kept up to date with
+     the commits and deletions done through us.  A deletion requested
+     by the compositor is done with the next commit.  */
+  char *surrounding_text;
+  size_t surrounding_length;
+  bool surrounding_valid;
+  bool surrounding_requested;
+  bool surrounding_sent;        /* the text input has it */
+  unsigned int substitutions;   /* XIM_STR_CONVERSION_REPLY to skip */
+  bool delete_pending;
+  int32_t delete_index;
+  uint32_t delete_length;
+
   char *preedit_string;
   uint16_t preedit_length;
   int32_t preedit_caret;
   struct wl_list preedit_styling_list;
 
+  /* Language and text direction announced by the compositor, shown in
+     the status area of clients with status callbacks.  The status last
+     drawn is kept so that the compositor repeating itself, which it
+     does on every focus, costs nothing.  */
+  char *language;
+  uint32_t text_direction;
+  char *status_string;          /* last XIM_STATUS_DRAW */
+  bool status_started;
+
+  struct wl_list link;
+};
+
+/* Position of a focus window on its root window, so that caret moves
+   don't need a round trip.  Entries are referenced by the input
+   contexts whose focus window they are, and watched for StructureNotify
+   as long as they are referenced.  The ancestors up to the top-level
+   are walked once with QueryTree, and the top-level is watched through
+   an entry of its own, since that is the window which moves.  An
+   origin is invalidated by ConfigureNotify on its window or on one of
+   its ancestors, the ancestors by ReparentNotify.  */
+struct xim_wayland_window_t
+{
+  xcb_window_t window;
+  xcb_window_t root;
+  unsigned int references;
+  bool destroyed;
+  bool valid;
+  bool tree_valid;              /* ancestors and top-level are known */
+  bool pending;                 /* sequence not yet replied */
+  unsigned int sequence;        /* QueryTree until tree_valid, then
+                                   TranslateCoordinates */
+  int16_t x;
+  int16_t y;
+  xcb_window_t *ancestors;      /* parent first, up to the top-level */
+  size_t nancestors;
+  xim_wayland_window_t *toplevel; /* referenced, NULL if itself */
+
+  struct wl_list link;
+};
+
+/* A wl_seat, bound and released in the Wayland thread.  It is
+   referenced by the seat list of xim_wayland_t while advertised, and by
+   each server which has been told about it.  */
+struct xim_wayland_seat_t
+{
+  xim_wayland_t *xw;
+  uint32_t global_name;
+  struct wl_seat *wl_seat;
+  char *name;                   /* NULL before version 2 */
+  bool announced;               /* servers have been told about it */
+  int references;
+
+  struct wl_list link;
+};
+
+/* Per-seat state of a server, only accessed in its thread.  */
+struct xim_wayland_server_seat_t
+{
+  xim_wayland_seat_t *seat;
+  xim_wayland_input_context_t *focused_input_context;
+
+  struct wl_list link;
+};
+
+/* Input methods opened through a transport, so that they are found
+   and freed without looking at those of other clients.  Attached to
+   the transport as its user_data.  */
+struct xim_wayland_client_t
+{
+  xcb_xim_transport_t *transport;
+
+  /* Requests which failed in a row.  Past QUARANTINE_ERRORS, the
+     client is quarantined: its input methods are freed and its
+     requests are answered with XIM_ERROR until it disconnects.  */
+  unsigned int errors;
+  bool quarantined;
+
+  /* Key events sent back with XIM_FORWARD_EVENT.  */
+  uint64_t forwarded_events;
+
+  /* Whether XIM_SET_EVENT_MASK was sent, the key events forwarded
+     since then, and whether the client turned out to ignore it, in
+     which case it is no longer sent on XIM_CREATE_IC.  */
+  bool event_mask_sent;
+  unsigned int masked_forwarded_events;
+  bool ignores_event_mask;
+
+  /* (1 << EXTENSION_*) returned by XIM_QUERY_EXTENSION.  */
+  uint32_t extensions;
+
+  /* Set when XIM_STR_CONVERSION was left unanswered until the next
+     focus, so that it is not sent again.  */
+  bool no_str_conversion;
+
+  /* Whether the client implements the string conversion callback, as
+     shown by a non-empty retrieval, and whether it turned out to
+     ignore substitutions anyway, by replying with nothing.  Otherwise
+     deletions are done with BackSpace.  */
+  bool str_conversion_supported;
+  bool ignores_substitution;
+
+  struct wl_list input_method_list;
   struct wl_list link;
 };
 
 struct xim_wayland_input_method_t
 {
   xcb_xim_transport_t *transport;
+  xim_wayland_client_t *client;
   uint16_t id;
-  uint16_t input_context_counter;
+  xim_wayland_id_allocator_t input_context_ids;
 
-  xcb_xim_attribute_spec_t *specs[LAST_IM_ATTRIBUTE];
-  xcb_xim_attribute_t *attrs[LAST_IM_ATTRIBUTE];
+  xim_wayland_server_t *server;
 
-  xcb_xim_attribute_spec_t *ic_specs[LAST_IC_ATTRIBUTE];
+  /* Seat the client's text goes to; NULL while there is none.  */
+  xim_wayland_server_seat_t *seat;
+
+  /* Values set with XIM_SET_IM_VALUES; NULL means the default in
+     xim_wayland_handshake_t.  */
+  xcb_xim_attribute_t *attrs[LAST_IM_ATTRIBUTE];
 
   struct wl_list input_context_list;
   struct wl_list link;
+  struct wl_list client_link;
 };
 
-struct xim_wayland_t
+/* Replies to the requests sent while opening an input method, which
+   are the same for all input methods.  They are serialized once per
+   byte order at startup and shared.  */
+struct xim_wayland_handshake_t
+{
+  xcb_xim_attribute_t *attrs[LAST_IM_ATTRIBUTE];
+  xcb_xim_extension_t *extensions[LAST_EXTENSION];
+
+  xcb_xim_reply_t *open_reply;
+  xcb_xim_reply_t *query_extension_reply;
+  xcb_xim_reply_t *query_input_style_reply;
+};
+
+typedef struct xim_wayland_handshake_t xim_wayland_handshake_t;
+
+struct xim_wayland_statistics_t
+{
+  xim_wayland_id_statistics_t input_method_ids;
+  xim_wayland_id_statistics_t input_context_ids;
+
+  xim_wayland_delay_statistics_t queue_delays[LAST_PRIORITY];
+
+  uint64_t trims;
+  uint64_t released_input_contexts;
+  uint64_t reclaimed_bytes;
+
+  /* Failed requests, by major opcode.  */
+  uint64_t request_errors[256];
+  uint64_t quarantined_clients;
+  uint64_t quarantined_requests;
+
+  uint64_t forwarded_events;
+  uint64_t event_masks;
+  uint64_t event_mask_ignored;
+
+  uint64_t triggers_on;
+  uint64_t triggers_off;
+  uint64_t dormant_input_contexts;
+
+  uint64_t spot_moves;
+
+  uint64_t cursor_updates;
+  uint64_t cursor_updates_skipped;
+  uint64_t origin_requests;
+
+  uint64_t surrounding_requests;
+  uint64_t surrounding_updates;
+  uint64_t surrounding_updates_skipped;
+  uint64_t surrounding_deletions;
+  uint64_t surrounding_backspaces;
+
+  uint64_t status_draws;
+  uint64_t status_draws_skipped;
+};
+
+typedef struct xim_wayland_statistics_t xim_wayland_statistics_t;
+
+/* Messages exchanged between the Wayland thread and the X threads in
+   threaded mode.  */
+typedef enum
+  {
+    /* From the Wayland thread to an X thread; the first ones mirror
+       the wl_text_input events.  */
+    MESSAGE_ENTER,
+    MESSAGE_LEAVE,
+    MESSAGE_MODIFIERS_MAP,
+    MESSAGE_INPUT_PANEL_STATE,
+    MESSAGE_PREEDIT_STRING,
+    MESSAGE_PREEDIT_STYLING,
+    MESSAGE_PREEDIT_CURSOR,
+    MESSAGE_COMMIT_STRING,
+    MESSAGE_CURSOR_POSITION,
+    MESSAGE_DELETE_SURROUNDING_TEXT,
+    MESSAGE_KEYSYM,
+    MESSAGE_LANGUAGE,
+    MESSAGE_TEXT_DIRECTION,
+    MESSAGE_RETIRED,            /* echo of MESSAGE_RETIRE */
+    MESSAGE_SEAT_ADDED,
+    MESSAGE_SEAT_REMOVED,
+    MESSAGE_PRINT_STATISTICS,
+
+    /* From an X thread to the Wayland thread.  */
+    MESSAGE_RETIRE,             /* an input context is being freed */
+    MESSAGE_SEAT_RELEASED,      /* echo of MESSAGE_SEAT_REMOVED */
+    MESSAGE_FLUSH,              /* requests couldn't be flushed */
+    MESSAGE_DRAIN,              /* room was made in the queue to it */
+    MESSAGE_STOPPED             /* the X thread has failed */
+  } xim_wayland_message_type_t;
+
+struct xim_wayland_message_t
+{
+  xim_wayland_message_type_t type;
+  xim_wayland_input_context_t *input_context;
+  struct wl_text_input *text_input;
+  unsigned int generation;
+  void *object;
+  uint32_t args[5];
+  char *strings[2];
+  struct wl_array array;
+};
+
+typedef struct xim_wayland_message_t xim_wayland_message_t;
+
+/* Messages which didn't fit in a queue.  */
+struct xim_wayland_overflow_t
+{
+  xim_wayland_message_t message;
+  struct xim_wayland_overflow_t *next;
+};
+
+#define MESSAGE_QUEUE_CAPACITY 1024
+#define MESSAGE_BUDGET 64
+
+/* Wayland events kept for an X thread which doesn't keep up, beyond
+   which they are dropped.  Other messages are always kept.  */
+#define MESSAGE_OVERFLOW_LIMIT 4096
+
+/* How often a failed X thread retries sending its left over messages,
+   in milliseconds.  */
+#define OVERFLOW_RETRY_INTERVAL 10
+
+/* Interval between checks of the resident set size, and minimum
+   interval between the trims it causes, in milliseconds.  */
+#define RSS_CHECK_INTERVAL 1000
+#define RSS_TRIM_INTERVAL 10000
+
+/* Cursor rectangles are sent at most once per frame, in milliseconds.  */
+#define CURSOR_UPDATE_INTERVAL 16
+
+/* Characters before the caret asked from clients as surrounding text,
+   and the bytes of it kept as commits are added.  */
+#define SURROUNDING_TEXT_CHARS 64
+#define SURROUNDING_TEXT_MAX 256
+
+/* Work done per loop iteration, so that no source or client can delay
+   the others for long.  Requests from the client owning the focused
+   input context are handled first, then the other clients' requests
+   in round-robin order.  */
+#define X_EVENT_BUDGET 64
+#define WAYLAND_READ_BUDGET 8
+#define FOCUSED_REQUEST_BUDGET 32
+#define TRANSPORT_REQUEST_BUDGET 4
+#define REQUEST_BUDGET 64
+
+/* An XIM server on an X display.  All servers share the Wayland
+   connection and the replies in xim_wayland_handshake_t.  */
+struct xim_wayland_server_t
 {
+  xim_wayland_t *xw;
+  char *name;
+  char *seat_name;              /* preferred seat, or NULL */
+
   xcb_connection_t *connection;
   xcb_xim_server_connection_t *xim;
-  uint16_t input_method_counter;
+  xim_wayland_id_allocator_t input_method_ids;
+
+  xim_wayland_statistics_t statistics;
+
+  uint64_t last_activity;
+  uint64_t last_rss_check;
+  uint64_t last_rss_trim;
+  bool trimmed;                 /* no activity since the last trim */
+  xim_wayland_loop_timer_t *idle_timer;
+  xim_wayland_loop_timer_t *rss_timer;  /* while over the limit */
+
+  xim_wayland_loop_t *loop;     /* the same as xw->loop unless threaded */
+  xim_wayland_loop_source_t *x_source;
+
+  /* Set when the source has used up its budget.  */
+  bool x_pending;
+
+  xim_wayland_input_context_t *focused_input_context;
+
+  struct wl_list seat_list;
+
+  /* Input contexts whose cursor rectangle is sent when the timer
+     fires, and the origins of their focus windows.  */
+  xim_wayland_loop_timer_t *cursor_timer;
+  struct wl_list cursor_list;
+  struct wl_list window_list;
+
+  /* Threaded mode.  Each server runs in its own X thread, and the
+     Wayland thread relays Wayland events to the X thread owning the
+     input context; sending Wayland requests is thread-safe.  Input
+     contexts are retired through the Wayland thread before being
+     freed, so that the messages referring to them are consumed
+     first.  */
+  pthread_t thread;
+  bool thread_started;
+  atomic_bool thread_running;
+  xim_wayland_queue_t *to_x;
+  xim_wayland_queue_t *to_wayland;
+  xim_wayland_loop_source_t *to_x_source;
+  xim_wayland_loop_source_t *to_wayland_source;
+
+  /* Written by the Wayland thread to stop the X thread, which leaves
+     the messages still queued to discard_messages.  */
+  int quit_fd;
+  xim_wayland_loop_source_t *quit_source;
+  struct xim_wayland_overflow_t *overflow;
+  struct xim_wayland_overflow_t *overflow_tail;
+  bool messages_pending;
+
+  /* Messages which didn't fit in to_x, owned by the Wayland thread so
+     that a stalled X thread doesn't hold up the other displays.  The
+     X thread sends MESSAGE_DRAIN when it made room while
+     x_overflowing is set.  */
+  struct xim_wayland_overflow_t *x_overflow;
+  struct xim_wayland_overflow_t *x_overflow_tail;
+  size_t x_overflow_length;
+  atomic_bool x_overflowing;
+
+  /* Relayed events dropped while x_overflow was full, counted in the
+     Wayland thread and printed with the statistics of the X thread.  */
+  atomic_uint_fast64_t dropped_events;
+
+  struct wl_list input_method_list;
+  struct wl_list client_list;
+  struct wl_list link;
+};
+
+struct xim_wayland_t
+{
+  /* Idle trimming; timeouts are in milliseconds and 0 disables.  */
+  uint64_t idle_timeout;
+  size_t rss_limit;
+
+  /* Runs in the main thread, which is also the Wayland thread.  Unless
+     threaded, the servers run in it too.  */
+  xim_wayland_loop_t *loop;
+  xim_wayland_loop_source_t *wayland_source;
+
+  /* Set when the source has used up its budget.  */
+  bool wayland_pending;
+
+  bool threaded;
+  bool threads_started;
+
+  /* Startup times in microseconds, until every server owns its
+     selection and until the Wayland globals are known.  */
+  uint64_t startup_ready_time;
+  uint64_t startup_time;
+
+  /* Indexed by byte order: 0 for little endian, 1 for big endian.  */
+  xim_wayland_handshake_t handshakes[2];
+
+  /* Keys turning input on and off, registered with every client if
+     any, so that they use dynamic event flow.  */
+  xcb_xim_triggerkey_t trigger_keys[MAX_TRIGGER_KEYS];
+  size_t trigger_keys_length;
 
   struct wl_display *display;
   struct wl_registry *registry;
-  struct wl_seat *seat;
   struct wl_compositor *compositor;
   struct wl_text_input_manager *text_input_manager;
 
-  struct wl_list input_method_list;
+  struct wl_list seat_list;
+  struct wl_list server_list;
 };
 
-typedef struct xim_wayland_t xim_wayland_t;
+static void
+id_allocator_init (xim_wayland_id_allocator_t *allocator,
+                   xim_wayland_id_statistics_t *statistics)
+{
+  memset (allocator, 0, sizeof (xim_wayland_id_allocator_t));
+  allocator->next = 1;
+  allocator->statistics = statistics;
+}
+
+static void
+id_allocator_destroy (xim_wayland_id_allocator_t *allocator)
+{
+  free (allocator->freed);
+  allocator->freed = NULL;
+  allocator->freed_head = 0;
+  allocator->freed_length = 0;
+  allocator->freed_size = 0;
+}
+
+/* Returns 0 if all IDs are either in use or in quarantine.  */
+static uint16_t
+id_allocator_alloc (xim_wayland_id_allocator_t *allocator)
+{
+  xim_wayland_id_statistics_t *statistics = allocator->statistics;
+  uint16_t id;
+
+  if (allocator->next <= ID_MAX)
+    id = allocator->next++;
+  else if (allocator->freed_length > ID_QUARANTINE)
+    {
+      id = allocator->freed[allocator->freed_head];
+      allocator->freed_head =
+        (allocator->freed_head + 1) % allocator->freed_size;
+      allocator->freed_length--;
+      statistics->reused++;
+    }
+  else
+    {
+      statistics->exhausted++;
+      return 0;
+    }
+
+  statistics->allocated++;
+  if (++statistics->live > statistics->peak)
+    statistics->peak = statistics->live;
+
+  return id;
+}
+
+static void
+id_allocator_free (xim_wayland_id_allocator_t *allocator, uint16_t id)
+{
+  if (allocator->freed_length == allocator->freed_size)
+    {
+      size_t freed_size = allocator->freed_size * 2 + 16;
+      uint16_t *freed;
+      size_t i;
+
+      freed = malloc (sizeof (uint16_t) * freed_size);
+      if (!freed)
+        {
+          /* Leak the ID rather than reusing it too early.  */
+          allocator->statistics->live--;
+          return;
+        }
+
+      for (i = 0; i < allocator->freed_length; i++)
+        freed[i] = allocator->freed[(allocator->freed_head + i)
+                                    % allocator->freed_size];
+
+      free (allocator->freed);
+      allocator->freed = freed;
+      allocator->freed_head = 0;
+      allocator->freed_size = freed_size;
+    }
+
+  allocator->freed[(allocator->freed_head + allocator->freed_length)
+                   % allocator->freed_size] = id;
+  allocator->freed_length++;
+  allocator->statistics->live--;
+}
+
+static void
+print_id_statistics (FILE *stream,
+                     const char *name,
+                     const xim_wayland_id_statistics_t *statistics)
+{
+  fprintf (stream,
+           "%s: %zu live (%.1f%%), %zu peak, %llu allocated, "
+           "%llu reused, %llu exhausted\n",
+           name,
+           statistics->live,
+           100.0 * statistics->live / ID_MAX,
+           statistics->peak,
+           (unsigned long long) statistics->allocated,
+           (unsigned long long) statistics->reused,
+           (unsigned long long) statistics->exhausted);
+}
+
+static void
+print_delay_statistics (FILE *stream,
+                        const char *name,
+                        const xim_wayland_delay_statistics_t *statistics)
+{
+  fprintf (stream,
+           "%s: %llu requests, %llu us average, %llu us max\n",
+           name,
+           (unsigned long long) statistics->count,
+           (unsigned long long) (statistics->count > 0
+                                 ? statistics->total / statistics->count
+                                 : 0),
+           (unsigned long long) statistics->max);
+}
+
+/* In threaded mode, must be called in the thread of SERVER.  */
+static void
+print_server_statistics (xim_wayland_server_t *server, FILE *stream)
+{
+  xim_wayland_statistics_t *statistics = &server->statistics;
+  xcb_xim_transport_statistics_t transports;
+  xim_wayland_client_t *client;
+  int i;
+
+  xcb_xim_server_connection_get_transport_statistics (server->xim,
+                                                      &transports);
+
+  /* Keep the lines together when X threads print at the same time.  */
+  flockfile (stream);
+  fprintf (stream, "display %s:\n", server->name);
+  print_id_statistics (stream, "input method IDs",
+                       &statistics->input_method_ids);
+  print_id_statistics (stream, "input context IDs",
+                       &statistics->input_context_ids);
+  print_delay_statistics (stream, "queue delay (focused)",
+                          &statistics->queue_delays[PRIORITY_FOCUSED]);
+  print_delay_statistics (stream, "queue delay (other)",
+                          &statistics->queue_delays[PRIORITY_NORMAL]);
+  fprintf (stream,
+           "trims: %llu, %llu input contexts released, "
+           "%llu bytes reclaimed\n",
+           (unsigned long long) statistics->trims,
+           (unsigned long long) statistics->released_input_contexts,
+           (unsigned long long) statistics->reclaimed_bytes);
+  for (i = 0; i < SIZEOF (statistics->request_errors); i++)
+    if (statistics->request_errors[i] > 0)
+      fprintf (stream, "errors in request %d: %llu\n",
+               i,
+               (unsigned long long) statistics->request_errors[i]);
+  for (i = 0; i < 256; i++)
+    {
+      uint64_t count =
+        xcb_xim_server_connection_get_default_replies (server->xim, i);
+      if (count > 0)
+        fprintf (stream, "default replies to request %d: %llu\n",
+                 i,
+                 (unsigned long long) count);
+    }
+  fprintf (stream, "forwarded events: %llu\n",
+           (unsigned long long) statistics->forwarded_events);
+  fprintf (stream, "dropped events: %llu\n",
+           (unsigned long long) atomic_load (&server->dropped_events));
+  wl_list_for_each (client, &server->client_list, link)
+    if (client->forwarded_events > 0)
+      fprintf (stream, "  client 0x%x: %llu\n",
+               client->transport->client_window,
+               (unsigned long long) client->forwarded_events);
+  fprintf (stream, "event masks: %llu sent, %llu clients ignoring\n",
+           (unsigned long long) statistics->event_masks,
+           (unsigned long long) statistics->event_mask_ignored);
+  fprintf (stream,
+           "triggers: %llu on, %llu off, %llu input contexts dormant\n",
+           (unsigned long long) statistics->triggers_on,
+           (unsigned long long) statistics->triggers_off,
+           (unsigned long long) statistics->dormant_input_contexts);
+  fprintf (stream, "spot moves: %llu\n",
+           (unsigned long long) statistics->spot_moves);
+  fprintf (stream,
+           "cursor rectangles: %llu sent, %llu unchanged, "
+           "%llu origin requests\n",
+           (unsigned long long) statistics->cursor_updates,
+           (unsigned long long) statistics->cursor_updates_skipped,
+           (unsigned long long) statistics->origin_requests);
+  fprintf (stream,
+           "surrounding text: %llu requests, %llu sent, %llu unchanged, "
+           "%llu deletions, %llu with BackSpace\n",
+           (unsigned long long) statistics->surrounding_requests,
+           (unsigned long long) statistics->surrounding_updates,
+           (unsigned long long) statistics->surrounding_updates_skipped,
+           (unsigned long long) statistics->surrounding_deletions,
+           (unsigned long long) statistics->surrounding_backspaces);
+  fprintf (stream, "status: %llu draws, %llu unchanged\n",
+           (unsigned long long) statistics->status_draws,
+           (unsigned long long) statistics->status_draws_skipped);
+  fprintf (stream,
+           "quarantined: %llu clients, %llu requests\n",
+           (unsigned long long) statistics->quarantined_clients,
+           (unsigned long long) statistics->quarantined_requests);
+  fprintf (stream,
+           "transports: %zu open, %llu closed, "
+           "%llu without XIM_DISCONNECT, %llu malformed requests\n",
+           transports.open,
+           (unsigned long long) transports.closed,
+           (unsigned long long) transports.destroyed,
+           (unsigned long long) transports.malformed_requests);
+  funlockfile (stream);
+}
+
+static void
+print_startup_statistics (xim_wayland_t *xw, FILE *stream)
+{
+  fprintf (stream,
+           "startup: %llu us until selections owned, %llu us total\n",
+           (unsigned long long) xw->startup_ready_time,
+           (unsigned long long) xw->startup_time);
+}
+
+static void
+print_statistics (xim_wayland_t *xw, FILE *stream)
+{
+  xim_wayland_server_t *server;
+
+  print_startup_statistics (xw, stream);
+  wl_list_for_each (server, &xw->server_list, link)
+    print_server_statistics (server, stream);
+}
+
+static void
+dematerialize_input_context (xim_wayland_input_context_t *input_context)
+{
+  if (!input_context->text_input)
+    return;
+
+  atomic_fetch_add (&input_context->generation, 1);
+  wl_text_input_destroy (input_context->text_input);
+  input_context->text_input = NULL;
+  wl_surface_destroy (input_context->surface);
+  input_context->surface = NULL;
+}
 
 static void
 handle_wayland_enter (void *data,
@@ -125,10 +891,27 @@ handle_wayland_enter (void *data,
   wl_text_input_commit_state (wl_text_input, ++input_context->serial);
 }
 
+/* In dynamic event flow, the input context goes dormant once the
+   compositor deactivates it, unless preedit is in progress.  It is
+   recreated when the client focuses it again.  */
 static void
 handle_wayland_leave (void *data,
                       struct wl_text_input *wl_text_input)
 {
+  xim_wayland_input_context_t *input_context = data;
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+  xim_wayland_server_t *server = input_context->server;
+
+  if (server->xw->trigger_keys_length == 0
+      || input_context->preedit_started)
+    return;
+
+  if (input_method->seat
+      && input_method->seat->focused_input_context == input_context)
+    input_method->seat->focused_input_context = NULL;
+
+  dematerialize_input_context (input_context);
+  server->statistics.dormant_input_contexts++;
 }
 
 static void
@@ -138,13 +921,6 @@ handle_wayland_modifiers_map (void *data,
 {
 }
 
-static void
-handle_wayland_input_panel_state (void *data,
-                                  struct wl_text_input *wl_text_input,
-                                  uint32_t state)
-{
-}
-
 static void
 reset_preedit (xim_wayland_input_context_t *input_context)
 {
@@ -171,7 +947,7 @@ update_preedit_string (xim_wayland_input_context_t *input_context,
 
   if (*text == '\0')
     {
-      if (!xcb_xim_preedit_draw (input_context->xw->xim,
+      if (!xcb_xim_preedit_draw (input_context->server->xim,
                                  transport,
                                  input_context->input_method->id,
                                  input_context->id,
@@ -189,9 +965,9 @@ update_preedit_string (xim_wayland_input_context_t *input_context,
           return false;
         }
 
-      if (!input_context->preedit_started)
+      if (input_context->preedit_started)
         {
-          if (!xcb_xim_preedit_done (input_context->xw->xim,
+          if (!xcb_xim_preedit_done (input_context->server->xim,
                                      transport,
                                      input_context->input_method->id,
                                      input_context->id,
@@ -214,7 +990,7 @@ update_preedit_string (xim_wayland_input_context_t *input_context,
 
       if (!input_context->preedit_started)
         {
-          if (!xcb_xim_preedit_start (input_context->xw->xim,
+          if (!xcb_xim_preedit_start (input_context->server->xim,
                                       transport,
                                       input_context->input_method->id,
                                       input_context->id,
@@ -241,7 +1017,7 @@ update_preedit_string (xim_wayland_input_context_t *input_context,
             feedbacks[i + preedit_styling->index] |= preedit_styling->feedback;
         }
 
-      if (!xcb_xim_preedit_draw (input_context->xw->xim,
+      if (!xcb_xim_preedit_draw (input_context->server->xim,
                                  transport,
                                  input_context->input_method->id,
                                  input_context->id,
@@ -357,7 +1133,7 @@ handle_wayland_preedit_cursor (void *data,
   xcb_generic_error_t *error;
 
   error = NULL;
-  if (!xcb_xim_preedit_caret (input_context->xw->xim,
+  if (!xcb_xim_preedit_caret (input_context->server->xim,
                               transport,
                               input_context->input_method->id,
                               input_context->id,
@@ -378,50 +1154,321 @@ handle_wayland_preedit_cursor (void *data,
 }
 
 static void
-handle_wayland_commit_string (void *data,
-                              struct wl_text_input *wl_text_input,
-                              uint32_t serial,
-                              const char *text)
+free_surrounding_text (xim_wayland_input_context_t *input_context)
 {
-  xim_wayland_input_context_t *input_context = data;
-  xcb_generic_error_t *error;
+  free (input_context->surrounding_text);
+  input_context->surrounding_text = NULL;
+  input_context->surrounding_length = 0;
+  input_context->surrounding_valid = false;
+}
 
-  error = NULL;
-  if (!update_preedit_string (input_context, "", &error))
+/* Replaces the surrounding text with the last SURROUNDING_TEXT_MAX
+   bytes of TEXT, cut at a character boundary.  Returns true if it
+   changed.  */
+static bool
+set_surrounding_text (xim_wayland_input_context_t *input_context,
+                      const char *text,
+                      size_t length)
+{
+  char *copy;
+
+  if (length > SURROUNDING_TEXT_MAX)
     {
-      if (error)
-        {
-          fprintf (stderr, "can't clear preedit: %i\n",
-                   error->error_code);
-          free (error);
-        }
-      else
-        fprintf (stderr, "can't clear preedit\n");
+      text += length - SURROUNDING_TEXT_MAX;
+      length = SURROUNDING_TEXT_MAX;
+      while (length > 0 && (*text & 0xc0) == 0x80)
+        text++, length--;
     }
 
-  error = NULL;
-  if (!xcb_xim_commit (input_context->xw->xim,
-                       input_context->input_method->transport,
-                       input_context->input_method->id,
-                       input_context->id,
-                       XCB_XIM_COMMIT_FLAG_KEYSYM | XCB_XIM_COMMIT_FLAG_STRING,
-                       0xffffff,
-                       strlen (text),
-                       (const uint8_t *) text,
-                       &error))
+  if (input_context->surrounding_valid
+      && input_context->surrounding_length == length
+      && memcmp (input_context->surrounding_text, text, length) == 0)
+    return false;
+
+  copy = malloc (length + 1);
+  if (!copy)
     {
-      if (error)
-        {
-          fprintf (stderr, "can't commit string: %i\n",
-                   error->error_code);
-          free (error);
-        }
-      else
-        fprintf (stderr, "can't commit string\n");
+      free_surrounding_text (input_context);
+      return false;
     }
+  memcpy (copy, text, length);
+  copy[length] = '\0';
+
+  free (input_context->surrounding_text);
+  input_context->surrounding_text = copy;
+  input_context->surrounding_length = length;
+  input_context->surrounding_valid = true;
+  return true;
 }
 
-static void
+/* Replaces the surrounding text after its first KEEP bytes with
+   TEXT.  */
+static bool
+splice_surrounding_text (xim_wayland_input_context_t *input_context,
+                         size_t keep,
+                         const char *text,
+                         size_t length)
+{
+  char *buffer;
+  bool changed;
+
+  buffer = malloc (keep + length);
+  if (!buffer)
+    {
+      free_surrounding_text (input_context);
+      return false;
+    }
+
+  memcpy (buffer, input_context->surrounding_text, keep);
+  memcpy (buffer + keep, text, length);
+  changed = set_surrounding_text (input_context, buffer, keep + length);
+  free (buffer);
+
+  return changed;
+}
+
+/* Sends the surrounding text to the text input, unless it already has
+   it.  */
+static void
+send_surrounding_text (xim_wayland_input_context_t *input_context,
+                       bool changed)
+{
+  xim_wayland_server_t *server = input_context->server;
+
+  if (!input_context->text_input || !input_context->surrounding_valid)
+    return;
+
+  if (!changed && input_context->surrounding_sent)
+    {
+      server->statistics.surrounding_updates_skipped++;
+      return;
+    }
+
+  wl_text_input_set_surrounding_text (input_context->text_input,
+                                      input_context->surrounding_text,
+                                      input_context->surrounding_length,
+                                      input_context->surrounding_length);
+  wl_text_input_commit_state (input_context->text_input,
+                              ++input_context->serial);
+
+  input_context->surrounding_sent = true;
+  server->statistics.surrounding_updates++;
+}
+
+static void
+print_str_conversion_error (xcb_generic_error_t *error)
+{
+  if (error)
+    {
+      fprintf (stderr, "can't send string conversion: %i\n",
+               error->error_code);
+      free (error);
+    }
+  else
+    fprintf (stderr, "can't send string conversion\n");
+}
+
+/* Asks the client for the text before the caret, unless it is known
+   or the client doesn't answer.  */
+static void
+request_surrounding_text (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+  xim_wayland_client_t *client = input_method->client;
+  xcb_generic_error_t *error;
+
+  if (!client || client->no_str_conversion
+      || input_context->surrounding_valid)
+    return;
+
+  if (input_context->surrounding_requested)
+    {
+      client->no_str_conversion = true;
+      return;
+    }
+
+  error = NULL;
+  if (!xcb_xim_str_conversion (input_context->server->xim,
+                               input_method->transport,
+                               input_method->id,
+                               input_context->id,
+                               0,
+                               XCB_XIM_CARET_DIRECTION_BACKWARD_CHAR,
+                               SURROUNDING_TEXT_CHARS,
+                               XCB_XIM_STRING_CONVERSION_RETRIEVAL,
+                               0,
+                               &error))
+    {
+      print_str_conversion_error (error);
+      return;
+    }
+
+  input_context->surrounding_requested = true;
+  input_context->server->statistics.surrounding_requests++;
+}
+
+/* Deletes CHARACTERS before the caret by committing as many BackSpace
+   keysyms, which Xlib hands to the client like key presses.  */
+static bool
+commit_backspaces (xim_wayland_input_context_t *input_context,
+                   size_t characters)
+{
+  xcb_generic_error_t *error;
+  size_t i;
+
+  for (i = 0; i < characters; i++)
+    {
+      error = NULL;
+      if (!xcb_xim_commit (input_context->server->xim,
+                           input_context->input_method->transport,
+                           input_context->input_method->id,
+                           input_context->id,
+                           XCB_XIM_COMMIT_FLAG_KEYSYM,
+                           0xff08, /* BackSpace */
+                           0,
+                           NULL,
+                           &error))
+        {
+          if (error)
+            {
+              fprintf (stderr, "can't commit keysym: %i\n",
+                       error->error_code);
+              free (error);
+            }
+          else
+            fprintf (stderr, "can't commit keysym\n");
+          return false;
+        }
+    }
+
+  input_context->server->statistics.surrounding_backspaces++;
+  return true;
+}
+
+/* Does the deletion requested by the compositor in the client, by
+   substituting the characters before the caret with nothing, or with
+   BackSpace if the client doesn't apply substitutions.  Only
+   deletions which end at the caret are possible, and only if the
+   surrounding text is known, since XIM counts characters while
+   Wayland counts bytes.  Returns true if the surrounding text
+   changed.  */
+static bool
+delete_surrounding_text (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+  xim_wayland_client_t *client = input_method->client;
+  size_t length = input_context->surrounding_length;
+  size_t start, characters, i;
+  xcb_generic_error_t *error;
+
+  if (!input_context->delete_pending)
+    return false;
+  input_context->delete_pending = false;
+
+  if (!input_context->surrounding_valid
+      || input_context->delete_index >= 0
+      || (size_t) -(int64_t) input_context->delete_index > length
+      || (int64_t) input_context->delete_index
+         + input_context->delete_length != 0)
+    return false;
+
+  start = length + input_context->delete_index;
+  characters = 0;
+  for (i = start; i < length; i++)
+    if ((input_context->surrounding_text[i] & 0xc0) != 0x80)
+      characters++;
+
+  if (!client || !client->str_conversion_supported
+      || client->ignores_substitution)
+    {
+      if (!commit_backspaces (input_context, characters))
+        return false;
+      input_context->server->statistics.surrounding_deletions++;
+      return splice_surrounding_text (input_context, start, "", 0);
+    }
+
+  error = NULL;
+  if (!xcb_xim_str_conversion (input_context->server->xim,
+                               input_method->transport,
+                               input_method->id,
+                               input_context->id,
+                               0,
+                               XCB_XIM_CARET_DIRECTION_BACKWARD_CHAR,
+                               characters,
+                               XCB_XIM_STRING_CONVERSION_SUBSTITUTION,
+                               0,
+                               &error))
+    {
+      print_str_conversion_error (error);
+      return false;
+    }
+
+  input_context->substitutions++;
+  input_context->server->statistics.surrounding_deletions++;
+  return splice_surrounding_text (input_context, start, "", 0);
+}
+
+static void
+handle_wayland_commit_string (void *data,
+                              struct wl_text_input *wl_text_input,
+                              uint32_t serial,
+                              const char *text)
+{
+  xim_wayland_input_context_t *input_context = data;
+  xcb_generic_error_t *error;
+  bool changed;
+
+  error = NULL;
+  if (!update_preedit_string (input_context, "", &error))
+    {
+      if (error)
+        {
+          fprintf (stderr, "can't clear preedit: %i\n",
+                   error->error_code);
+          free (error);
+        }
+      else
+        fprintf (stderr, "can't clear preedit\n");
+    }
+
+  changed = delete_surrounding_text (input_context);
+
+  error = NULL;
+  if (!xcb_xim_commit (input_context->server->xim,
+                       input_context->input_method->transport,
+                       input_context->input_method->id,
+                       input_context->id,
+                       XCB_XIM_COMMIT_FLAG_KEYSYM | XCB_XIM_COMMIT_FLAG_STRING,
+                       0xffffff,
+                       strlen (text),
+                       (const uint8_t *) text,
+                       &error))
+    {
+      if (error)
+        {
+          fprintf (stderr, "can't commit string: %i\n",
+                   error->error_code);
+          free (error);
+        }
+      else
+        fprintf (stderr, "can't commit string\n");
+      send_surrounding_text (input_context, changed);
+      return;
+    }
+
+  if (input_context->surrounding_valid
+      && splice_surrounding_text (input_context,
+                                  input_context->surrounding_length,
+                                  text,
+                                  strlen (text)))
+    changed = true;
+
+  send_surrounding_text (input_context, changed);
+}
+
+/* XIM has no way to move the caret of the client, which stays after
+   the committed text.  */
+static void
 handle_wayland_cursor_position (void *data,
                                 struct wl_text_input *wl_text_input,
                                 int32_t index,
@@ -435,6 +1482,11 @@ handle_wayland_delete_surrounding_text (void *data,
                                         int32_t index,
                                         uint32_t length)
 {
+  xim_wayland_input_context_t *input_context = data;
+
+  input_context->delete_pending = true;
+  input_context->delete_index = index;
+  input_context->delete_length = length;
 }
 
 static void
@@ -456,7 +1508,7 @@ handle_wayland_keysym (void *data,
     return;
 
   error = NULL;
-  if (!xcb_xim_commit (input_context->xw->xim,
+  if (!xcb_xim_commit (input_context->server->xim,
                        input_context->input_method->transport,
                        input_context->input_method->id,
                        input_context->id,
@@ -477,12 +1529,183 @@ handle_wayland_keysym (void *data,
     }
 }
 
+static bool
+has_status_callbacks (xim_wayland_input_context_t *input_context)
+{
+  xcb_xim_transport_t *transport = input_context->input_method->transport;
+  uint32_t input_style;
+
+  if (!input_context->attrs[INPUT_STYLE])
+    return false;
+
+  input_style =
+    xcb_xim_card32 (transport,
+                    *(uint32_t *) (input_context->attrs[INPUT_STYLE] + 1));
+  return (input_style & XCB_XIM_STATUS_CALLBACKS) != 0;
+}
+
+/* Draws the language, followed by the text direction if the compositor
+   forces one, in the status area of the client.  Nothing is sent if
+   the client already shows the same status.  */
+static bool
+draw_status (xim_wayland_input_context_t *input_context,
+             xcb_generic_error_t **error)
+{
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+  xim_wayland_server_t *server = input_context->server;
+  const char *language, *direction;
+  char *status;
+  size_t length;
+
+  if (!has_status_callbacks (input_context))
+    return true;
+
+  language = input_context->language ? input_context->language : "";
+  switch (input_context->text_direction)
+    {
+    case WL_TEXT_INPUT_TEXT_DIRECTION_LTR:
+      direction = "LTR";
+      break;
+
+    case WL_TEXT_INPUT_TEXT_DIRECTION_RTL:
+      direction = "RTL";
+      break;
+
+    default:
+      direction = "";
+      break;
+    }
+
+  length = strlen (language) + 1 + strlen (direction);
+  if (length > UINT16_MAX)
+    return false;
+
+  status = malloc (length + 1);
+  if (!status)
+    return false;
+  snprintf (status, length + 1, "%s%s%s",
+            language, *language && *direction ? " " : "", direction);
+  length = strlen (status);
+
+  if (input_context->status_started && input_context->status_string
+      && strcmp (input_context->status_string, status) == 0)
+    {
+      server->statistics.status_draws_skipped++;
+      free (status);
+      return true;
+    }
+
+  if (!input_context->status_started)
+    {
+      if (!xcb_xim_status_start (server->xim,
+                                 input_method->transport,
+                                 input_method->id,
+                                 input_context->id,
+                                 error))
+        {
+          free (status);
+          return false;
+        }
+      input_context->status_started = true;
+    }
+
+  if (!xcb_xim_status_draw (server->xim,
+                            input_method->transport,
+                            input_method->id,
+                            input_context->id,
+                            0,
+                            0,
+                            length,
+                            (const uint8_t *) status,
+                            0,
+                            NULL,
+                            0,
+                            error))
+    {
+      free (status);
+      return false;
+    }
+
+  free (input_context->status_string);
+  input_context->status_string = status;
+  server->statistics.status_draws++;
+  return true;
+}
+
+/* Ends the status area of the client, if it was started.  */
+static bool
+end_status (xim_wayland_input_context_t *input_context,
+            xcb_generic_error_t **error)
+{
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+
+  free (input_context->status_string);
+  input_context->status_string = NULL;
+
+  if (!input_context->status_started)
+    return true;
+  input_context->status_started = false;
+
+  return xcb_xim_status_done (input_context->server->xim,
+                              input_method->transport,
+                              input_method->id,
+                              input_context->id,
+                              error);
+}
+
+static void
+print_status_error (xcb_generic_error_t *error)
+{
+  if (error)
+    {
+      fprintf (stderr, "can't render status: %i\n", error->error_code);
+      free (error);
+    }
+  else
+    fprintf (stderr, "can't render status\n");
+}
+
+static void
+handle_wayland_input_panel_state (void *data,
+                                  struct wl_text_input *wl_text_input,
+                                  uint32_t state)
+{
+  xim_wayland_input_context_t *input_context = data;
+  xcb_generic_error_t *error;
+  bool success;
+
+  error = NULL;
+  if (state)
+    success = draw_status (input_context, &error);
+  else
+    success = end_status (input_context, &error);
+  if (!success)
+    print_status_error (error);
+}
+
 static void
 handle_wayland_language (void *data,
                          struct wl_text_input *wl_text_input,
                          uint32_t serial,
                          const char *language)
 {
+  xim_wayland_input_context_t *input_context = data;
+  xcb_generic_error_t *error;
+
+  if (!input_context->language
+      || strcmp (input_context->language, language) != 0)
+    {
+      char *copy = strdup (language);
+
+      if (!copy)
+        return;
+      free (input_context->language);
+      input_context->language = copy;
+    }
+
+  error = NULL;
+  if (!draw_status (input_context, &error))
+    print_status_error (error);
 }
 
 static void
@@ -491,6 +1714,14 @@ handle_wayland_text_direction (void *data,
                                uint32_t serial,
                                uint32_t direction)
 {
+  xim_wayland_input_context_t *input_context = data;
+  xcb_generic_error_t *error;
+
+  input_context->text_direction = direction;
+
+  error = NULL;
+  if (!draw_status (input_context, &error))
+    print_status_error (error);
 }
 
 static const struct wl_text_input_listener
@@ -512,912 +1743,4121 @@ text_input_listener =
   };
 
 static void
-init_im_attributes (xim_wayland_input_method_t *input_method)
+free_message (xim_wayland_message_t *message)
 {
-  uint32_t value[] =
+  free (message->strings[0]);
+  free (message->strings[1]);
+  wl_array_release (&message->array);
+}
+
+static void
+flush_x_overflow (xim_wayland_server_t *server)
+{
+  /* Set before trying, so that the X thread either made room already
+     or sees the flag once it does.  */
+  atomic_store (&server->x_overflowing, true);
+
+  while (server->x_overflow
+         && xim_wayland_queue_push (server->to_x,
+                                    &server->x_overflow->message))
     {
-      XCB_XIM_PREEDIT_CALLBACKS | XCB_XIM_STATUS_CALLBACKS,
-      XCB_XIM_PREEDIT_CALLBACKS | XCB_XIM_STATUS_NOTHING,
-      XCB_XIM_PREEDIT_NOTHING | XCB_XIM_STATUS_NOTHING
-    };
+      struct xim_wayland_overflow_t *next = server->x_overflow->next;
 
-  input_method->specs[QUERY_INPUT_STYLE] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                QUERY_INPUT_STYLE,
-                                XCB_XIM_TYPE_XIMSTYLES,
-                                strlen ("queryInputStyle"),
-                                "queryInputStyle");
+      free (server->x_overflow);
+      server->x_overflow = next;
+      server->x_overflow_length--;
+    }
 
-  input_method->attrs[QUERY_INPUT_STYLE] =
-    xcb_xim_attribute_styles_new (input_method->transport,
-                                  QUERY_INPUT_STYLE,
-                                  SIZEOF (value),
-                                  value);
+  if (!server->x_overflow)
+    {
+      server->x_overflow_tail = NULL;
+      atomic_store (&server->x_overflowing, false);
+    }
+}
 
-  input_method->ic_specs[INPUT_STYLE] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                INPUT_STYLE,
-                                XCB_XIM_TYPE_CARD32,
-                                strlen ("inputStyle"),
-                                "inputStyle");
+/* Called in the Wayland thread.  Never waits, so that an X thread
+   which doesn't keep up doesn't stop the other displays; messages
+   which don't fit are sent later from prepare_wayland_thread.  */
+static void
+send_to_x (xim_wayland_server_t *server, xim_wayland_message_t *message)
+{
+  struct xim_wayland_overflow_t *overflow;
 
-  input_method->ic_specs[FILTER_EVENTS] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                FILTER_EVENTS,
-                                XCB_XIM_TYPE_CARD32,
-                                strlen ("filterEvents"),
-                                "filterEvents");
+  if (!server->x_overflow
+      && xim_wayland_queue_push (server->to_x, message))
+    return;
 
-  input_method->ic_specs[CLIENT_WINDOW] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                CLIENT_WINDOW,
-                                XCB_XIM_TYPE_WINDOW,
-                                strlen ("clientWindow"),
-                                "clientWindow");
+  if (message->type < MESSAGE_RETIRED
+      && server->x_overflow_length >= MESSAGE_OVERFLOW_LIMIT)
+    {
+      if (atomic_fetch_add (&server->dropped_events, 1) == 0)
+        fprintf (stderr, "X display %s doesn't keep up, dropping events; "
+                 "see the statistics for how many\n",
+                 server->name);
+      free_message (message);
+      return;
+    }
 
-  input_method->ic_specs[FOCUS_WINDOW] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                FOCUS_WINDOW,
-                                XCB_XIM_TYPE_WINDOW,
-                                strlen ("focusWindow"),
-                                "focusWindow");
+  overflow = malloc (sizeof (struct xim_wayland_overflow_t));
+  if (!overflow)
+    {
+      /* Leak the input context or seat rather than freeing them too
+         early.  */
+      fprintf (stderr, "can't send message to X thread\n");
+      free_message (message);
+      return;
+    }
 
-  input_method->ic_specs[PREEDIT_ATTRIBUTES] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                PREEDIT_ATTRIBUTES,
-                                XCB_XIM_TYPE_NEST,
-                                strlen ("preeditAttributes"),
-                                "preeditAttributes");
+  overflow->message = *message;
+  overflow->next = NULL;
+  if (server->x_overflow)
+    server->x_overflow_tail->next = overflow;
+  else
+    server->x_overflow = overflow;
+  server->x_overflow_tail = overflow;
+  server->x_overflow_length++;
 
-  input_method->ic_specs[STATUS_ATTRIBUTES] =
-    xcb_xim_attribute_spec_new (input_method->transport,
-                                STATUS_ATTRIBUTES,
-                                XCB_XIM_TYPE_NEST,
-                                strlen ("statusAttributes"),
-                                "statusAttributes");
+  flush_x_overflow (server);
 }
 
+/* Called in an X thread.  Never waits, to avoid a deadlock with
+   the Wayland thread; messages which don't fit are sent later from
+   the loop.  */
 static void
-init_ic_attributes (xim_wayland_input_context_t *input_context)
+send_to_wayland (xim_wayland_server_t *server, xim_wayland_message_t *message)
 {
-  xcb_xim_transport_t *transport = input_context->input_method->transport;
+  struct xim_wayland_overflow_t *overflow;
 
-  input_context->attrs[INPUT_STYLE] =
-    xcb_xim_attribute_card32_new (transport,
-                                  INPUT_STYLE,
-                                  XCB_XIM_PREEDIT_CALLBACKS
-                                  | XCB_XIM_STATUS_CALLBACKS);
+  if (!server->overflow
+      && xim_wayland_queue_push (server->to_wayland, message))
+    return;
 
-  input_context->attrs[FILTER_EVENTS] =
-    xcb_xim_attribute_card32_new (transport,
-                                  FILTER_EVENTS,
-                                  0);
+  /* A pending flush or drain request is enough.  */
+  if ((message->type == MESSAGE_FLUSH || message->type == MESSAGE_DRAIN)
+      && server->overflow)
+    return;
 
-  input_context->attrs[CLIENT_WINDOW] =
-    xcb_xim_attribute_card32_new (transport,
-                                  CLIENT_WINDOW,
-                                  0);
+  overflow = malloc (sizeof (struct xim_wayland_overflow_t));
+  if (!overflow)
+    {
+      /* Leak the input context rather than freeing it too early.  */
+      fprintf (stderr, "can't send message to Wayland thread\n");
+      return;
+    }
 
-  input_context->attrs[FOCUS_WINDOW] =
-    xcb_xim_attribute_card32_new (transport,
-                                  FOCUS_WINDOW,
-                                  0);
+  overflow->message = *message;
+  overflow->next = NULL;
+  if (server->overflow)
+    server->overflow_tail->next = overflow;
+  else
+    server->overflow = overflow;
+  server->overflow_tail = overflow;
 }
 
-static xim_wayland_input_context_t *
-xim_wayland_input_context_new (xim_wayland_t *xw,
-                               xim_wayland_input_method_t *input_method,
-                               uint16_t id)
+static void
+flush_overflow (xim_wayland_server_t *server)
 {
-  xim_wayland_input_context_t *input_context;
+  while (server->overflow
+         && xim_wayland_queue_push (server->to_wayland,
+                                    &server->overflow->message))
+    {
+      struct xim_wayland_overflow_t *next = server->overflow->next;
 
-  input_context = calloc (1, sizeof (xim_wayland_input_context_t));
-  if (!input_context)
-    return NULL;
+      free (server->overflow);
+      server->overflow = next;
+    }
 
-  input_context->xw = xw;
-  input_context->text_input =
-    wl_text_input_manager_create_text_input (xw->text_input_manager);
-  if (!input_context->text_input)
+  if (!server->overflow)
+    server->overflow_tail = NULL;
+}
+
+static void
+relay_event (void *data,
+             struct wl_text_input *wl_text_input,
+             xim_wayland_message_t *message)
+{
+  xim_wayland_input_context_t *input_context = data;
+
+  message->input_context = input_context;
+  message->text_input = wl_text_input;
+  message->generation = atomic_load (&input_context->generation);
+  send_to_x (input_context->server, message);
+}
+
+static void
+relay_enter (void *data,
+             struct wl_text_input *wl_text_input,
+             struct wl_surface *surface)
+{
+  xim_wayland_message_t message;
+
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_ENTER;
+  message.object = surface;
+  relay_event (data, wl_text_input, &message);
+}
+
+static void
+relay_leave (void *data,
+             struct wl_text_input *wl_text_input)
+{
+  xim_wayland_message_t message;
+
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_LEAVE;
+  relay_event (data, wl_text_input, &message);
+}
+
+static void
+relay_modifiers_map (void *data,
+                     struct wl_text_input *wl_text_input,
+                     struct wl_array *map)
+{
+  xim_wayland_message_t message;
+
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_MODIFIERS_MAP;
+  wl_array_init (&message.array);
+  if (wl_array_copy (&message.array, map) < 0)
     {
-      free (input_context);
-      return NULL;
+      wl_array_release (&message.array);
+      return;
     }
+  relay_event (data, wl_text_input, &message);
+}
 
-  wl_text_input_add_listener (input_context->text_input,
-                              &text_input_listener, input_context);
+static void
+relay_input_panel_state (void *data,
+                         struct wl_text_input *wl_text_input,
+                         uint32_t state)
+{
+  xim_wayland_message_t message;
 
-  input_context->surface =
-    wl_compositor_create_surface (xw->compositor);
-  if (!input_context->surface)
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_INPUT_PANEL_STATE;
+  message.args[0] = state;
+  relay_event (data, wl_text_input, &message);
+}
+
+static void
+relay_preedit_string (void *data,
+                      struct wl_text_input *wl_text_input,
+                      uint32_t serial,
+                      const char *text,
+                      const char *commit)
+{
+  xim_wayland_message_t message;
+
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_PREEDIT_STRING;
+  message.args[0] = serial;
+  message.strings[0] = strdup (text);
+  message.strings[1] = strdup (commit);
+  if (!message.strings[0] || !message.strings[1])
     {
-      wl_text_input_destroy (input_context->text_input);
-      free (input_context);
-      return NULL;
+      free_message (&message);
+      return;
     }
+  relay_event (data, wl_text_input, &message);
+}
 
-  input_context->id = id;
-  input_context->input_method = input_method;
-  wl_list_init (&input_context->preedit_styling_list);
+static void
+relay_preedit_styling (void *data,
+                       struct wl_text_input *wl_text_input,
+                       uint32_t index,
+                       uint32_t length,
+                       uint32_t style)
+{
+  xim_wayland_message_t message;
+
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_PREEDIT_STYLING;
+  message.args[0] = index;
+  message.args[1] = length;
+  message.args[2] = style;
+  relay_event (data, wl_text_input, &message);
+}
 
-  init_ic_attributes (input_context);
+static void
+relay_preedit_cursor (void *data,
+                      struct wl_text_input *wl_text_input,
+                      int32_t index)
+{
+  xim_wayland_message_t message;
 
-  return input_context;
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_PREEDIT_CURSOR;
+  message.args[0] = index;
+  relay_event (data, wl_text_input, &message);
 }
 
 static void
-xim_wayland_input_context_free (xim_wayland_input_context_t *input_context)
+relay_commit_string (void *data,
+                     struct wl_text_input *wl_text_input,
+                     uint32_t serial,
+                     const char *text)
 {
-  int i;
+  xim_wayland_message_t message;
 
-  for (i = 0; i < SIZEOF (input_context->attrs); i++)
-    free (input_context->attrs[i]);
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_COMMIT_STRING;
+  message.args[0] = serial;
+  message.strings[0] = strdup (text);
+  if (!message.strings[0])
+    return;
+  relay_event (data, wl_text_input, &message);
+}
 
-  wl_text_input_destroy (input_context->text_input);
-  wl_surface_destroy (input_context->surface);
+static void
+relay_cursor_position (void *data,
+                       struct wl_text_input *wl_text_input,
+                       int32_t index,
+                       int32_t anchor)
+{
+  xim_wayland_message_t message;
 
-  free (input_context);
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_CURSOR_POSITION;
+  message.args[0] = index;
+  message.args[1] = anchor;
+  relay_event (data, wl_text_input, &message);
 }
 
-static xim_wayland_input_method_t *
-xim_wayland_input_method_new (xcb_xim_transport_t *transport,
-                              uint16_t id)
+static void
+relay_delete_surrounding_text (void *data,
+                               struct wl_text_input *wl_text_input,
+                               int32_t index,
+                               uint32_t length)
 {
-  xim_wayland_input_method_t *input_method;
-
-  input_method = calloc (1, sizeof (xim_wayland_input_method_t));
-  if (!input_method)
-    return NULL;
+  xim_wayland_message_t message;
 
-  input_method->transport = transport;
-  input_method->id = id;
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_DELETE_SURROUNDING_TEXT;
+  message.args[0] = index;
+  message.args[1] = length;
+  relay_event (data, wl_text_input, &message);
+}
 
-  init_im_attributes (input_method);
+static void
+relay_keysym (void *data,
+              struct wl_text_input *wl_text_input,
+              uint32_t serial,
+              uint32_t time,
+              uint32_t sym,
+              uint32_t state,
+              uint32_t modifiers)
+{
+  xim_wayland_message_t message;
+
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_KEYSYM;
+  message.args[0] = serial;
+  message.args[1] = time;
+  message.args[2] = sym;
+  message.args[3] = state;
+  message.args[4] = modifiers;
+  relay_event (data, wl_text_input, &message);
+}
 
-  wl_list_init (&input_method->input_context_list);
+static void
+relay_language (void *data,
+                struct wl_text_input *wl_text_input,
+                uint32_t serial,
+                const char *language)
+{
+  xim_wayland_message_t message;
 
-  return input_method;
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_LANGUAGE;
+  message.args[0] = serial;
+  message.strings[0] = strdup (language);
+  if (!message.strings[0])
+    return;
+  relay_event (data, wl_text_input, &message);
 }
 
 static void
-xim_wayland_input_method_free (xim_wayland_input_method_t *input_method)
+relay_text_direction (void *data,
+                      struct wl_text_input *wl_text_input,
+                      uint32_t serial,
+                      uint32_t direction)
 {
-  xim_wayland_input_context_t *input_context, *next;
-  int i;
+  xim_wayland_message_t message;
 
-  wl_list_for_each_safe (input_context, next,
-                         &input_method->input_context_list, link)
-    {
-      wl_list_remove (&input_context->link);
-      xim_wayland_input_context_free (input_context);
-    }
+  memset (&message, 0, sizeof (message));
+  message.type = MESSAGE_TEXT_DIRECTION;
+  message.args[0] = serial;
+  message.args[1] = direction;
+  relay_event (data, wl_text_input, &message);
+}
 
-  for (i = 0; i < SIZEOF (input_method->attrs); i++)
-    free (input_method->attrs[i]);
+static const struct wl_text_input_listener
+text_input_relay_listener =
+  {
+    relay_enter,
+    relay_leave,
+    relay_modifiers_map,
+    relay_input_panel_state,
+    relay_preedit_string,
+    relay_preedit_styling,
+    relay_preedit_cursor,
+    relay_commit_string,
+    relay_cursor_position,
+    relay_delete_surrounding_text,
+    relay_keysym,
+    relay_language,
+    relay_text_direction,
+  };
+
+/* Chooses the seat of the clients of SERVER: the seat named with
+   --display if present, otherwise the first one.  */
+static xim_wayland_server_seat_t *
+choose_seat (xim_wayland_server_t *server)
+{
+  xim_wayland_server_seat_t *server_seat;
 
-  for (i = 0; i < SIZEOF (input_method->specs); i++)
-    free (input_method->specs[i]);
+  if (wl_list_empty (&server->seat_list))
+    return NULL;
 
-  for (i = 0; i < SIZEOF (input_method->ic_specs); i++)
-    free (input_method->ic_specs[i]);
+  if (server->seat_name)
+    wl_list_for_each (server_seat, &server->seat_list, link)
+      {
+        if (server_seat->seat->name
+            && strcmp (server_seat->seat->name, server->seat_name) == 0)
+          return server_seat;
+      }
 
-  free (input_method);
+  return wl_container_of (server->seat_list.next, server_seat, link);
 }
 
-static xim_wayland_input_context_t *
-find_input_context (xim_wayland_input_method_t *input_method, uint16_t id)
+/* Moves the focused input contexts of INPUT_METHOD to another seat.
+   The text inputs themselves are not tied to a seat, so the client
+   doesn't notice.  */
+static void
+move_input_method (xim_wayland_input_method_t *input_method,
+                   xim_wayland_server_seat_t *server_seat)
 {
   xim_wayland_input_context_t *input_context;
 
   wl_list_for_each (input_context, &input_method->input_context_list, link)
     {
-      if (input_context->id == id)
-        return input_context;
-    }
+      if (!input_context->focused || !input_context->text_input)
+        continue;
 
-  return NULL;
-}
+      if (input_method->seat)
+        {
+          if (input_method->seat->focused_input_context == input_context)
+            input_method->seat->focused_input_context = NULL;
 
-static xim_wayland_input_method_t *
-find_input_method (xim_wayland_t *xw,
-                   xcb_xim_transport_t *transport,
-                   uint16_t id)
-{
-  xim_wayland_input_method_t *input_method;
+          wl_text_input_deactivate (input_context->text_input,
+                                    input_method->seat->seat->wl_seat);
+        }
 
-  wl_list_for_each (input_method, &xw->input_method_list, link)
-    {
-      if (input_method->transport == transport && input_method->id == id)
-        return input_method;
+      if (server_seat)
+        {
+          server_seat->focused_input_context = input_context;
+
+          wl_text_input_show_input_panel (input_context->text_input);
+          wl_text_input_activate (input_context->text_input,
+                                  server_seat->seat->wl_seat,
+                                  input_context->surface);
+        }
     }
 
-  return NULL;
+  input_method->seat = server_seat;
 }
 
+/* Called in the thread of SERVER.  */
 static bool
-handle_xim_open_request (xim_wayland_t *xw,
-                         xcb_xim_generic_request_t *request,
-                         xcb_xim_transport_t *requestor,
-                         xcb_generic_error_t **error)
+server_add_seat (xim_wayland_server_t *server, xim_wayland_seat_t *seat)
 {
+  xim_wayland_server_seat_t *server_seat;
   xim_wayland_input_method_t *input_method;
-  bool success;
 
-  input_method = xim_wayland_input_method_new (requestor,
-                                               ++xw->input_method_counter);
-  if (!input_method)
+  server_seat = calloc (1, sizeof (xim_wayland_server_seat_t));
+  if (!server_seat)
     return false;
 
-  success = xcb_xim_open_reply (xw->xim,
-                                requestor,
-                                input_method->id,
-                                LAST_IM_ATTRIBUTE,
-                                input_method->specs,
-                                LAST_IC_ATTRIBUTE,
-                                input_method->ic_specs,
-                                error);
+  server_seat->seat = seat;
+  wl_list_insert (server->seat_list.prev, &server_seat->link);
 
-  if (!success)
-    {
-      xim_wayland_input_method_free (input_method);
-      return false;
-    }
+  /* Clients without a seat, or preferring the new one, move to it.  */
+  server_seat = choose_seat (server);
+  wl_list_for_each (input_method, &server->input_method_list, link)
+    if (input_method->seat != server_seat)
+      move_input_method (input_method, server_seat);
 
-  wl_list_insert (&xw->input_method_list, &input_method->link);
-  return success;
+  return true;
 }
 
+/* Called in the thread of SERVER.  Returns false if SERVER doesn't
+   reference SEAT.  */
 static bool
-handle_xim_close_request (xim_wayland_t *xw,
-                          xcb_xim_generic_request_t *request,
-                          xcb_xim_transport_t *requestor,
-                          xcb_generic_error_t **error)
+server_remove_seat (xim_wayland_server_t *server, xim_wayland_seat_t *seat)
 {
-  xcb_xim_close_request_t *_close = (xcb_xim_close_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _close->input_method_id);
+  xim_wayland_server_seat_t *server_seat, *replacement;
   xim_wayland_input_method_t *input_method;
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  wl_list_for_each (server_seat, &server->seat_list, link)
+    if (server_seat->seat == seat)
+      break;
 
-  wl_list_remove (&input_method->link);
-  xim_wayland_input_method_free (input_method);
+  if (&server_seat->link == &server->seat_list)
+    return false;
 
-  return xcb_xim_close_reply (xw->xim,
-                              requestor,
-                              input_method_id,
-                              error);
-}
+  wl_list_remove (&server_seat->link);
 
-static bool
-handle_xim_query_extension_request (xim_wayland_t *xw,
-                                    xcb_xim_generic_request_t *request,
-                                    xcb_xim_transport_t *requestor,
-                                    xcb_generic_error_t **error)
-{
-  xcb_xim_query_extension_request_t *_query_extension =
-    (xcb_xim_query_extension_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _query_extension->input_method_id);
+  replacement = choose_seat (server);
+  wl_list_for_each (input_method, &server->input_method_list, link)
+    if (input_method->seat == server_seat)
+      move_input_method (input_method, replacement);
 
-  return xcb_xim_query_extension_reply (xw->xim,
-                                        requestor,
-                                        input_method_id,
-                                        0,
-                                        NULL,
-                                        error);
+  free (server_seat);
+  return true;
 }
 
-static bool
-handle_xim_encoding_negotiation_request (xim_wayland_t *xw,
-                                         xcb_xim_generic_request_t *request,
-                                         xcb_xim_transport_t *requestor,
-                                         xcb_generic_error_t **error)
+/* Called in an X thread.  */
+static void
+handle_message (xim_wayland_server_t *server, xim_wayland_message_t *message)
 {
-  xcb_xim_str_iterator_t iterator;
-  xcb_xim_encoding_negotiation_request_t *_encoding_negotiation =
-    (xcb_xim_encoding_negotiation_request_t *) request;
-  uint16_t input_method_id =
-    xcb_xim_card16 (requestor,
-                    _encoding_negotiation->input_method_id);
+  xim_wayland_input_context_t *input_context = message->input_context;
+  struct wl_text_input *text_input = message->text_input;
 
-  /* FIXME: only support UTF-8 at the moment */
-  iterator =
-    xcb_xim_encoding_negotiation_request_encoding_iterator (_encoding_negotiation);
-  while (xcb_xim_str_iterator_has_data (&iterator))
+  switch (message->type)
     {
-      xcb_xim_str_t *str = iterator.data;
+    case MESSAGE_RETIRED:
+      free (input_context);
+      return;
 
-      if (strncmp ((const char *) (str + 1), "UTF-8", str->length) == 0)
-        break;
-      xcb_xim_str_iterator_next (&iterator);
+    case MESSAGE_SEAT_ADDED:
+      if (!server_add_seat (server, message->object))
+        {
+          message->type = MESSAGE_SEAT_RELEASED;
+          send_to_wayland (server, message);
+        }
+      return;
+
+    case MESSAGE_SEAT_REMOVED:
+      if (server_remove_seat (server, message->object))
+        {
+          message->type = MESSAGE_SEAT_RELEASED;
+          send_to_wayland (server, message);
+        }
+      return;
+
+    case MESSAGE_PRINT_STATISTICS:
+      print_server_statistics (server, stderr);
+      return;
+
+    default:
+      break;
+    }
+
+  /* The input context is retired or its text input was released and
+     recreated since the event was sent.  The text input pointer alone
+     can't tell, as the new one may be allocated at the same address.  */
+  if (atomic_load (&input_context->generation) != message->generation)
+    {
+      free_message (message);
+      return;
+    }
+
+  switch (message->type)
+    {
+    case MESSAGE_ENTER:
+      handle_wayland_enter (input_context, text_input, message->object);
+      break;
+
+    case MESSAGE_LEAVE:
+      handle_wayland_leave (input_context, text_input);
+      break;
+
+    case MESSAGE_MODIFIERS_MAP:
+      handle_wayland_modifiers_map (input_context, text_input,
+                                    &message->array);
+      break;
+
+    case MESSAGE_INPUT_PANEL_STATE:
+      handle_wayland_input_panel_state (input_context, text_input,
+                                        message->args[0]);
+      break;
+
+    case MESSAGE_PREEDIT_STRING:
+      handle_wayland_preedit_string (input_context, text_input,
+                                     message->args[0],
+                                     message->strings[0],
+                                     message->strings[1]);
+      break;
+
+    case MESSAGE_PREEDIT_STYLING:
+      handle_wayland_preedit_styling (input_context, text_input,
+                                      message->args[0],
+                                      message->args[1],
+                                      message->args[2]);
+      break;
+
+    case MESSAGE_PREEDIT_CURSOR:
+      handle_wayland_preedit_cursor (input_context, text_input,
+                                     message->args[0]);
+      break;
+
+    case MESSAGE_COMMIT_STRING:
+      handle_wayland_commit_string (input_context, text_input,
+                                    message->args[0],
+                                    message->strings[0]);
+      break;
+
+    case MESSAGE_CURSOR_POSITION:
+      handle_wayland_cursor_position (input_context, text_input,
+                                      message->args[0],
+                                      message->args[1]);
+      break;
+
+    case MESSAGE_DELETE_SURROUNDING_TEXT:
+      handle_wayland_delete_surrounding_text (input_context, text_input,
+                                              message->args[0],
+                                              message->args[1]);
+      break;
+
+    case MESSAGE_KEYSYM:
+      handle_wayland_keysym (input_context, text_input,
+                             message->args[0],
+                             message->args[1],
+                             message->args[2],
+                             message->args[3],
+                             message->args[4]);
+      break;
+
+    case MESSAGE_LANGUAGE:
+      handle_wayland_language (input_context, text_input,
+                               message->args[0],
+                               message->strings[0]);
+      break;
+
+    case MESSAGE_TEXT_DIRECTION:
+      handle_wayland_text_direction (input_context, text_input,
+                                     message->args[0],
+                                     message->args[1]);
+      break;
+
+    default:
+      break;
+    }
+
+  free_message (message);
+}
+
+static bool
+init_handshake (xim_wayland_handshake_t *handshake, uint8_t endian)
+{
+  xcb_xim_transport_t transport;
+  xcb_xim_attribute_spec_t *specs[LAST_IM_ATTRIBUTE];
+  xcb_xim_attribute_spec_t *ic_specs[LAST_IC_ATTRIBUTE];
+  xcb_xim_attribute_t *query_input_style;
+  bool success;
+  int i;
+  uint32_t value[] =
+    {
+      XCB_XIM_PREEDIT_CALLBACKS | XCB_XIM_STATUS_CALLBACKS,
+      XCB_XIM_PREEDIT_CALLBACKS | XCB_XIM_STATUS_NOTHING,
+      XCB_XIM_PREEDIT_NOTHING | XCB_XIM_STATUS_NOTHING
+    };
+
+  /* Only the byte order matters for serialization.  */
+  memset (&transport, 0, sizeof (transport));
+  transport.endian = endian;
+
+  specs[QUERY_INPUT_STYLE] =
+    xcb_xim_attribute_spec_new (&transport,
+                                QUERY_INPUT_STYLE,
+                                XCB_XIM_TYPE_XIMSTYLES,
+                                strlen ("queryInputStyle"),
+                                "queryInputStyle");
+
+  handshake->attrs[QUERY_INPUT_STYLE] =
+    xcb_xim_attribute_styles_new (&transport,
+                                  QUERY_INPUT_STYLE,
+                                  SIZEOF (value),
+                                  value);
+
+  ic_specs[INPUT_STYLE] =
+    xcb_xim_attribute_spec_new (&transport,
+                                INPUT_STYLE,
+                                XCB_XIM_TYPE_CARD32,
+                                strlen ("inputStyle"),
+                                "inputStyle");
+
+  ic_specs[FILTER_EVENTS] =
+    xcb_xim_attribute_spec_new (&transport,
+                                FILTER_EVENTS,
+                                XCB_XIM_TYPE_CARD32,
+                                strlen ("filterEvents"),
+                                "filterEvents");
+
+  ic_specs[CLIENT_WINDOW] =
+    xcb_xim_attribute_spec_new (&transport,
+                                CLIENT_WINDOW,
+                                XCB_XIM_TYPE_WINDOW,
+                                strlen ("clientWindow"),
+                                "clientWindow");
+
+  ic_specs[FOCUS_WINDOW] =
+    xcb_xim_attribute_spec_new (&transport,
+                                FOCUS_WINDOW,
+                                XCB_XIM_TYPE_WINDOW,
+                                strlen ("focusWindow"),
+                                "focusWindow");
+
+  ic_specs[PREEDIT_ATTRIBUTES] =
+    xcb_xim_attribute_spec_new (&transport,
+                                PREEDIT_ATTRIBUTES,
+                                XCB_XIM_TYPE_NEST,
+                                strlen ("preeditAttributes"),
+                                "preeditAttributes");
+
+  ic_specs[STATUS_ATTRIBUTES] =
+    xcb_xim_attribute_spec_new (&transport,
+                                STATUS_ATTRIBUTES,
+                                XCB_XIM_TYPE_NEST,
+                                strlen ("statusAttributes"),
+                                "statusAttributes");
+
+  ic_specs[AREA] =
+    xcb_xim_attribute_spec_new (&transport,
+                                AREA,
+                                XCB_XIM_TYPE_XRECTANGLE,
+                                strlen ("area"),
+                                "area");
+
+  ic_specs[SPOT_LOCATION] =
+    xcb_xim_attribute_spec_new (&transport,
+                                SPOT_LOCATION,
+                                XCB_XIM_TYPE_XPOINT,
+                                strlen ("spotLocation"),
+                                "spotLocation");
+
+  ic_specs[FONT_SET] =
+    xcb_xim_attribute_spec_new (&transport,
+                                FONT_SET,
+                                XCB_XIM_TYPE_XFONTSET,
+                                strlen ("fontSet"),
+                                "fontSet");
+
+  for (i = 0; i < LAST_EXTENSION; i++)
+    handshake->extensions[i] =
+      xcb_xim_extension_new (&transport,
+                             XCB_XIM_EXTENSION,
+                             extension_infos[i].minor_opcode,
+                             strlen (extension_infos[i].name),
+                             extension_infos[i].name);
+
+  success = handshake->attrs[QUERY_INPUT_STYLE] != NULL;
+  for (i = 0; i < SIZEOF (handshake->extensions); i++)
+    if (!handshake->extensions[i])
+      success = false;
+  for (i = 0; i < SIZEOF (specs); i++)
+    if (!specs[i])
+      success = false;
+  for (i = 0; i < SIZEOF (ic_specs); i++)
+    if (!ic_specs[i])
+      success = false;
+
+  if (success)
+    {
+      handshake->open_reply =
+        xcb_xim_open_reply_new (&transport,
+                                LAST_IM_ATTRIBUTE,
+                                specs,
+                                LAST_IC_ATTRIBUTE,
+                                ic_specs);
+
+      /* For clients which query no extension in particular.  */
+      handshake->query_extension_reply =
+        xcb_xim_query_extension_reply_new (&transport,
+                                           LAST_EXTENSION,
+                                           handshake->extensions);
+
+      /* Reply to XIM_GET_IM_VALUES, as sent by XOpenIM.  */
+      query_input_style = handshake->attrs[QUERY_INPUT_STYLE];
+      handshake->query_input_style_reply =
+        xcb_xim_get_im_values_reply_new (&transport,
+                                         1,
+                                         &query_input_style);
+
+      success = handshake->open_reply != NULL
+        && handshake->query_extension_reply != NULL
+        && handshake->query_input_style_reply != NULL;
+    }
+
+  /* The specs are only needed to serialize XIM_OPEN_REPLY.  */
+  for (i = 0; i < SIZEOF (specs); i++)
+    free (specs[i]);
+  for (i = 0; i < SIZEOF (ic_specs); i++)
+    free (ic_specs[i]);
+
+  return success;
+}
+
+static void
+free_handshake (xim_wayland_handshake_t *handshake)
+{
+  int i;
+
+  for (i = 0; i < SIZEOF (handshake->attrs); i++)
+    free (handshake->attrs[i]);
+  for (i = 0; i < SIZEOF (handshake->extensions); i++)
+    free (handshake->extensions[i]);
+
+  free (handshake->open_reply);
+  free (handshake->query_extension_reply);
+  free (handshake->query_input_style_reply);
+}
+
+static xim_wayland_handshake_t *
+get_handshake (xim_wayland_t *xw, xcb_xim_transport_t *transport)
+{
+  return &xw->handshakes[transport->endian == 'B' ? 1 : 0];
+}
+
+static void
+init_ic_attributes (xim_wayland_input_context_t *input_context)
+{
+  xcb_xim_transport_t *transport = input_context->input_method->transport;
+
+  input_context->attrs[INPUT_STYLE] =
+    xcb_xim_attribute_card32_new (transport,
+                                  INPUT_STYLE,
+                                  XCB_XIM_PREEDIT_CALLBACKS
+                                  | XCB_XIM_STATUS_CALLBACKS);
+
+  input_context->attrs[FILTER_EVENTS] =
+    xcb_xim_attribute_card32_new (transport,
+                                  FILTER_EVENTS,
+                                  FORWARD_EVENT_MASK);
+
+  input_context->attrs[CLIENT_WINDOW] =
+    xcb_xim_attribute_card32_new (transport,
+                                  CLIENT_WINDOW,
+                                  0);
+
+  input_context->attrs[FOCUS_WINDOW] =
+    xcb_xim_attribute_card32_new (transport,
+                                  FOCUS_WINDOW,
+                                  0);
+}
+
+static void
+free_nested_attributes (xim_wayland_nested_attributes_t *nested)
+{
+  free (nested->font_set);
+  nested->font_set = NULL;
+
+  free (nested->encoded);
+  nested->encoded = NULL;
+}
+
+static void
+set_spot_location (xim_wayland_nested_attributes_t *nested,
+                   const xcb_point_t *spot_location)
+{
+  nested->mask |= NESTED_SPOT_LOCATION;
+  if (memcmp (&nested->spot_location, spot_location,
+              sizeof (xcb_point_t)) != 0)
+    {
+      nested->spot_location = *spot_location;
+      nested->dirty |= NESTED_SPOT_LOCATION;
+    }
+}
+
+static void
+set_nested_values (xcb_xim_transport_t *transport,
+                   xim_wayland_nested_attributes_t *nested,
+                   xcb_xim_attribute_t *attribute)
+{
+  xcb_xim_attribute_iterator_t iterator;
+
+  for (iterator = xcb_xim_attribute_nested_list_iterator (transport,
+                                                          attribute);
+       xcb_xim_attribute_iterator_has_data (&iterator);
+       xcb_xim_attribute_iterator_next (&iterator))
+    {
+      xcb_xim_attribute_t *value = iterator.data;
+      uint16_t attribute_id = xcb_xim_card16 (transport,
+                                              value->attribute_id);
+
+      switch (attribute_id)
+        {
+        case AREA:
+          {
+            xcb_rectangle_t area;
+
+            if (!xcb_xim_attribute_get_rectangle (transport, value, &area))
+              break;
+
+            nested->mask |= NESTED_AREA;
+            if (memcmp (&nested->area, &area, sizeof (area)) != 0)
+              {
+                nested->area = area;
+                nested->dirty |= NESTED_AREA;
+              }
+          }
+          break;
+
+        case SPOT_LOCATION:
+          {
+            xcb_point_t spot_location;
+
+            if (!xcb_xim_attribute_get_point (transport, value,
+                                              &spot_location))
+              break;
+
+            set_spot_location (nested, &spot_location);
+          }
+          break;
+
+        case FONT_SET:
+          {
+            const char *font_set;
+            uint16_t font_set_length;
+
+            if (!xcb_xim_attribute_get_font_set (transport, value,
+                                                 &font_set_length,
+                                                 &font_set))
+              break;
+
+            nested->mask |= NESTED_FONT_SET;
+            if (!nested->font_set
+                || strlen (nested->font_set) != font_set_length
+                || strncmp (nested->font_set, font_set, font_set_length) != 0)
+              {
+                free (nested->font_set);
+                nested->font_set = strndup (font_set, font_set_length);
+                nested->dirty |= NESTED_FONT_SET;
+              }
+          }
+          break;
+
+        default:
+          /* Ignore sub-attributes we don't advertise.  */
+          break;
+        }
+    }
+}
+
+static xcb_xim_attribute_t *
+get_nested_value (xcb_xim_transport_t *transport,
+                  xim_wayland_nested_attributes_t *nested)
+{
+  const xcb_xim_attribute_t *values[3];
+  uint16_t values_length;
+  int i;
+
+  if (nested->encoded && !nested->dirty)
+    return nested->encoded;
+
+  values_length = 0;
+
+  if ((nested->mask & NESTED_AREA) != 0)
+    values[values_length++] =
+      xcb_xim_attribute_rectangle_new (transport, AREA, &nested->area);
+
+  if ((nested->mask & NESTED_SPOT_LOCATION) != 0)
+    values[values_length++] =
+      xcb_xim_attribute_point_new (transport, SPOT_LOCATION,
+                                   &nested->spot_location);
+
+  if ((nested->mask & NESTED_FONT_SET) != 0 && nested->font_set)
+    values[values_length++] =
+      xcb_xim_attribute_font_set_new (transport, FONT_SET,
+                                      strlen (nested->font_set),
+                                      nested->font_set);
+
+  free (nested->encoded);
+  nested->encoded = NULL;
+
+  for (i = 0; i < values_length; i++)
+    if (!values[i])
+      break;
+
+  if (i == values_length)
+    {
+      nested->encoded =
+        xcb_xim_attribute_nested_list_new (transport,
+                                           nested->attribute_id,
+                                           values_length,
+                                           values);
+      if (nested->encoded)
+        nested->dirty = 0;
+    }
+
+  for (i = 0; i < values_length; i++)
+    free ((xcb_xim_attribute_t *) values[i]);
+
+  return nested->encoded;
+}
+
+/* Creates the Wayland objects of an input context, which are released
+   while the input context is idle.  */
+static bool
+materialize_input_context (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_t *xw = input_context->server->xw;
+
+  if (input_context->text_input)
+    return true;
+
+  input_context->text_input =
+    wl_text_input_manager_create_text_input (xw->text_input_manager);
+  if (!input_context->text_input)
+    return false;
+
+  wl_text_input_add_listener (input_context->text_input,
+                              xw->threaded
+                              ? &text_input_relay_listener
+                              : &text_input_listener,
+                              input_context);
+
+  input_context->surface =
+    wl_compositor_create_surface (xw->compositor);
+  if (!input_context->surface)
+    {
+      wl_text_input_destroy (input_context->text_input);
+      input_context->text_input = NULL;
+      return false;
+    }
+
+  /* The new text input knows nothing about the cursor.  */
+  input_context->cursor_sent = false;
+  input_context->surrounding_sent = false;
+
+  return true;
+}
+
+static xim_wayland_input_context_t *
+xim_wayland_input_context_new (xim_wayland_server_t *server,
+                               xim_wayland_input_method_t *input_method,
+                               uint16_t id)
+{
+  xim_wayland_input_context_t *input_context;
+
+  input_context = calloc (1, sizeof (xim_wayland_input_context_t));
+  if (!input_context)
+    return NULL;
+
+  input_context->server = server;
+  input_context->engaged = server->xw->trigger_keys_length == 0;
+  if (input_context->engaged && !materialize_input_context (input_context))
+    {
+      free (input_context);
+      return NULL;
+    }
+
+  input_context->id = id;
+  input_context->input_method = input_method;
+  wl_list_init (&input_context->preedit_styling_list);
+
+  input_context->preedit_attributes.attribute_id = PREEDIT_ATTRIBUTES;
+  input_context->status_attributes.attribute_id = STATUS_ATTRIBUTES;
+
+  init_ic_attributes (input_context);
+
+  return input_context;
+}
+
+static void
+free_window (xim_wayland_server_t *server, xim_wayland_window_t *window)
+{
+  if (window->pending)
+    xcb_discard_reply (server->connection, window->sequence);
+  if (!window->destroyed)
+    xcb_xim_server_connection_unwatch_window (server->xim, window->window);
+  if (window->toplevel && --window->toplevel->references == 0)
+    free_window (server, window->toplevel);
+  wl_list_remove (&window->link);
+  free (window->ancestors);
+  free (window);
+}
+
+static void
+unref_window (xim_wayland_server_t *server, xim_wayland_window_t *window)
+{
+  if (--window->references == 0)
+    free_window (server, window);
+}
+
+/* Asks for the origin of WINDOW, which is known at the latest when the
+   cursor timer fires, or for the next ancestor first if the hierarchy
+   is not known.  */
+static void
+request_window_origin (xim_wayland_server_t *server,
+                       xim_wayland_window_t *window)
+{
+  if (!window->tree_valid)
+    window->sequence =
+      xcb_query_tree (server->connection,
+                      window->nancestors > 0
+                      ? window->ancestors[window->nancestors - 1]
+                      : window->window).sequence;
+  else
+    window->sequence = xcb_translate_coordinates (server->connection,
+                                                  window->window,
+                                                  window->root,
+                                                  0, 0).sequence;
+  window->pending = true;
+  server->statistics.origin_requests++;
+}
+
+static void
+untrack_focus_window (xim_wayland_input_context_t *input_context)
+{
+  if (input_context->window)
+    unref_window (input_context->server, input_context->window);
+  input_context->window = NULL;
+}
+
+static void
+xim_wayland_input_context_free (xim_wayland_input_context_t *input_context)
+{
+  int i;
+
+  if (input_context->server->focused_input_context == input_context)
+    input_context->server->focused_input_context = NULL;
+
+  if (input_context->input_method->seat
+      && (input_context->input_method->seat->focused_input_context
+          == input_context))
+    input_context->input_method->seat->focused_input_context = NULL;
+
+  if (input_context->cursor_pending)
+    wl_list_remove (&input_context->cursor_link);
+  untrack_focus_window (input_context);
+
+  id_allocator_free (&input_context->input_method->input_context_ids,
+                     input_context->id);
+
+  for (i = 0; i < SIZEOF (input_context->attrs); i++)
+    free (input_context->attrs[i]);
+
+  free_nested_attributes (&input_context->preedit_attributes);
+  free_nested_attributes (&input_context->status_attributes);
+  free_surrounding_text (input_context);
+  free (input_context->language);
+  free (input_context->status_string);
+
+  reset_preedit (input_context);
+  dematerialize_input_context (input_context);
+
+  if (input_context->server->xw->threaded
+      && atomic_load (&input_context->server->thread_running))
+    {
+      xim_wayland_message_t message;
+
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_RETIRE;
+      message.input_context = input_context;
+      send_to_wayland (input_context->server, &message);
+      return;
+    }
+
+  free (input_context);
+}
+
+static xim_wayland_input_method_t *
+xim_wayland_input_method_new (xim_wayland_server_t *server,
+                              xcb_xim_transport_t *transport,
+                              uint16_t id)
+{
+  xim_wayland_input_method_t *input_method;
+
+  input_method = calloc (1, sizeof (xim_wayland_input_method_t));
+  if (!input_method)
+    return NULL;
+
+  input_method->server = server;
+  input_method->transport = transport;
+  input_method->id = id;
+  id_allocator_init (&input_method->input_context_ids,
+                     &server->statistics.input_context_ids);
+
+  wl_list_init (&input_method->input_context_list);
+
+  return input_method;
+}
+
+static void
+xim_wayland_input_method_free (xim_wayland_input_method_t *input_method)
+{
+  xim_wayland_input_context_t *input_context, *next;
+  int i;
+
+  wl_list_for_each_safe (input_context, next,
+                         &input_method->input_context_list, link)
+    {
+      wl_list_remove (&input_context->link);
+      xim_wayland_input_context_free (input_context);
+    }
+
+  id_allocator_destroy (&input_method->input_context_ids);
+  id_allocator_free (&input_method->server->input_method_ids, input_method->id);
+
+  for (i = 0; i < SIZEOF (input_method->attrs); i++)
+    free (input_method->attrs[i]);
+
+  free (input_method);
+}
+
+static xim_wayland_input_context_t *
+find_input_context (xim_wayland_input_method_t *input_method, uint16_t id)
+{
+  xim_wayland_input_context_t *input_context;
+
+  wl_list_for_each (input_context, &input_method->input_context_list, link)
+    {
+      if (input_context->id == id)
+        return input_context;
+    }
+
+  return NULL;
+}
+
+static xim_wayland_input_method_t *
+find_input_method (xim_wayland_server_t *server,
+                   xcb_xim_transport_t *transport,
+                   uint16_t id)
+{
+  xim_wayland_client_t *client = transport->user_data;
+  xim_wayland_input_method_t *input_method;
+
+  if (!client)
+    return NULL;
+
+  wl_list_for_each (input_method, &client->input_method_list, client_link)
+    {
+      if (input_method->id == id)
+        return input_method;
+    }
+
+  return NULL;
+}
+
+static xim_wayland_client_t *
+get_client (xim_wayland_server_t *server, xcb_xim_transport_t *transport)
+{
+  xim_wayland_client_t *client = transport->user_data;
+
+  if (client)
+    return client;
+
+  client = calloc (1, sizeof (xim_wayland_client_t));
+  if (!client)
+    return NULL;
+
+  client->transport = transport;
+  wl_list_init (&client->input_method_list);
+  wl_list_insert (&server->client_list, &client->link);
+  transport->user_data = client;
+
+  return client;
+}
+
+/* Frees the input methods of CLIENT, with their input contexts.  */
+static void
+free_client_input_methods (xim_wayland_client_t *client)
+{
+  xim_wayland_input_method_t *input_method, *next;
+
+  wl_list_for_each_safe (input_method, next,
+                         &client->input_method_list, client_link)
+    {
+      wl_list_remove (&input_method->link);
+      wl_list_remove (&input_method->client_link);
+      xim_wayland_input_method_free (input_method);
+    }
+}
+
+static void
+free_client (xim_wayland_client_t *client)
+{
+  free_client_input_methods (client);
+
+  wl_list_remove (&client->link);
+  client->transport->user_data = NULL;
+  free (client);
+}
+
+static bool
+handle_xim_open_request (xim_wayland_server_t *server,
+                         xcb_xim_generic_request_t *request,
+                         xcb_xim_transport_t *requestor,
+                         xcb_generic_error_t **error)
+{
+  xim_wayland_handshake_t *handshake = get_handshake (server->xw, requestor);
+  xim_wayland_client_t *client;
+  xim_wayland_input_method_t *input_method;
+  uint16_t input_method_id;
+  bool success;
+
+  client = get_client (server, requestor);
+  if (!client)
+    return false;
+
+  input_method_id = id_allocator_alloc (&server->input_method_ids);
+  if (input_method_id == 0)
+    return false;
+
+  input_method = xim_wayland_input_method_new (server,
+                                               requestor,
+                                               input_method_id);
+  if (!input_method)
+    {
+      id_allocator_free (&server->input_method_ids, input_method_id);
+      return false;
+    }
+
+  input_method->seat = choose_seat (server);
+
+  /* Must precede XIM_OPEN_REPLY.  */
+  if (server->xw->trigger_keys_length > 0)
+    {
+      const xcb_xim_triggerkey_t *trigger_keys[MAX_TRIGGER_KEYS];
+      size_t i;
+
+      for (i = 0; i < server->xw->trigger_keys_length; i++)
+        trigger_keys[i] = &server->xw->trigger_keys[i];
+
+      if (!xcb_xim_register_triggerkeys (server->xim,
+                                         requestor,
+                                         input_method->id,
+                                         server->xw->trigger_keys_length,
+                                         trigger_keys,
+                                         server->xw->trigger_keys_length,
+                                         trigger_keys,
+                                         error))
+        {
+          xim_wayland_input_method_free (input_method);
+          return false;
+        }
+    }
+
+  success = xcb_xim_reply_send (server->xim,
+                                requestor,
+                                handshake->open_reply,
+                                input_method->id,
+                                error);
+
+  if (!success)
+    {
+      xim_wayland_input_method_free (input_method);
+      return false;
+    }
+
+  input_method->client = client;
+  wl_list_insert (&server->input_method_list, &input_method->link);
+  wl_list_insert (&client->input_method_list, &input_method->client_link);
+  return success;
+}
+
+static bool
+handle_xim_close_request (xim_wayland_server_t *server,
+                          xcb_xim_generic_request_t *request,
+                          xcb_xim_transport_t *requestor,
+                          xcb_generic_error_t **error)
+{
+  xcb_xim_close_request_t *_close = (xcb_xim_close_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _close->input_method_id);
+  xim_wayland_input_method_t *input_method;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  wl_list_remove (&input_method->link);
+  wl_list_remove (&input_method->client_link);
+  xim_wayland_input_method_free (input_method);
+
+  return xcb_xim_close_reply (server->xim,
+                              requestor,
+                              input_method_id,
+                              error);
+}
+
+/* Also sent by the connection for a client which went away, with an
+   empty body.  In that case, the client may have been focused or in
+   the middle of preedit, which freeing its input contexts takes care
+   of.  */
+static bool
+handle_xim_disconnect_request (xim_wayland_server_t *server,
+                               xcb_xim_generic_request_t *request,
+                               xcb_xim_transport_t *requestor,
+                               xcb_generic_error_t **error)
+{
+  if (requestor->user_data)
+    free_client (requestor->user_data);
+
+  return xcb_xim_server_connection_close_transport (server->xim,
+                                                    requestor,
+                                                    error);
+}
+
+static bool
+handle_xim_query_extension_request (xim_wayland_server_t *server,
+                                    xcb_xim_generic_request_t *request,
+                                    xcb_xim_transport_t *requestor,
+                                    xcb_generic_error_t **error)
+{
+  xcb_xim_query_extension_request_t *_query_extension =
+    (xcb_xim_query_extension_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _query_extension->input_method_id);
+  xim_wayland_handshake_t *handshake = get_handshake (server->xw, requestor);
+  xim_wayland_client_t *client = requestor->user_data;
+  xcb_xim_extension_t *extensions[LAST_EXTENSION];
+  uint16_t extensions_length = 0;
+  xcb_xim_str_iterator_t iterator;
+  uint32_t mask = 0;
+  int i;
+
+  iterator =
+    xcb_xim_query_extension_request_extension_iterator (_query_extension);
+  if (!xcb_xim_str_iterator_has_data (&iterator))
+    {
+      if (client)
+        client->extensions = (1 << LAST_EXTENSION) - 1;
+      return xcb_xim_reply_send (server->xim,
+                                 requestor,
+                                 handshake->query_extension_reply,
+                                 input_method_id,
+                                 error);
+    }
+
+  for (; xcb_xim_str_iterator_has_data (&iterator);
+       xcb_xim_str_iterator_next (&iterator))
+    {
+      xcb_xim_str_t *str = iterator.data;
+
+      for (i = 0; i < LAST_EXTENSION; i++)
+        if (strlen (extension_infos[i].name) == str->length
+            && strncmp ((const char *) (str + 1),
+                        extension_infos[i].name,
+                        str->length) == 0)
+          break;
+
+      if (i == LAST_EXTENSION || (mask & (1 << i)) != 0)
+        continue;
+
+      mask |= 1 << i;
+      extensions[extensions_length++] = handshake->extensions[i];
+    }
+
+  if (client)
+    client->extensions = mask;
+
+  return xcb_xim_query_extension_reply (server->xim,
+                                        requestor,
+                                        input_method_id,
+                                        extensions_length,
+                                        extensions,
+                                        error);
+}
+
+static bool
+handle_xim_encoding_negotiation_request (xim_wayland_server_t *server,
+                                         xcb_xim_generic_request_t *request,
+                                         xcb_xim_transport_t *requestor,
+                                         xcb_generic_error_t **error)
+{
+  xcb_xim_str_iterator_t iterator;
+  xcb_xim_encoding_negotiation_request_t *_encoding_negotiation =
+    (xcb_xim_encoding_negotiation_request_t *) request;
+  uint16_t input_method_id =
+    xcb_xim_card16 (requestor,
+                    _encoding_negotiation->input_method_id);
+
+  /* FIXME: only support UTF-8 at the moment */
+  iterator =
+    xcb_xim_encoding_negotiation_request_encoding_iterator (_encoding_negotiation);
+  while (xcb_xim_str_iterator_has_data (&iterator))
+    {
+      xcb_xim_str_t *str = iterator.data;
+
+      if (strncmp ((const char *) (str + 1), "UTF-8", str->length) == 0)
+        break;
+      xcb_xim_str_iterator_next (&iterator);
+    }
+  if (!xcb_xim_str_iterator_has_data (&iterator))
+    return false;
+
+  return xcb_xim_encoding_negotiation_reply (server->xim,
+                                             requestor,
+                                             input_method_id,
+                                             0,
+                                             iterator.index,
+                                             error);
+}
+
+static void
+set_value (xcb_xim_transport_t *transport,
+           xcb_xim_attribute_t **attributes,
+           xcb_xim_attribute_t *attribute)
+{
+  xcb_xim_attribute_t *attribute_copy;
+  uint16_t attribute_id = xcb_xim_card16 (transport,
+                                          attribute->attribute_id);
+  uint16_t attribute_byte_length =
+    4 + xcb_xim_card16 (transport,
+                        attribute->value_byte_length);
+
+  attribute_copy = malloc (attribute_byte_length);
+  if (!attribute_copy)
+    return;
+
+  memcpy (attribute_copy, attribute, attribute_byte_length);
+
+  free (attributes[attribute_id]);
+  attributes[attribute_id] = attribute_copy;
+}
+
+static void
+set_values (xcb_xim_transport_t *transport,
+            xcb_xim_attribute_t **attributes,
+            uint16_t max_attribute_id,
+            xcb_xim_attribute_iterator_t iterator)
+{
+  for (; xcb_xim_attribute_iterator_has_data (&iterator);
+       xcb_xim_attribute_iterator_next (&iterator))
+    {
+      xcb_xim_attribute_t *attribute = iterator.data;
+      uint16_t attribute_id = xcb_xim_card16 (transport,
+                                              attribute->attribute_id);
+
+      if (attribute_id >= max_attribute_id)
+        continue;
+
+      set_value (transport, attributes, attribute);
+    }
+}
+
+static void
+set_ic_values (xim_wayland_input_context_t *input_context,
+               xcb_xim_attribute_iterator_t iterator)
+{
+  xcb_xim_transport_t *transport = input_context->input_method->transport;
+
+  for (; xcb_xim_attribute_iterator_has_data (&iterator);
+       xcb_xim_attribute_iterator_next (&iterator))
+    {
+      xcb_xim_attribute_t *attribute = iterator.data;
+      uint16_t attribute_id = xcb_xim_card16 (transport,
+                                              attribute->attribute_id);
+
+      switch (attribute_id)
+        {
+        case PREEDIT_ATTRIBUTES:
+          set_nested_values (transport,
+                             &input_context->preedit_attributes,
+                             attribute);
+          break;
+
+        case STATUS_ATTRIBUTES:
+          set_nested_values (transport,
+                             &input_context->status_attributes,
+                             attribute);
+          break;
+
+        case AREA:
+        case SPOT_LOCATION:
+        case FONT_SET:
+          /* Only valid in a nested list.  */
+          break;
+
+        default:
+          if (attribute_id < LAST_IC_ATTRIBUTE)
+            set_value (transport, input_context->attrs, attribute);
+          break;
+        }
+    }
+}
+
+static bool
+handle_xim_set_im_values_request (xim_wayland_server_t *server,
+                                  xcb_xim_generic_request_t *request,
+                                  xcb_xim_transport_t *requestor,
+                                  xcb_generic_error_t **error)
+{
+  xcb_xim_set_im_values_request_t *_set_im_values =
+    (xcb_xim_set_im_values_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _set_im_values->input_method_id);
+  xim_wayland_input_method_t *input_method;
+  xcb_xim_attribute_iterator_t iterator;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  iterator = xcb_xim_set_im_values_request_attribute_iterator (_set_im_values);
+  set_values (requestor,
+              input_method->attrs,
+              LAST_IM_ATTRIBUTE,
+              iterator);
+
+  return xcb_xim_set_im_values_reply (server->xim,
+                                      requestor,
+                                      input_method_id,
+                                      error);
+}
+
+static bool
+handle_xim_get_im_values_request (xim_wayland_server_t *server,
+                                  xcb_xim_generic_request_t *request,
+                                  xcb_xim_transport_t *requestor,
+                                  xcb_generic_error_t **error)
+{
+  xcb_xim_get_im_values_request_t *_get_im_values =
+    (xcb_xim_get_im_values_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _get_im_values->input_method_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_handshake_t *handshake;
+  xcb_xim_attribute_id_iterator_t iterator;
+  uint16_t attributes_length;
+  uint16_t max_attributes_length;
+  xcb_xim_attribute_t **attributes;
+  bool success;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  handshake = get_handshake (server->xw, requestor);
+
+  /* Fast path for XOpenIM, which only asks for queryInputStyle.  */
+  iterator =
+    xcb_xim_get_im_values_request_attribute_id_iterator (_get_im_values);
+  if (!input_method->attrs[QUERY_INPUT_STYLE]
+      && iterator.remainder == 2
+      && xcb_xim_card16 (requestor, *iterator.data) == QUERY_INPUT_STYLE)
+    return xcb_xim_reply_send (server->xim,
+                               requestor,
+                               handshake->query_input_style_reply,
+                               input_method_id,
+                               error);
+
+  max_attributes_length = 0;
+  attributes_length = 0;
+  attributes = NULL;
+
+  for (; xcb_xim_attribute_id_iterator_has_data (&iterator);
+       xcb_xim_attribute_id_iterator_next (&iterator))
+    {
+      uint16_t attribute_id = xcb_xim_card16 (requestor,
+                                              *iterator.data);
+
+      if (attribute_id >= LAST_IM_ATTRIBUTE)
+        continue;
+
+      if (attributes_length == max_attributes_length)
+        {
+          max_attributes_length = max_attributes_length * 2 + 10;
+          attributes =
+            realloc (attributes,
+                     sizeof (xcb_xim_attribute_t *) * max_attributes_length);
+        }
+
+      attributes[attributes_length++] =
+        input_method->attrs[attribute_id]
+        ? input_method->attrs[attribute_id]
+        : handshake->attrs[attribute_id];
+    }
+
+  success = xcb_xim_get_im_values_reply (server->xim,
+                                         requestor,
+                                         input_method_id,
+                                         attributes_length,
+                                         attributes,
+                                         error);
+  free (attributes);
+  return success;
+}
+
+/* Returns focusWindow, or clientWindow if unset, as Xlib does.  */
+static xcb_window_t
+get_focus_window (xim_wayland_input_context_t *input_context)
+{
+  xcb_xim_transport_t *transport = input_context->input_method->transport;
+  uint32_t window;
+
+  if (input_context->attrs[FOCUS_WINDOW]
+      && xcb_xim_attribute_get_card32 (transport,
+                                       input_context->attrs[FOCUS_WINDOW],
+                                       &window)
+      && window != XCB_WINDOW_NONE)
+    return window;
+
+  if (input_context->attrs[CLIENT_WINDOW]
+      && xcb_xim_attribute_get_card32 (transport,
+                                       input_context->attrs[CLIENT_WINDOW],
+                                       &window))
+    return window;
+
+  return XCB_WINDOW_NONE;
+}
+
+/* Clients which keep forwarding key events anyway fall back to the
+   fast path of XIM_FORWARD_EVENT, so a failure is only reported: the
+   request which triggered this was already answered.  */
+static void
+send_event_mask (xim_wayland_server_t *server,
+                 xim_wayland_client_t *client,
+                 xim_wayland_input_context_t *input_context)
+{
+  xcb_generic_error_t *error = NULL;
+  bool success;
+
+  if (!client || client->ignores_event_mask)
+    return;
+
+  /* Xlib applies the select mask of XIM_EXT_SET_EVENT_MASK to the
+     focus window, so only use it once there is one.  */
+  if ((client->extensions & (1 << EXTENSION_SET_EVENT_MASK)) != 0
+      && get_focus_window (input_context) != XCB_WINDOW_NONE)
+    success = xcb_xim_ext_set_event_mask (server->xim,
+                                          client->transport,
+                                          input_context->input_method->id,
+                                          input_context->id,
+                                          FORWARD_EVENT_MASK,
+                                          0,
+                                          0,
+                                          FORWARD_EVENT_MASK,
+                                          SYNCHRONOUS_EVENT_MASK,
+                                          &error);
+  else
+    success = xcb_xim_set_event_mask (server->xim,
+                                      client->transport,
+                                      input_context->input_method->id,
+                                      input_context->id,
+                                      FORWARD_EVENT_MASK,
+                                      SYNCHRONOUS_EVENT_MASK,
+                                      &error);
+  if (!success)
+    {
+      if (error)
+        {
+          fprintf (stderr, "can't send event mask: %i\n",
+                   error->error_code);
+          free (error);
+        }
+      else
+        fprintf (stderr, "can't send event mask\n");
+      return;
+    }
+
+  client->event_mask_sent = true;
+  server->statistics.event_masks++;
+}
+
+static xim_wayland_window_t *
+find_window (xim_wayland_server_t *server, xcb_window_t window)
+{
+  xim_wayland_window_t *_window;
+
+  wl_list_for_each (_window, &server->window_list, link)
+    if (_window->window == window)
+      return _window;
+
+  return NULL;
+}
+
+/* Returns a new reference to the entry of WINDOW.  */
+static xim_wayland_window_t *
+ref_window (xim_wayland_server_t *server, xcb_window_t window)
+{
+  xim_wayland_window_t *_window;
+
+  _window = find_window (server, window);
+  if (_window)
+    {
+      _window->references++;
+      return _window;
+    }
+
+  _window = calloc (1, sizeof (xim_wayland_window_t));
+  if (!_window)
+    return NULL;
+
+  /* The client windows of the transports are watched by the XIM
+     connection too, which keeps the event mask until both stop.  */
+  if (!xcb_xim_server_connection_watch_window (server->xim, window))
+    {
+      free (_window);
+      return NULL;
+    }
+
+  _window->window = window;
+  _window->references = 1;
+
+  wl_list_insert (&server->window_list, &_window->link);
+  return _window;
+}
+
+/* Makes INPUT_CONTEXT reference the entry of its current focus window,
+   and returns it with its origin requested if unknown.  */
+static xim_wayland_window_t *
+track_focus_window (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_server_t *server = input_context->server;
+  xim_wayland_window_t *window = input_context->window;
+  xcb_window_t focus_window = get_focus_window (input_context);
+
+  if (!window || window->window != focus_window)
+    {
+      if (window)
+        unref_window (server, window);
+      window = focus_window != XCB_WINDOW_NONE
+        ? ref_window (server, focus_window)
+        : NULL;
+      input_context->window = window;
+    }
+
+  if (window && !window->destroyed && !window->valid && !window->pending)
+    request_window_origin (server, window);
+
+  return window;
+}
+
+/* Records the parent from TREE, the reply to QueryTree on the last
+   known ancestor of WINDOW, and references the top-level once the
+   root is reached.  */
+static bool
+add_window_ancestor (xim_wayland_server_t *server,
+                     xim_wayland_window_t *window,
+                     xcb_query_tree_reply_t *tree)
+{
+  xim_wayland_window_t *toplevel = NULL;
+  xcb_window_t *ancestors;
+
+  window->root = tree->root;
+
+  if (tree->parent != tree->root && tree->parent != XCB_WINDOW_NONE)
+    {
+      ancestors = realloc (window->ancestors,
+                           (window->nancestors + 1) * sizeof (xcb_window_t));
+      if (!ancestors)
+        return false;
+
+      ancestors[window->nancestors++] = tree->parent;
+      window->ancestors = ancestors;
+      return true;
+    }
+
+  if (window->nancestors > 0)
+    {
+      toplevel = ref_window (server,
+                             window->ancestors[window->nancestors - 1]);
+      if (!toplevel)
+        return false;
+    }
+
+  if (window->toplevel)
+    unref_window (server, window->toplevel);
+  window->toplevel = toplevel;
+  window->tree_valid = true;
+  return true;
+}
+
+/* Returns false if the origin of WINDOW is not known yet.  */
+static bool
+get_window_origin (xim_wayland_server_t *server,
+                   xim_wayland_window_t *window,
+                   bool *valid)
+{
+  xcb_generic_error_t *error = NULL;
+  void *reply;
+
+  if (window->pending)
+    {
+      if (!xcb_poll_for_reply (server->connection,
+                               window->sequence,
+                               &reply,
+                               &error))
+        return false;
+
+      window->pending = false;
+      free (error);
+
+      if (reply && !window->tree_valid)
+        {
+          if (!add_window_ancestor (server, window, reply))
+            {
+              free (reply);
+              *valid = false;
+              return true;
+            }
+          free (reply);
+          request_window_origin (server, window);
+          return false;
+        }
+
+      /* Coordinates are 0,0 when the root is on another screen, in
+         which case the origin stays unknown.  */
+      if (reply)
+        {
+          xcb_translate_coordinates_reply_t *translate = reply;
+
+          if (translate->same_screen)
+            {
+              window->x = translate->dst_x;
+              window->y = translate->dst_y;
+              window->valid = true;
+            }
+          free (reply);
+        }
+    }
+
+  *valid = window->valid;
+  return true;
+}
+
+static bool
+is_window_ancestor (xim_wayland_window_t *window, xcb_window_t ancestor)
+{
+  size_t i;
+
+  for (i = 0; i < window->nancestors; i++)
+    if (window->ancestors[i] == ancestor)
+      return true;
+
+  return false;
+}
+
+/* Forgets the origins of CONFIGURED and of the windows below it, and
+   with TREE, their ancestors too.  Returns true if one of them was
+   the focus window of the focused input context.  */
+static bool
+invalidate_window_origins (xim_wayland_server_t *server,
+                           xcb_window_t configured,
+                           bool tree)
+{
+  xim_wayland_input_context_t *focused = server->focused_input_context;
+  xim_wayland_window_t *window;
+  bool found = false;
+
+  wl_list_for_each (window, &server->window_list, link)
+    {
+      if (window->window != configured
+          && !is_window_ancestor (window, configured))
+        continue;
+
+      if (window->pending)
+        {
+          xcb_discard_reply (server->connection, window->sequence);
+          window->pending = false;
+        }
+      window->valid = false;
+      if (tree)
+        {
+          window->tree_valid = false;
+          window->nancestors = 0;
+        }
+
+      if (focused && focused->window == window)
+        found = true;
+    }
+
+  return found;
+}
+
+/* Sends the cursor rectangle of INPUT_CONTEXT within the next frame,
+   unless it didn't change by then.  */
+static void
+schedule_cursor_update (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_server_t *server = input_context->server;
+
+  if (input_context->cursor_pending || !input_context->text_input)
+    return;
+
+  if (!track_focus_window (input_context))
+    return;
+
+  wl_list_insert (server->cursor_list.prev, &input_context->cursor_link);
+  input_context->cursor_pending = true;
+
+  if (!xim_wayland_loop_timer_is_armed (server->cursor_timer))
+    xim_wayland_loop_timer_arm (server->loop, server->cursor_timer,
+                                CURSOR_UPDATE_INTERVAL);
+}
+
+/* Returns false if the origin of the focus window is not known yet.
+   Otherwise, sends the rectangle if it changed.  */
+static bool
+update_cursor_rectangle (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_server_t *server = input_context->server;
+  xim_wayland_nested_attributes_t *nested =
+    &input_context->preedit_attributes;
+  xim_wayland_window_t *window;
+  xcb_rectangle_t rectangle;
+  bool valid;
+
+  if (!input_context->text_input
+      || (nested->mask & (NESTED_SPOT_LOCATION | NESTED_AREA)) == 0)
+    return true;
+
+  /* The focus window may have been destroyed meanwhile.  */
+  window = track_focus_window (input_context);
+  if (!window || window->destroyed)
+    return true;
+
+  if (!get_window_origin (server, window, &valid))
+    return false;
+
+  if (!valid)
+    return true;
+
+  /* The spot location is where the next character is drawn, and is
+     preferred to the preedit area.  */
+  if ((nested->mask & NESTED_SPOT_LOCATION) != 0)
+    {
+      rectangle.x = window->x + nested->spot_location.x;
+      rectangle.y = window->y + nested->spot_location.y;
+      rectangle.width = 0;
+      rectangle.height = 0;
+    }
+  else
+    {
+      rectangle = nested->area;
+      rectangle.x += window->x;
+      rectangle.y += window->y;
+    }
+
+  if (input_context->cursor_sent
+      && memcmp (&input_context->cursor_rectangle, &rectangle,
+                 sizeof (rectangle)) == 0)
+    {
+      server->statistics.cursor_updates_skipped++;
+      return true;
+    }
+
+  wl_text_input_set_cursor_rectangle (input_context->text_input,
+                                      rectangle.x,
+                                      rectangle.y,
+                                      rectangle.width,
+                                      rectangle.height);
+  wl_text_input_commit_state (input_context->text_input,
+                              ++input_context->serial);
+
+  input_context->cursor_rectangle = rectangle;
+  input_context->cursor_sent = true;
+  server->statistics.cursor_updates++;
+  return true;
+}
+
+static void
+handle_cursor_timeout (xim_wayland_loop_t *loop, void *data)
+{
+  xim_wayland_server_t *server = data;
+  xim_wayland_input_context_t *input_context, *next;
+
+  wl_list_for_each_safe (input_context, next, &server->cursor_list,
+                         cursor_link)
+    {
+      if (!update_cursor_rectangle (input_context))
+        continue;
+
+      wl_list_remove (&input_context->cursor_link);
+      input_context->cursor_pending = false;
+    }
+
+  /* Wait for the origins which are still pending.  */
+  if (!wl_list_empty (&server->cursor_list))
+    xim_wayland_loop_timer_arm (loop, server->cursor_timer,
+                                CURSOR_UPDATE_INTERVAL);
+}
+
+static void
+handle_window_event (xim_wayland_server_t *server,
+                     xcb_generic_event_t *event)
+{
+  xim_wayland_window_t *window;
+
+  switch (event->response_type & ~0x80)
+    {
+    case XCB_CONFIGURE_NOTIFY:
+      if (invalidate_window_origins (
+            server,
+            ((xcb_configure_notify_event_t *) event)->window,
+            false))
+        schedule_cursor_update (server->focused_input_context);
+      break;
+
+    case XCB_REPARENT_NOTIFY:
+      /* Window managers reparent the top-levels into their frames.  */
+      if (invalidate_window_origins (
+            server,
+            ((xcb_reparent_notify_event_t *) event)->window,
+            true))
+        schedule_cursor_update (server->focused_input_context);
+      break;
+
+    case XCB_DESTROY_NOTIFY:
+      /* Freed with the last input context referring to it.  */
+      window = find_window (server,
+                            ((xcb_destroy_notify_event_t *) event)->window);
+      if (window)
+        {
+          if (window->pending)
+            xcb_discard_reply (server->connection, window->sequence);
+          window->pending = false;
+          window->valid = false;
+          window->destroyed = true;
+        }
+      break;
+
+    default:
+      break;
+    }
+}
+
+static bool
+handle_xim_create_ic_request (xim_wayland_server_t *server,
+                              xcb_xim_generic_request_t *request,
+                              xcb_xim_transport_t *requestor,
+                              xcb_generic_error_t **error)
+{
+  xcb_xim_create_ic_request_t *_create_ic =
+    (xcb_xim_create_ic_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _create_ic->input_method_id);
+  xim_wayland_client_t *client = requestor->user_data;
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  uint16_t input_context_id;
+  xcb_xim_attribute_iterator_t iterator;
+  bool success;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context_id = id_allocator_alloc (&input_method->input_context_ids);
+  if (input_context_id == 0)
+    return false;
+
+  input_context =
+    xim_wayland_input_context_new (server,
+                                   input_method,
+                                   input_context_id);
+  if (!input_context)
+    {
+      id_allocator_free (&input_method->input_context_ids, input_context_id);
+      return false;
+    }
+
+  iterator = xcb_xim_create_ic_request_attribute_iterator (_create_ic);
+  set_ic_values (input_context, iterator);
+
+  success = xcb_xim_create_ic_reply (server->xim,
+                                     requestor,
+                                     input_method_id,
+                                     input_context->id,
+                                     error);
+  if (!success)
+    {
+      xim_wayland_input_context_free (input_context);
+      return false;
+    }
+
+  wl_list_insert (&input_method->input_context_list, &input_context->link);
+
+  send_event_mask (server, client, input_context);
+  return true;
+}
+
+static bool
+handle_xim_destroy_ic_request (xim_wayland_server_t *server,
+                               xcb_xim_generic_request_t *request,
+                               xcb_xim_transport_t *requestor,
+                               xcb_generic_error_t **error)
+{
+  xcb_xim_destroy_ic_request_t *_destroy_ic =
+    (xcb_xim_destroy_ic_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _destroy_ic->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _destroy_ic->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  wl_list_remove (&input_context->link);
+  xim_wayland_input_context_free (input_context);
+
+  return xcb_xim_destroy_ic_reply (server->xim,
+                                   requestor,
+                                   input_method_id,
+                                   input_context_id,
+                                   error);
+}
+
+static bool
+handle_xim_set_ic_values_request (xim_wayland_server_t *server,
+                                  xcb_xim_generic_request_t *request,
+                                  xcb_xim_transport_t *requestor,
+                                  xcb_generic_error_t **error)
+{
+  xcb_xim_set_ic_values_request_t *_set_ic_values =
+    (xcb_xim_set_ic_values_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _set_ic_values->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _set_ic_values->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  xcb_xim_attribute_iterator_t iterator;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  iterator = xcb_xim_set_ic_values_request_attribute_iterator (_set_ic_values);
+  set_ic_values (input_context, iterator);
+  if (input_context->focused)
+    schedule_cursor_update (input_context);
+
+  return xcb_xim_set_ic_values_reply (server->xim,
+                                      requestor,
+                                      input_method_id,
+                                      input_context_id,
+                                      error);
+}
+
+static bool
+handle_xim_get_ic_values_request (xim_wayland_server_t *server,
+                                  xcb_xim_generic_request_t *request,
+                                  xcb_xim_transport_t *requestor,
+                                  xcb_generic_error_t **error)
+{
+  xcb_xim_get_ic_values_request_t *_get_ic_values =
+    (xcb_xim_get_ic_values_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _get_ic_values->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _get_ic_values->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  xcb_xim_attribute_id_iterator_t iterator;
+  uint16_t attributes_length;
+  uint16_t max_attributes_length;
+  xcb_xim_attribute_t **attributes;
+  bool success;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  max_attributes_length = 0;
+  attributes_length = 0;
+  attributes = NULL;
+
+  for (iterator =
+         xcb_xim_get_ic_values_request_attribute_id_iterator (_get_ic_values);
+       xcb_xim_attribute_id_iterator_has_data (&iterator);
+       xcb_xim_attribute_id_iterator_next (&iterator))
+    {
+      uint16_t attribute_id = xcb_xim_card16 (requestor,
+                                              *iterator.data);
+      xcb_xim_attribute_t *attribute;
+
+      if (attribute_id >= LAST_IC_ATTRIBUTE)
+        continue;
+
+      if (attributes_length == max_attributes_length)
+        {
+          max_attributes_length = max_attributes_length * 2 + 10;
+          attributes =
+            realloc (attributes,
+                     sizeof (xcb_xim_attribute_t *) * max_attributes_length);
+        }
+
+      switch (attribute_id)
+        {
+        case PREEDIT_ATTRIBUTES:
+          attribute =
+            get_nested_value (requestor, &input_context->preedit_attributes);
+          break;
+
+        case STATUS_ATTRIBUTES:
+          attribute =
+            get_nested_value (requestor, &input_context->status_attributes);
+          break;
+
+        default:
+          attribute = input_context->attrs[attribute_id];
+          break;
+        }
+
+      /* Skip values which have never been set.  */
+      if (!attribute)
+        continue;
+
+      attributes[attributes_length++] = attribute;
+    }
+
+  success = xcb_xim_get_ic_values_reply (server->xim,
+                                         requestor,
+                                         input_method_id,
+                                         input_context_id,
+                                         attributes_length,
+                                         attributes,
+                                         error);
+  free (attributes);
+  return success;
+}
+
+/* Creates the Wayland objects of an engaged input context if needed,
+   and activates it if it is focused.  */
+static bool
+engage_input_context (xim_wayland_input_context_t *input_context)
+{
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+
+  if (!materialize_input_context (input_context))
+    return false;
+
+  /* Activated when a seat appears.  */
+  if (!input_context->focused || !input_method->seat)
+    return true;
+
+  input_method->seat->focused_input_context = input_context;
+
+  wl_text_input_show_input_panel (input_context->text_input);
+  wl_text_input_activate (input_context->text_input,
+                          input_method->seat->seat->wl_seat,
+                          input_context->surface);
+  schedule_cursor_update (input_context);
+
+  if (input_context->surrounding_valid)
+    send_surrounding_text (input_context, false);
+  else
+    request_surrounding_text (input_context);
+
+  return true;
+}
+
+/* Ends preedit and releases the Wayland objects of an input context
+   which the client turned off.  */
+static bool
+disengage_input_context (xim_wayland_input_context_t *input_context,
+                         xcb_generic_error_t **error)
+{
+  xim_wayland_input_method_t *input_method = input_context->input_method;
+
+  if (input_method->seat
+      && input_method->seat->focused_input_context == input_context)
+    {
+      input_method->seat->focused_input_context = NULL;
+      if (input_context->text_input)
+        wl_text_input_deactivate (input_context->text_input,
+                                  input_method->seat->seat->wl_seat);
+    }
+
+  if (input_context->preedit_started
+      && !update_preedit_string (input_context, "", error))
+    return false;
+
+  reset_preedit (input_context);
+
+  if (!end_status (input_context, error))
+    return false;
+
+  if (input_context->text_input)
+    {
+      dematerialize_input_context (input_context);
+      input_context->server->statistics.dormant_input_contexts++;
+    }
+
+  return true;
+}
+
+static bool
+handle_xim_set_ic_focus_request (xim_wayland_server_t *server,
+                                 xcb_xim_generic_request_t *request,
+                                 xcb_xim_transport_t *requestor,
+                                 xcb_generic_error_t **error)
+{
+  xcb_xim_set_ic_focus_request_t *_set_ic_focus =
+    (xcb_xim_set_ic_focus_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _set_ic_focus->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _set_ic_focus->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  input_context->focused = true;
+  server->focused_input_context = input_context;
+
+  if (!input_context->engaged)
+    return true;
+
+  return engage_input_context (input_context);
+}
+
+static bool
+handle_xim_unset_ic_focus_request (xim_wayland_server_t *server,
+                                   xcb_xim_generic_request_t *request,
+                                   xcb_xim_transport_t *requestor,
+                                   xcb_generic_error_t **error)
+{
+  xcb_xim_unset_ic_focus_request_t *_unset_ic_focus =
+    (xcb_xim_unset_ic_focus_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _unset_ic_focus->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _unset_ic_focus->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  input_context->focused = false;
+  if (server->focused_input_context == input_context)
+    server->focused_input_context = NULL;
+
+  if (!input_method->seat)
+    return true;
+
+  if (input_method->seat->focused_input_context == input_context)
+    input_method->seat->focused_input_context = NULL;
+
+  if (!input_context->text_input)
+    return true;
+
+  wl_text_input_deactivate (input_context->text_input,
+                            input_method->seat->seat->wl_seat);
+  return true;
+}
+
+static bool
+handle_xim_preedit_caret_reply (xim_wayland_server_t *server,
+                                xcb_xim_generic_request_t *request,
+                                xcb_xim_transport_t *requestor,
+                                xcb_generic_error_t **error)
+{
+  xcb_xim_preedit_caret_reply_t *_preedit_caret =
+    (xcb_xim_preedit_caret_reply_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _preedit_caret->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _preedit_caret->input_context_id);
+  uint32_t position = xcb_xim_card32 (requestor,
+                                      _preedit_caret->position);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  if (position > input_context->preedit_length)
+    input_context->preedit_caret = position;
+
+  return true;
+}
+
+static bool
+handle_xim_trigger_notify_request (xim_wayland_server_t *server,
+                                   xcb_xim_generic_request_t *request,
+                                   xcb_xim_transport_t *requestor,
+                                   xcb_generic_error_t **error)
+{
+  xcb_xim_trigger_notify_request_t *_trigger_notify =
+    (xcb_xim_trigger_notify_request_t *) request;
+  uint16_t input_method_id =
+    xcb_xim_card16 (requestor, _trigger_notify->input_method_id);
+  uint16_t input_context_id =
+    xcb_xim_card16 (requestor, _trigger_notify->input_context_id);
+  uint32_t flag = xcb_xim_card32 (requestor, _trigger_notify->flag);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  /* Reply only once input is switched, so that a failure is reported
+     with XIM_ERROR instead.  */
+  if (flag == TRIGGER_NOTIFY_OFF)
+    {
+      input_context->engaged = false;
+      if (!disengage_input_context (input_context, error))
+        return false;
+      server->statistics.triggers_off++;
+    }
+  else
+    {
+      if (!engage_input_context (input_context))
+        return false;
+      input_context->engaged = true;
+      server->statistics.triggers_on++;
+    }
+
+  if (!xcb_xim_trigger_notify_reply (server->xim,
+                                     requestor,
+                                     input_method_id,
+                                     input_context_id,
+                                     error))
+    return false;
+
+  if (flag != TRIGGER_NOTIFY_OFF)
+    send_event_mask (server, requestor->user_data, input_context);
+  return true;
+}
+
+static bool
+handle_xim_sync_request (xim_wayland_server_t *server,
+                         xcb_xim_generic_request_t *request,
+                         xcb_xim_transport_t *requestor,
+                         xcb_generic_error_t **error)
+{
+  xcb_xim_sync_request_t *_sync = (xcb_xim_sync_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _sync->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _sync->input_context_id);
+
+  /* Requests are handled in order, so everything sent before is
+     done.  */
+  return xcb_xim_sync_reply (server->xim,
+                             requestor,
+                             input_method_id,
+                             input_context_id,
+                             error);
+}
+
+/* Hands the preedit text over to the client, which commits it, and
+   clears it on both sides.  */
+static bool
+handle_xim_reset_ic_request (xim_wayland_server_t *server,
+                             xcb_xim_generic_request_t *request,
+                             xcb_xim_transport_t *requestor,
+                             xcb_generic_error_t **error)
+{
+  xcb_xim_reset_ic_request_t *_reset_ic =
+    (xcb_xim_reset_ic_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _reset_ic->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _reset_ic->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  const char *preedit;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  preedit = input_context->preedit_string ? input_context->preedit_string : "";
+  if (!xcb_xim_reset_ic_reply (server->xim,
+                               requestor,
+                               input_method_id,
+                               input_context_id,
+                               strlen (preedit),
+                               (const uint8_t *) preedit,
+                               error))
+    return false;
+
+  if (input_context->text_input)
+    wl_text_input_reset (input_context->text_input);
+
+  if (*preedit != '\0')
+    return update_preedit_string (input_context, "", error);
+
+  return true;
+}
+
+static void
+count_forwarded_event (xim_wayland_server_t *server,
+                       xim_wayland_client_t *client)
+{
+  server->statistics.forwarded_events++;
+  if (!client)
+    return;
+
+  client->forwarded_events++;
+  if (client->event_mask_sent && !client->ignores_event_mask
+      && ++client->masked_forwarded_events > EVENT_MASK_GRACE)
+    {
+      client->ignores_event_mask = true;
+      server->statistics.event_mask_ignored++;
+    }
+}
+
+/* Wayland delivers key events to the input method directly, so a key
+   event forwarded by a client is one the input method didn't want.
+   Send it back right away so that the client processes it itself,
+   and end the wait of a synchronous client.  */
+static bool
+handle_xim_forward_event_request (xim_wayland_server_t *server,
+                                  xcb_xim_generic_request_t *request,
+                                  xcb_xim_transport_t *requestor,
+                                  xcb_generic_error_t **error)
+{
+  xcb_xim_forward_event_request_t *_forward_event =
+    (xcb_xim_forward_event_request_t *) request;
+  uint16_t input_method_id =
+    xcb_xim_card16 (requestor, _forward_event->input_method_id);
+  uint16_t input_context_id =
+    xcb_xim_card16 (requestor, _forward_event->input_context_id);
+  uint16_t flag = xcb_xim_card16 (requestor, _forward_event->flag);
+  xim_wayland_client_t *client = requestor->user_data;
+
+  /* The header, the IDs, flag and serial, and a 32-byte event.  */
+  if (xcb_xim_card16 (requestor, request->length) < 10)
+    return false;
+
+  if (!xcb_xim_forward_event (server->xim,
+                              requestor,
+                              input_method_id,
+                              input_context_id,
+                              0,
+                              xcb_xim_forward_event_get_serial (_forward_event),
+                              xcb_xim_forward_event_get_event (_forward_event),
+                              error))
+    return false;
+
+  count_forwarded_event (server, client);
+
+  if ((flag & XCB_XIM_FORWARD_EVENT_FLAG_SYNCHRONOUS) == 0)
+    return true;
+
+  return xcb_xim_sync_reply (server->xim,
+                             requestor,
+                             input_method_id,
+                             input_context_id,
+                             error);
+}
+
+/* Same as XIM_FORWARD_EVENT, in the compact form of the extension.  */
+static bool
+handle_xim_ext_forward_keyevent_request (xim_wayland_server_t *server,
+                                         xcb_xim_generic_request_t *request,
+                                         xcb_xim_transport_t *requestor,
+                                         xcb_generic_error_t **error)
+{
+  xcb_xim_ext_forward_keyevent_request_t *_forward_keyevent =
+    (xcb_xim_ext_forward_keyevent_request_t *) request;
+  uint16_t input_method_id =
+    xcb_xim_card16 (requestor, _forward_keyevent->input_method_id);
+  uint16_t input_context_id =
+    xcb_xim_card16 (requestor, _forward_keyevent->input_context_id);
+  uint16_t flag = xcb_xim_card16 (requestor, _forward_keyevent->flag);
+
+  if (xcb_xim_card16 (requestor, request->length) < 5)
+    return false;
+
+  if (!xcb_xim_ext_forward_keyevent (
+        server->xim,
+        requestor,
+        input_method_id,
+        input_context_id,
+        0,
+        xcb_xim_card16 (requestor, _forward_keyevent->sequence),
+        _forward_keyevent->type,
+        _forward_keyevent->keycode,
+        xcb_xim_card16 (requestor, _forward_keyevent->state),
+        xcb_xim_card32 (requestor, _forward_keyevent->time),
+        xcb_xim_card32 (requestor, _forward_keyevent->window),
+        error))
+    return false;
+
+  count_forwarded_event (server, requestor->user_data);
+
+  if ((flag & XCB_XIM_FORWARD_EVENT_FLAG_SYNCHRONOUS) == 0)
+    return true;
+
+  return xcb_xim_sync_reply (server->xim,
+                             requestor,
+                             input_method_id,
+                             input_context_id,
+                             error);
+}
+
+/* Moves the spot location of the preedit attributes, without the
+   nested list of XIM_SET_IC_VALUES.  No reply.  */
+static bool
+handle_xim_ext_move_request (xim_wayland_server_t *server,
+                             xcb_xim_generic_request_t *request,
+                             xcb_xim_transport_t *requestor,
+                             xcb_generic_error_t **error)
+{
+  xcb_xim_ext_move_request_t *_move = (xcb_xim_ext_move_request_t *) request;
+  uint16_t input_method_id = xcb_xim_card16 (requestor,
+                                             _move->input_method_id);
+  uint16_t input_context_id = xcb_xim_card16 (requestor,
+                                              _move->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  xcb_point_t spot_location;
+
+  if (xcb_xim_card16 (requestor, request->length) < 2)
+    return false;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+
+  spot_location.x = (int16_t) xcb_xim_card16 (requestor, _move->x);
+  spot_location.y = (int16_t) xcb_xim_card16 (requestor, _move->y);
+  set_spot_location (&input_context->preedit_attributes, &spot_location);
+  server->statistics.spot_moves++;
+  if (input_context->focused)
+    schedule_cursor_update (input_context);
+
+  return true;
+}
+
+/* Requests of the extensions returned by XIM_QUERY_EXTENSION, which
+   share XCB_XIM_EXTENSION as their major opcode.  */
+static bool
+handle_xim_extension_request (xim_wayland_server_t *server,
+                              xcb_xim_generic_request_t *request,
+                              xcb_xim_transport_t *requestor,
+                              xcb_generic_error_t **error)
+{
+  switch (request->minor_opcode)
+    {
+    case XCB_XIM_EXT_FORWARD_KEYEVENT:
+      return handle_xim_ext_forward_keyevent_request (server, request,
+                                                      requestor, error);
+
+    case XCB_XIM_EXT_MOVE:
+      return handle_xim_ext_move_request (server, request, requestor, error);
+
+    default:
+      return false;
+    }
+}
+
+static bool
+handle_xim_str_conversion_reply (xim_wayland_server_t *server,
+                                 xcb_xim_generic_request_t *request,
+                                 xcb_xim_transport_t *requestor,
+                                 xcb_generic_error_t **error)
+{
+  xcb_xim_str_conversion_reply_t *_str_conversion =
+    (xcb_xim_str_conversion_reply_t *) request;
+  uint16_t input_method_id =
+    xcb_xim_card16 (requestor, _str_conversion->input_method_id);
+  uint16_t input_context_id =
+    xcb_xim_card16 (requestor, _str_conversion->input_context_id);
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  xim_wayland_client_t *client;
+  uint16_t string_byte_length;
+  const uint8_t *string;
+  bool changed;
+
+  input_method = find_input_method (server, requestor, input_method_id);
+  if (!input_method)
+    return false;
+
+  input_context = find_input_context (input_method, input_context_id);
+  if (!input_context)
+    return false;
+  client = input_method->client;
+
+  if (!xcb_xim_str_conversion_reply_get_string (_str_conversion,
+                                                &string_byte_length,
+                                                &string))
+    return false;
+
+  /* Replies come in order.  Those to deletions return the deleted
+     text, which is empty if the client left it there; the text is
+     then retrieved again, and later deletions use BackSpace.  */
+  if (input_context->substitutions > 0)
+    {
+      input_context->substitutions--;
+      if (string_byte_length == 0 && client && !client->ignores_substitution)
+        {
+          fprintf (stderr, "client 0x%x ignores string substitutions\n",
+                   requestor->client_window);
+          client->ignores_substitution = true;
+          input_context->surrounding_valid = false;
+          request_surrounding_text (input_context);
+        }
+      return true;
+    }
+
+  if (!input_context->surrounding_requested)
+    return true;
+  input_context->surrounding_requested = false;
+
+  if (string_byte_length > 0 && client)
+    client->str_conversion_supported = true;
+
+  changed = set_surrounding_text (input_context,
+                                  (const char *) string,
+                                  string_byte_length);
+  send_surrounding_text (input_context, changed);
+  return true;
+}
+
+typedef bool (* xim_wayland_xim_request_handler_t) (
+  xim_wayland_server_t *server,
+  xcb_xim_generic_request_t *request,
+  xcb_xim_transport_t *requestor,
+  xcb_generic_error_t **error);
+
+static const struct
+{
+  uint8_t major_opcode;
+  xim_wayland_xim_request_handler_t handler;
+} xim_request_handlers[] =
+  {
+    { XCB_XIM_DISCONNECT, handle_xim_disconnect_request },
+    { XCB_XIM_OPEN, handle_xim_open_request },
+    { XCB_XIM_CLOSE, handle_xim_close_request },
+    { XCB_XIM_TRIGGER_NOTIFY, handle_xim_trigger_notify_request },
+    { XCB_XIM_QUERY_EXTENSION, handle_xim_query_extension_request },
+    { XCB_XIM_ENCODING_NEGOTIATION, handle_xim_encoding_negotiation_request },
+    { XCB_XIM_SET_IM_VALUES, handle_xim_set_im_values_request },
+    { XCB_XIM_GET_IM_VALUES, handle_xim_get_im_values_request },
+    { XCB_XIM_CREATE_IC, handle_xim_create_ic_request },
+    { XCB_XIM_DESTROY_IC, handle_xim_destroy_ic_request },
+    { XCB_XIM_SET_IC_VALUES, handle_xim_set_ic_values_request },
+    { XCB_XIM_GET_IC_VALUES, handle_xim_get_ic_values_request },
+    { XCB_XIM_SET_IC_FOCUS, handle_xim_set_ic_focus_request },
+    { XCB_XIM_UNSET_IC_FOCUS, handle_xim_unset_ic_focus_request },
+    { XCB_XIM_FORWARD_EVENT, handle_xim_forward_event_request },
+    { XCB_XIM_SYNC, handle_xim_sync_request },
+    { XCB_XIM_RESET_IC, handle_xim_reset_ic_request },
+    { XCB_XIM_STR_CONVERSION_REPLY, handle_xim_str_conversion_reply },
+    { XCB_XIM_PREEDIT_CARET_REPLY, handle_xim_preedit_caret_reply },
+    { XCB_XIM_EXTENSION, handle_xim_extension_request }
+  };
+
+static bool
+handle_xim_request (xim_wayland_server_t *server,
+                    xcb_xim_generic_request_t *request,
+                    xcb_xim_transport_t *requestor,
+                    xcb_generic_error_t **error)
+{
+  int i;
+
+  for (i = 0; i < SIZEOF (xim_request_handlers); i++)
+    {
+      if (xim_request_handlers[i].major_opcode == request->major_opcode)
+        return xim_request_handlers[i].handler (server, request, requestor, error);
+    }
+
+  return true;
+}
+
+/* Reads and dispatches Wayland events without blocking.  */
+static bool
+handle_wayland_events (xim_wayland_t *xw)
+{
+  /* prepare_read fails if events are already queued; they must be
+     dispatched first.  */
+  while (wl_display_prepare_read (xw->display) != 0)
+    if (wl_display_dispatch_pending (xw->display) < 0)
+      return false;
+
+  if (wl_display_read_events (xw->display) < 0 && errno != EAGAIN)
+    return false;
+
+  return wl_display_dispatch_pending (xw->display) >= 0;
+}
+
+/* Flushes Wayland requests.  If the socket is full, waits for it to
+   become writable instead of blocking.  */
+static bool
+flush_wayland (xim_wayland_t *xw)
+{
+  uint32_t events = EPOLLIN | EPOLLET;
+
+  if (wl_display_flush (xw->display) < 0)
+    {
+      if (errno != EAGAIN)
+        return false;
+      events |= EPOLLOUT;
+    }
+
+  return xim_wayland_loop_update_fd (xw->loop, xw->wayland_source, events);
+}
+
+static bool
+handle_x_event (xim_wayland_server_t *server, xcb_generic_event_t *event)
+{
+  xcb_xim_dispatch_result_t result;
+  xcb_generic_error_t *error;
+
+  error = NULL;
+  result = xcb_xim_server_connection_dispatch (server->xim, event, &error);
+
+  switch (result)
+    {
+    case XCB_XIM_DISPATCH_ERROR:     /* Error in dispatching.  */
+      if (error)
+        {
+          fprintf (stderr, "can't dispatch XIM message: %i\n",
+                   error->error_code);
+          free (error);
+        }
+      else
+        fprintf (stderr, "can't dispatch XIM message\n");
+      return false;
+
+    case XCB_XIM_DISPATCH_CONTINUE:
+    case XCB_XIM_DISPATCH_REMOVE:
+      /* Client windows are also tracked as focus windows.  */
+      handle_window_event (server, event);
+      break;
+    }
+
+  return true;
+}
+
+static uint64_t
+get_time_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Tells the client that REQUEST failed, so that it doesn't wait for
+   a reply.  */
+static void
+reply_error (xim_wayland_server_t *server,
+             xcb_xim_generic_request_t *request,
+             xcb_xim_transport_t *requestor)
+{
+  xcb_xim_error_flag_t error_flag;
+  uint16_t input_method_id, input_context_id;
+
+  error_flag = xcb_xim_request_get_ids (requestor,
+                                        request,
+                                        &input_method_id,
+                                        &input_context_id);
+  xcb_xim_error (server->xim,
+                 requestor,
+                 input_method_id,
+                 input_context_id,
+                 error_flag,
+                 XCB_XIM_ERROR_BAD_SOMETHING,
+                 0,
+                 0,
+                 NULL,
+                 NULL);
+}
+
+/* A failed request only affects the client which sent it: it gets an
+   XIM_ERROR if it still waits for a reply, and is quarantined after
+   too many failures in a row.  */
+static bool
+handle_request (xim_wayland_server_t *server, xcb_xim_request_container_t *container)
+{
+  uint8_t major_opcode = container->request.major_opcode;
+  xcb_xim_transport_t *requestor = container->requestor;
+  xim_wayland_client_t *client;
+  xim_wayland_delay_statistics_t *delays;
+  xcb_generic_error_t *error;
+  uint64_t delay;
+  bool success;
+
+  if (server->focused_input_context
+      && (server->focused_input_context->input_method->transport
+          == container->requestor))
+    delays = &server->statistics.queue_delays[PRIORITY_FOCUSED];
+  else
+    delays = &server->statistics.queue_delays[PRIORITY_NORMAL];
+
+  delay = get_time_us () - container->queue_time;
+  delays->count++;
+  delays->total += delay;
+  if (delay > delays->max)
+    delays->max = delay;
+
+  client = requestor->user_data;
+  if (client && client->quarantined && major_opcode != XCB_XIM_DISCONNECT)
+    {
+      server->statistics.quarantined_requests++;
+      if (xcb_xim_server_connection_reply_pending (server->xim, container))
+        reply_error (server, &container->request, requestor);
+      xcb_xim_server_connection_release_request (server->xim, container);
+      return true;
+    }
+
+  error = NULL;
+  success = handle_xim_request (server,
+                                &container->request,
+                                requestor,
+                                &error);
+
+  /* XIM_DISCONNECT frees the transport.  */
+  if (success || major_opcode == XCB_XIM_DISCONNECT)
+    {
+      xcb_xim_server_connection_release_request (server->xim, container);
+      /* ...and the client with it.  */
+      if (success && client && major_opcode != XCB_XIM_DISCONNECT)
+        client->errors = 0;
+      free (error);
+      return success || !xcb_connection_has_error (server->connection);
+    }
+
+  server->statistics.request_errors[major_opcode]++;
+
+  if (error)
+    {
+      fprintf (stderr, "can't handle XIM request %i: %i\n",
+               major_opcode,
+               error->error_code);
+      free (error);
+    }
+  else
+    fprintf (stderr, "can't handle XIM request %i\n",
+             major_opcode);
+
+  /* Only a broken X connection affects other clients.  */
+  if (xcb_connection_has_error (server->connection))
+    {
+      xcb_xim_server_connection_release_request (server->xim, container);
+      return false;
+    }
+
+  /* Requests the client doesn't wait for, or which were already
+     answered, get nothing.  */
+  if (xcb_xim_server_connection_reply_pending (server->xim, container))
+    reply_error (server, &container->request, requestor);
+  xcb_xim_server_connection_release_request (server->xim, container);
+
+  client = get_client (server, requestor);
+  if (client && ++client->errors >= QUARANTINE_ERRORS)
+    {
+      fprintf (stderr, "quarantining XIM client 0x%x\n",
+               requestor->client_window);
+      client->quarantined = true;
+      free_client_input_methods (client);
+      server->statistics.quarantined_clients++;
+    }
+
+  return true;
+}
+
+/* Handles queued requests within the budget.  Requests from a client
+   are always handled in order, so priority is given per client.  */
+static bool
+schedule_requests (xim_wayland_server_t *server)
+{
+  xcb_xim_request_container_t *container;
+  xcb_xim_transport_t *transport;
+  int budget = REQUEST_BUDGET;
+  bool disconnect;
+  int i;
+
+  if (server->focused_input_context)
+    {
+      transport = server->focused_input_context->input_method->transport;
+      for (i = 0; i < FOCUSED_REQUEST_BUDGET; i++)
+        {
+          container =
+            xcb_xim_server_connection_poll_transport_request (server->xim,
+                                                              transport);
+          if (!container)
+            break;
+
+          /* The transport is freed with XIM_DISCONNECT.  */
+          disconnect = container->request.major_opcode == XCB_XIM_DISCONNECT;
+          if (!handle_request (server, container))
+            return false;
+          if (disconnect)
+            break;
+        }
+    }
+
+  while (budget > 0
+         && (transport =
+             xcb_xim_server_connection_next_ready_transport (server->xim))
+         != NULL)
+    for (i = 0; i < TRANSPORT_REQUEST_BUDGET && budget > 0; i++, budget--)
+      {
+        container =
+          xcb_xim_server_connection_poll_transport_request (server->xim,
+                                                            transport);
+        if (!container)
+          break;
+
+        disconnect = container->request.major_opcode == XCB_XIM_DISCONNECT;
+        if (!handle_request (server, container))
+          return false;
+        if (disconnect)
+          break;
+      }
+
+  return true;
+}
+
+/* Handles events until the socket is drained, or only those already
+   read into the queue of XCB if QUEUED is true.  Sets x_pending if
+   the budget is used up first.  */
+static bool
+handle_x_events (xim_wayland_server_t *server, bool queued)
+{
+  xcb_generic_event_t *event;
+  int budget = X_EVENT_BUDGET;
+
+  server->x_pending = false;
+
+  while ((event = queued
+          ? xcb_poll_for_queued_event (server->connection)
+          : xcb_poll_for_event (server->connection)) != NULL)
+    {
+      bool success;
+
+      success = handle_x_event (server, event);
+      free (event);
+
+      if (!success)
+        return false;
+
+      if (--budget == 0)
+        {
+          server->x_pending = true;
+          break;
+        }
+    }
+
+  if (xcb_connection_has_error (server->connection))
+    {
+      fprintf (stderr, "lost connection to X display %s\n", server->name);
+      return false;
+    }
+
+  return true;
+}
+
+static size_t
+get_resident_set_size (void)
+{
+  FILE *fp;
+  unsigned long size, resident;
+
+  fp = fopen ("/proc/self/statm", "r");
+  if (!fp)
+    return 0;
+
+  if (fscanf (fp, "%lu %lu", &size, &resident) != 2)
+    resident = 0;
+
+  fclose (fp);
+
+  return resident * sysconf (_SC_PAGESIZE);
+}
+
+static void
+trim_nested_attributes (xim_wayland_nested_attributes_t *nested)
+{
+  free (nested->encoded);
+  nested->encoded = NULL;
+}
+
+/* Releases what an input context can recreate on demand.  The Wayland
+   objects are kept while the input context has focus or preedit.  */
+static void
+trim_input_context (xim_wayland_input_context_t *input_context)
+{
+  trim_nested_attributes (&input_context->preedit_attributes);
+  trim_nested_attributes (&input_context->status_attributes);
+
+  if (input_context->focused || input_context->preedit_started)
+    return;
+
+  reset_preedit (input_context);
+  free_surrounding_text (input_context);
+
+  if (input_context->text_input)
+    {
+      dematerialize_input_context (input_context);
+      input_context->server->statistics.released_input_contexts++;
+    }
+}
+
+static void
+trim (xim_wayland_server_t *server)
+{
+  xim_wayland_input_method_t *input_method;
+  xim_wayland_input_context_t *input_context;
+  size_t before, after;
+
+  before = get_resident_set_size ();
+
+  /* Input contexts which lost their text input don't need their focus
+     window either; its origin is requested again on the next caret
+     move.  Those of focused input contexts are kept.  */
+  wl_list_for_each (input_method, &server->input_method_list, link)
+    wl_list_for_each (input_context, &input_method->input_context_list, link)
+      {
+        trim_input_context (input_context);
+        if (!input_context->text_input)
+          untrack_focus_window (input_context);
+      }
+
+  xcb_xim_server_connection_trim (server->xim);
+
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim (0);
+#endif
+
+  after = get_resident_set_size ();
+
+  server->statistics.trims++;
+  if (before > after)
+    server->statistics.reclaimed_bytes += before - after;
+
+  server->trimmed = true;
+}
+
+static void
+mark_activity (xim_wayland_server_t *server)
+{
+  server->last_activity = xim_wayland_loop_get_time ();
+  server->trimmed = false;
+
+  if (server->xw->idle_timeout > 0
+      && !xim_wayland_loop_timer_is_armed (server->idle_timer))
+    xim_wayland_loop_timer_arm (server->loop, server->idle_timer,
+                                server->xw->idle_timeout);
+}
+
+static void
+handle_idle_timeout (xim_wayland_loop_t *loop, void *data)
+{
+  xim_wayland_server_t *server = data;
+  uint64_t elapsed;
+
+  if (server->trimmed)
+    return;
+
+  /* The timer is not rearmed on every activity; check how long we
+     have really been idle.  */
+  elapsed = xim_wayland_loop_get_time () - server->last_activity;
+  if (elapsed < server->xw->idle_timeout)
+    {
+      xim_wayland_loop_timer_arm (loop, server->idle_timer,
+                                  server->xw->idle_timeout - elapsed);
+      return;
     }
-  if (!xcb_xim_str_iterator_has_data (&iterator))
-    return false;
 
-  return xcb_xim_encoding_negotiation_reply (xw->xim,
-                                             requestor,
-                                             input_method_id,
-                                             0,
-                                             iterator.index,
-                                             error);
+  trim (server);
 }
 
+/* Trims as soon as the resident set size exceeds the limit.  */
 static void
-set_values (xcb_xim_transport_t *transport,
-            xcb_xim_attribute_t **attributes,
-            uint16_t max_attribute_id,
-            xcb_xim_attribute_iterator_t iterator)
+check_resident_set_size (xim_wayland_server_t *server)
 {
-  for (; xcb_xim_attribute_iterator_has_data (&iterator);
-       xcb_xim_attribute_iterator_next (&iterator))
-    {
-      xcb_xim_attribute_t *attribute = iterator.data;
-      xcb_xim_attribute_t *attribute_copy;
-      uint16_t attribute_id = xcb_xim_card16 (transport,
-                                              attribute->attribute_id);
-      uint16_t attribute_byte_length =
-        4 + xcb_xim_card16 (transport,
-                            attribute->value_byte_length);
+  uint64_t now;
 
-      if (attribute_id >= max_attribute_id)
-        continue;
+  if (server->xw->rss_limit == 0)
+    return;
 
-      attribute_copy = malloc (attribute_byte_length);
-      if (!attribute_copy)
-        continue;
+  now = xim_wayland_loop_get_time ();
+  if (now - server->last_rss_check < RSS_CHECK_INTERVAL)
+    return;
 
-      memcpy (attribute_copy, attribute, attribute_byte_length);
+  server->last_rss_check = now;
+  if (get_resident_set_size () <= server->xw->rss_limit)
+    return;
 
-      free (attributes[attribute_id]);
-      attributes[attribute_id] = attribute_copy;
+  if (server->last_rss_trim == 0
+      || now - server->last_rss_trim >= RSS_TRIM_INTERVAL)
+    {
+      trim (server);
+      server->last_rss_trim = now;
     }
+
+  /* Keep checking while over the limit, even without activity.  */
+  if (!xim_wayland_loop_timer_is_armed (server->rss_timer))
+    xim_wayland_loop_timer_arm (server->loop, server->rss_timer,
+                                RSS_CHECK_INTERVAL);
+}
+
+static void
+handle_rss_timeout (xim_wayland_loop_t *loop, void *data)
+{
+  xim_wayland_server_t *server = data;
+
+  server->last_rss_check = 0;
+  check_resident_set_size (server);
 }
 
+/* The source is edge-triggered; read until the socket is empty, or
+   set wayland_pending if the budget is used up first.  */
 static bool
-handle_xim_set_im_values_request (xim_wayland_t *xw,
-                                  xcb_xim_generic_request_t *request,
-                                  xcb_xim_transport_t *requestor,
-                                  xcb_generic_error_t **error)
+read_wayland (xim_wayland_t *xw)
 {
-  xcb_xim_set_im_values_request_t *_set_im_values =
-    (xcb_xim_set_im_values_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _set_im_values->input_method_id);
-  xim_wayland_input_method_t *input_method;
-  xcb_xim_attribute_iterator_t iterator;
+  int fd = wl_display_get_fd (xw->display);
+  int available;
+  int i;
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  xw->wayland_pending = false;
 
-  iterator = xcb_xim_set_im_values_request_attribute_iterator (_set_im_values);
-  set_values (requestor,
-              input_method->attrs,
-              LAST_IM_ATTRIBUTE,
-              iterator);
+  for (i = 0; i < WAYLAND_READ_BUDGET; i++)
+    {
+      if (!handle_wayland_events (xw))
+        return false;
 
-  return xcb_xim_set_im_values_reply (xw->xim,
-                                      requestor,
-                                      input_method_id,
-                                      error);
+      if (ioctl (fd, FIONREAD, &available) < 0 || available == 0)
+        return true;
+    }
+
+  xw->wayland_pending = true;
+  return true;
+}
+
+/* Called in the Wayland thread.  */
+static void
+destroy_seat (xim_wayland_seat_t *seat)
+{
+  wl_seat_destroy (seat->wl_seat);
+  free (seat->name);
+  free (seat);
+}
+
+static void
+release_seat (xim_wayland_seat_t *seat)
+{
+  if (--seat->references == 0)
+    destroy_seat (seat);
+}
+
+/* Tells SERVER about SEAT, directly unless its thread is running.  */
+static void
+add_server_seat (xim_wayland_server_t *server, xim_wayland_seat_t *seat)
+{
+  seat->references++;
+
+  if (server->thread_started)
+    {
+      xim_wayland_message_t message;
+
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_SEAT_ADDED;
+      message.object = seat;
+      send_to_x (server, &message);
+    }
+  else if (!server_add_seat (server, seat))
+    release_seat (seat);
+}
+
+static void
+remove_server_seat (xim_wayland_server_t *server, xim_wayland_seat_t *seat)
+{
+  if (server->thread_started)
+    {
+      xim_wayland_message_t message;
+
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_SEAT_REMOVED;
+      message.object = seat;
+      send_to_x (server, &message);
+    }
+  else if (server_remove_seat (server, seat))
+    release_seat (seat);
+}
+
+static void
+announce_seat (xim_wayland_t *xw, xim_wayland_seat_t *seat)
+{
+  xim_wayland_server_t *server;
+
+  seat->announced = true;
+
+  wl_list_for_each (server, &xw->server_list, link)
+    add_server_seat (server, seat);
+}
+
+static void
+seat_handle_capabilities (void *data,
+                          struct wl_seat *wl_seat,
+                          uint32_t capabilities)
+{
+}
+
+static void
+seat_handle_name (void *data,
+                  struct wl_seat *wl_seat,
+                  const char *name)
+{
+  xim_wayland_seat_t *seat = data;
+
+  if (seat->announced)
+    return;
+
+  seat->name = strdup (name);
+  announce_seat (seat->xw, seat);
+}
+
+static const struct wl_seat_listener
+seat_listener =
+  {
+    seat_handle_capabilities,
+    seat_handle_name
+  };
+
+static void
+add_seat (xim_wayland_t *xw,
+          struct wl_registry *registry,
+          uint32_t global_name,
+          uint32_t version)
+{
+  xim_wayland_seat_t *seat;
+
+  seat = calloc (1, sizeof (xim_wayland_seat_t));
+  if (!seat)
+    return;
+
+  /* The name is needed to apply the seat policy.  */
+  if (version > WL_SEAT_NAME_SINCE_VERSION)
+    version = WL_SEAT_NAME_SINCE_VERSION;
+
+  seat->wl_seat =
+    wl_registry_bind (registry, global_name, &wl_seat_interface, version);
+  if (!seat->wl_seat)
+    {
+      free (seat);
+      return;
+    }
+
+  seat->xw = xw;
+  seat->global_name = global_name;
+  seat->references = 1;
+  wl_list_insert (xw->seat_list.prev, &seat->link);
+
+  wl_seat_add_listener (seat->wl_seat, &seat_listener, seat);
+
+  /* Otherwise, wait for the name.  */
+  if (version < WL_SEAT_NAME_SINCE_VERSION)
+    announce_seat (xw, seat);
+}
+
+static void
+remove_seat (xim_wayland_seat_t *seat)
+{
+  xim_wayland_server_t *server;
+
+  wl_list_remove (&seat->link);
+
+  if (seat->announced)
+    wl_list_for_each (server, &seat->xw->server_list, link)
+      remove_server_seat (server, seat);
+
+  release_seat (seat);
+}
+
+static void
+handle_wayland_source (xim_wayland_loop_t *loop,
+                       int fd,
+                       uint32_t events,
+                       void *data)
+{
+  xim_wayland_t *xw = data;
+  xim_wayland_server_t *server;
+
+  if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+    {
+      fprintf (stderr, "lost connection to Wayland display\n");
+      xim_wayland_loop_quit (loop, false);
+      return;
+    }
+
+  if ((events & EPOLLOUT) != 0 && !flush_wayland (xw))
+    {
+      xim_wayland_loop_quit (loop, false);
+      return;
+    }
+
+  if ((events & EPOLLIN) == 0)
+    return;
+
+  /* In threaded mode, this is done when the X threads receive the
+     relayed events.  */
+  if (!xw->threaded)
+    wl_list_for_each (server, &xw->server_list, link)
+      mark_activity (server);
+
+  if (!read_wayland (xw))
+    xim_wayland_loop_quit (loop, false);
+}
+
+static void
+handle_x_source (xim_wayland_loop_t *loop,
+                 int fd,
+                 uint32_t events,
+                 void *data)
+{
+  xim_wayland_server_t *server = data;
+
+  if ((events & (EPOLLERR | EPOLLHUP)) != 0)
+    {
+      fprintf (stderr, "lost connection to X display %s\n", server->name);
+      xim_wayland_loop_quit (loop, false);
+      return;
+    }
+
+  mark_activity (server);
+
+  if (!handle_x_events (server, false) || !schedule_requests (server))
+    xim_wayland_loop_quit (loop, false);
+}
+
+static void
+handle_quit_signal (xim_wayland_loop_t *loop, int signo, void *data)
+{
+  xim_wayland_loop_quit (loop, true);
+}
+
+static void
+handle_statistics_signal (xim_wayland_loop_t *loop, int signo, void *data)
+{
+  xim_wayland_t *xw = data;
+  xim_wayland_server_t *server;
+
+  if (!xw->threaded)
+    {
+      print_statistics (xw, stderr);
+      return;
+    }
+
+  print_startup_statistics (xw, stderr);
+
+  /* The statistics are only updated in the X threads.  */
+  wl_list_for_each (server, &xw->server_list, link)
+    {
+      xim_wayland_message_t message;
+
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_PRINT_STATISTICS;
+      send_to_x (server, &message);
+    }
 }
 
+/* Called before each wait.  Continues the work left by sources which
+   used up their budget.  Also, events may have been read into the
+   queues as a side effect of round trips in the handlers, and the
+   edge-triggered sources won't report them again.  */
 static bool
-handle_xim_get_im_values_request (xim_wayland_t *xw,
-                                  xcb_xim_generic_request_t *request,
-                                  xcb_xim_transport_t *requestor,
-                                  xcb_generic_error_t **error)
+prepare (xim_wayland_loop_t *loop, void *data)
 {
-  xcb_xim_get_im_values_request_t *_get_im_values =
-    (xcb_xim_get_im_values_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _get_im_values->input_method_id);
-  xim_wayland_input_method_t *input_method;
-  xcb_xim_attribute_id_iterator_t iterator;
-  uint16_t attributes_length;
-  uint16_t max_attributes_length;
-  xcb_xim_attribute_t **attributes;
-  bool success;
+  xim_wayland_t *xw = data;
+  xim_wayland_server_t *server;
+  bool pending;
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  if (xw->wayland_pending
+      ? !read_wayland (xw)
+      : wl_display_dispatch_pending (xw->display) < 0)
+    {
+      xim_wayland_loop_quit (loop, false);
+      return false;
+    }
 
-  max_attributes_length = 0;
-  attributes_length = 0;
-  attributes = NULL;
+  pending = xw->wayland_pending;
 
-  for (iterator =
-         xcb_xim_get_im_values_request_attribute_id_iterator (_get_im_values);
-       xcb_xim_attribute_id_iterator_has_data (&iterator);
-       xcb_xim_attribute_id_iterator_next (&iterator))
+  wl_list_for_each (server, &xw->server_list, link)
     {
-      uint16_t attribute_id = xcb_xim_card16 (requestor,
-                                              *iterator.data);
+      if (!handle_x_events (server, !server->x_pending)
+          || !schedule_requests (server))
+        {
+          xim_wayland_loop_quit (loop, false);
+          return false;
+        }
 
-      if (attribute_id >= LAST_IM_ATTRIBUTE)
-        continue;
+      xcb_xim_server_connection_refill_windows (server->xim);
+      xcb_flush (server->connection);
 
-      if (attributes_length == max_attributes_length)
+      check_resident_set_size (server);
+
+      pending = pending
+        || server->x_pending
+        || xcb_xim_server_connection_has_requests (server->xim);
+    }
+
+  if (!flush_wayland (xw))
+    {
+      fprintf (stderr, "can't flush Wayland requests\n");
+      xim_wayland_loop_quit (loop, false);
+      return false;
+    }
+
+  return pending;
+}
+
+/* Called in an X thread.  */
+static void
+handle_messages (xim_wayland_server_t *server)
+{
+  xim_wayland_message_t message;
+  int budget = MESSAGE_BUDGET;
+
+  server->messages_pending = false;
+
+  while (xim_wayland_queue_pop (server->to_x, &message))
+    {
+      handle_message (server, &message);
+
+      if (--budget == 0)
         {
-          max_attributes_length = max_attributes_length * 2 + 10;
-          attributes =
-            realloc (attributes,
-                     sizeof (xcb_xim_attribute_t *) * max_attributes_length);
+          server->messages_pending = true;
+          break;
         }
+    }
 
-      attributes[attributes_length++] = input_method->attrs[attribute_id];
+  /* Let the Wayland thread send what didn't fit.  */
+  if (budget < MESSAGE_BUDGET
+      && atomic_exchange (&server->x_overflowing, false))
+    {
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_DRAIN;
+      send_to_wayland (server, &message);
     }
+}
 
-  success = xcb_xim_get_im_values_reply (xw->xim,
-                                         requestor,
-                                         input_method_id,
-                                         attributes_length,
-                                         attributes,
-                                         error);
-  free (attributes);
-  return success;
+static void
+handle_to_x_source (xim_wayland_loop_t *loop,
+                    int fd,
+                    uint32_t events,
+                    void *data)
+{
+  xim_wayland_server_t *server = data;
+
+  xim_wayland_queue_clear_fd (server->to_x);
+  mark_activity (server);
+  handle_messages (server);
 }
 
-static bool
-handle_xim_create_ic_request (xim_wayland_t *xw,
-                              xcb_xim_generic_request_t *request,
-                              xcb_xim_transport_t *requestor,
-                              xcb_generic_error_t **error)
+static void
+handle_quit_source (xim_wayland_loop_t *loop,
+                    int fd,
+                    uint32_t events,
+                    void *data)
 {
-  xcb_xim_create_ic_request_t *_create_ic =
-    (xcb_xim_create_ic_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _create_ic->input_method_id);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
-  xcb_xim_attribute_iterator_t iterator;
-  bool success;
+  xim_wayland_loop_quit (loop, true);
+}
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+static bool
+prepare_x_thread (xim_wayland_loop_t *loop, void *data)
+{
+  xim_wayland_server_t *server = data;
 
-  input_context =
-    xim_wayland_input_context_new (xw,
-                                   input_method,
-                                   ++input_method->input_context_counter);
-  if (!input_context)
-    return false;
+  flush_overflow (server);
 
-  iterator = xcb_xim_create_ic_request_attribute_iterator (_create_ic);
-  set_values (requestor,
-              input_context->attrs,
-              LAST_IC_ATTRIBUTE,
-              iterator);
+  if (server->messages_pending)
+    handle_messages (server);
 
-  success = xcb_xim_create_ic_reply (xw->xim,
-                                     requestor,
-                                     input_method_id,
-                                     input_context->id,
-                                     error);
-  if (!success)
+  if (!handle_x_events (server, !server->x_pending)
+      || !schedule_requests (server))
     {
-      xim_wayland_input_context_free (input_context);
+      xim_wayland_loop_quit (loop, false);
       return false;
     }
 
-  wl_list_insert (&input_method->input_context_list, &input_context->link);
-  return success;
-}
+  xcb_xim_server_connection_refill_windows (server->xim);
+  xcb_flush (server->connection);
 
-static bool
-handle_xim_destroy_ic_request (xim_wayland_t *xw,
-                               xcb_xim_generic_request_t *request,
-                               xcb_xim_transport_t *requestor,
-                               xcb_generic_error_t **error)
-{
-  xcb_xim_destroy_ic_request_t *_destroy_ic =
-    (xcb_xim_destroy_ic_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _destroy_ic->input_method_id);
-  uint16_t input_context_id = xcb_xim_card16 (requestor,
-                                              _destroy_ic->input_context_id);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
+  /* If the socket is full, let the Wayland thread wait for it.  */
+  if (wl_display_flush (server->xw->display) < 0)
+    {
+      xim_wayland_message_t message;
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+      if (errno != EAGAIN)
+        {
+          fprintf (stderr, "can't flush Wayland requests\n");
+          xim_wayland_loop_quit (loop, false);
+          return false;
+        }
 
-  input_context = find_input_context (input_method, input_context_id);
-  if (!input_context)
-    return false;
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_FLUSH;
+      send_to_wayland (server, &message);
+    }
 
-  wl_list_remove (&input_context->link);
-  xim_wayland_input_context_free (input_context);
+  check_resident_set_size (server);
 
-  return xcb_xim_destroy_ic_reply (xw->xim,
-                                   requestor,
-                                   input_method_id,
-                                   input_context_id,
-                                   error);
+  return server->x_pending
+    || server->messages_pending
+    || server->overflow
+    || xcb_xim_server_connection_has_requests (server->xim);
 }
 
-static bool
-handle_xim_set_ic_values_request (xim_wayland_t *xw,
-                                  xcb_xim_generic_request_t *request,
-                                  xcb_xim_transport_t *requestor,
-                                  xcb_generic_error_t **error)
+/* Called in the Wayland thread.  */
+static void
+handle_to_wayland_source (xim_wayland_loop_t *loop,
+                          int fd,
+                          uint32_t events,
+                          void *data)
 {
-  xcb_xim_set_ic_values_request_t *_set_ic_values =
-    (xcb_xim_set_ic_values_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _set_ic_values->input_method_id);
-  uint16_t input_context_id = xcb_xim_card16 (requestor,
-                                              _set_ic_values->input_context_id);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
-  xcb_xim_attribute_iterator_t iterator;
-
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  xim_wayland_server_t *server = data;
+  xim_wayland_message_t message;
+
+  xim_wayland_queue_clear_fd (server->to_wayland);
+
+  while (xim_wayland_queue_pop (server->to_wayland, &message))
+    switch (message.type)
+      {
+      case MESSAGE_RETIRE:
+        /* The text input was destroyed before this was sent, so no
+           more events refer to the input context.  */
+        message.type = MESSAGE_RETIRED;
+        send_to_x (server, &message);
+        break;
 
-  input_context = find_input_context (input_method, input_context_id);
-  if (!input_context)
-    return false;
+      case MESSAGE_SEAT_RELEASED:
+        release_seat (message.object);
+        break;
 
-  iterator = xcb_xim_set_ic_values_request_attribute_iterator (_set_ic_values);
-  set_values (requestor,
-              input_context->attrs,
-              LAST_IC_ATTRIBUTE,
-              iterator);
+      case MESSAGE_STOPPED:
+        xim_wayland_loop_quit (loop, false);
+        break;
 
-  return xcb_xim_set_ic_values_reply (xw->xim,
-                                      requestor,
-                                      input_method_id,
-                                      input_context_id,
-                                      error);
+      case MESSAGE_FLUSH:
+      case MESSAGE_DRAIN:
+        /* Done in prepare_wayland_thread.  */
+      default:
+        break;
+      }
 }
 
 static bool
-handle_xim_get_ic_values_request (xim_wayland_t *xw,
-                                  xcb_xim_generic_request_t *request,
-                                  xcb_xim_transport_t *requestor,
-                                  xcb_generic_error_t **error)
+prepare_wayland_thread (xim_wayland_loop_t *loop, void *data)
 {
-  xcb_xim_get_ic_values_request_t *_get_ic_values =
-    (xcb_xim_get_ic_values_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _get_ic_values->input_method_id);
-  uint16_t input_context_id = xcb_xim_card16 (requestor,
-                                              _get_ic_values->input_context_id);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
-  xcb_xim_attribute_id_iterator_t iterator;
-  uint16_t attributes_length;
-  uint16_t max_attributes_length;
-  xcb_xim_attribute_t **attributes;
-  bool success;
+  xim_wayland_t *xw = data;
+  xim_wayland_server_t *server;
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  wl_list_for_each (server, &xw->server_list, link)
+    if (server->x_overflow)
+      flush_x_overflow (server);
 
-  input_context = find_input_context (input_method, input_context_id);
-  if (!input_context)
-    return false;
+  if ((xw->wayland_pending
+       ? !read_wayland (xw)
+       : wl_display_dispatch_pending (xw->display) < 0)
+      || !flush_wayland (xw))
+    {
+      xim_wayland_loop_quit (loop, false);
+      return false;
+    }
 
-  max_attributes_length = 0;
-  attributes_length = 0;
-  attributes = NULL;
+  return xw->wayland_pending;
+}
 
-  for (iterator =
-         xcb_xim_get_ic_values_request_attribute_id_iterator (_get_ic_values);
-       xcb_xim_attribute_id_iterator_has_data (&iterator);
-       xcb_xim_attribute_id_iterator_next (&iterator))
-    {
-      uint16_t attribute_id = xcb_xim_card16 (requestor,
-                                              *iterator.data);
+/* Called in an X thread which has failed.  Keeps consuming messages,
+   so that they don't pile up in the Wayland thread, until it asks this
+   one to quit.  Sleeps in between, waking up periodically only while
+   messages to the Wayland thread are left over.  */
+static void
+wait_for_quit (xim_wayland_server_t *server)
+{
+  struct pollfd fds[2];
+  xim_wayland_message_t message;
 
-      if (attribute_id >= LAST_IC_ATTRIBUTE)
-        continue;
+  fds[0].fd = server->quit_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = xim_wayland_queue_get_fd (server->to_x);
+  fds[1].events = POLLIN;
 
-      if (attributes_length == max_attributes_length)
+  while (true)
+    {
+      flush_overflow (server);
+
+      xim_wayland_queue_clear_fd (server->to_x);
+      while (xim_wayland_queue_pop (server->to_x, &message))
+        switch (message.type)
+          {
+          case MESSAGE_RETIRED:
+            free (message.input_context);
+            break;
+
+          case MESSAGE_SEAT_ADDED:
+            message.type = MESSAGE_SEAT_RELEASED;
+            send_to_wayland (server, &message);
+            break;
+
+          default:
+            free_message (&message);
+            break;
+          }
+
+      if (poll (fds, SIZEOF (fds),
+                server->overflow ? OVERFLOW_RETRY_INTERVAL : -1) < 0
+          && errno != EINTR)
         {
-          max_attributes_length = max_attributes_length * 2 + 10;
-          attributes =
-            realloc (attributes,
-                     sizeof (xcb_xim_attribute_t *) * max_attributes_length);
+          fprintf (stderr, "can't wait for the Wayland thread: %s\n",
+                   strerror (errno));
+          return;
         }
 
-      attributes[attributes_length++] = input_context->attrs[attribute_id];
+      if (fds[0].revents & POLLIN)
+        return;
     }
-
-  success = xcb_xim_get_ic_values_reply (xw->xim,
-                                         requestor,
-                                         input_method_id,
-                                         input_context_id,
-                                         attributes_length,
-                                         attributes,
-                                         error);
-  free (attributes);
-  return success;
 }
 
-static bool
-handle_xim_set_ic_focus_request (xim_wayland_t *xw,
-                                 xcb_xim_generic_request_t *request,
-                                 xcb_xim_transport_t *requestor,
-                                 xcb_generic_error_t **error)
+static void *
+server_thread_main (void *data)
 {
-  xcb_xim_set_ic_focus_request_t *_set_ic_focus =
-    (xcb_xim_set_ic_focus_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _set_ic_focus->input_method_id);
-  uint16_t input_context_id = xcb_xim_card16 (requestor,
-                                              _set_ic_focus->input_context_id);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
-
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  xim_wayland_server_t *server = data;
 
-  input_context = find_input_context (input_method, input_context_id);
-  if (!input_context)
-    return false;
-
-  if (!input_context->text_input)
-    return false;
+  if (!xim_wayland_loop_run (server->loop))
+    {
+      xim_wayland_message_t message;
 
-  wl_text_input_show_input_panel (input_context->text_input);
-  wl_text_input_activate (input_context->text_input,
-                          xw->seat,
-                          input_context->surface);
-  wl_display_flush (xw->display);
+      memset (&message, 0, sizeof (message));
+      message.type = MESSAGE_STOPPED;
+      send_to_wayland (server, &message);
+      wait_for_quit (server);
+    }
 
-  return true;
+  atomic_store (&server->thread_running, false);
+  return NULL;
 }
 
-static bool
-handle_xim_unset_ic_focus_request (xim_wayland_t *xw,
-                                   xcb_xim_generic_request_t *request,
-                                   xcb_xim_transport_t *requestor,
-                                   xcb_generic_error_t **error)
+/* Called in the Wayland thread, once the X thread has stopped.  */
+static void
+discard_messages (xim_wayland_server_t *server)
 {
-  xcb_xim_unset_ic_focus_request_t *_unset_ic_focus =
-    (xcb_xim_unset_ic_focus_request_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _unset_ic_focus->input_method_id);
-  uint16_t input_context_id = xcb_xim_card16 (requestor,
-                                              _unset_ic_focus->input_context_id);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
-
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  xim_wayland_message_t message;
+
+  /* Seats being removed are still referenced by the server, and
+     released with it.  */
+  while (xim_wayland_queue_pop (server->to_x, &message))
+    if (message.type == MESSAGE_RETIRED)
+      free (message.input_context);
+    else if (message.type == MESSAGE_SEAT_ADDED)
+      release_seat (message.object);
+    else
+      free_message (&message);
+
+  while (server->x_overflow)
+    {
+      struct xim_wayland_overflow_t *next = server->x_overflow->next;
 
-  input_context = find_input_context (input_method, input_context_id);
-  if (!input_context)
-    return false;
+      if (server->x_overflow->message.type == MESSAGE_RETIRED)
+        free (server->x_overflow->message.input_context);
+      else if (server->x_overflow->message.type == MESSAGE_SEAT_ADDED)
+        release_seat (server->x_overflow->message.object);
+      else
+        free_message (&server->x_overflow->message);
+      free (server->x_overflow);
+      server->x_overflow = next;
+    }
+  server->x_overflow_tail = NULL;
+  server->x_overflow_length = 0;
 
-  if (!input_context->text_input)
-    return false;
+  /* Input contexts which were never retired.  */
+  while (server->overflow)
+    {
+      struct xim_wayland_overflow_t *next = server->overflow->next;
+
+      if (server->overflow->message.type == MESSAGE_RETIRE)
+        free (server->overflow->message.input_context);
+      else if (server->overflow->message.type == MESSAGE_SEAT_RELEASED)
+        release_seat (server->overflow->message.object);
+      free (server->overflow);
+      server->overflow = next;
+    }
+  server->overflow_tail = NULL;
 
-  wl_text_input_deactivate (input_context->text_input,
-                            xw->seat);
-  return true;
+  while (xim_wayland_queue_pop (server->to_wayland, &message))
+    if (message.type == MESSAGE_RETIRE)
+      free (message.input_context);
+    else if (message.type == MESSAGE_SEAT_RELEASED)
+      release_seat (message.object);
 }
 
-static bool
-handle_xim_preedit_caret_reply (xim_wayland_t *xw,
-                                xcb_xim_generic_request_t *request,
-                                xcb_xim_transport_t *requestor,
-                                xcb_generic_error_t **error)
+static void
+stop_server_thread (xim_wayland_server_t *server)
 {
-  xcb_xim_preedit_caret_reply_t *_preedit_caret =
-    (xcb_xim_preedit_caret_reply_t *) request;
-  uint16_t input_method_id = xcb_xim_card16 (requestor,
-                                             _preedit_caret->input_method_id);
-  uint16_t input_context_id = xcb_xim_card16 (requestor,
-                                              _preedit_caret->input_context_id);
-  uint32_t position = xcb_xim_card32 (requestor,
-                                      _preedit_caret->position);
-  xim_wayland_input_method_t *input_method;
-  xim_wayland_input_context_t *input_context;
+  uint64_t value = 1;
 
-  input_method = find_input_method (xw, requestor, input_method_id);
-  if (!input_method)
-    return false;
+  /* Not queued, so that it doesn't wait for room behind the other
+     messages; those are discarded once the thread has stopped.  */
+  if (write (server->quit_fd, &value, sizeof (value)) < 0)
+    fprintf (stderr, "can't stop thread for X display %s: %s\n",
+             server->name, strerror (errno));
 
-  input_context = find_input_context (input_method, input_context_id);
-  if (!input_context)
-    return false;
+  pthread_join (server->thread, NULL);
+  server->thread_started = false;
 
-  if (!input_context->text_input)
-    return false;
+  discard_messages (server);
+}
 
-  if (position > input_context->preedit_length)
-    input_context->preedit_caret = position;
+static bool
+start_server_thread (xim_wayland_server_t *server)
+{
+  atomic_store (&server->thread_running, true);
+  if (pthread_create (&server->thread, NULL,
+                      server_thread_main, server) != 0)
+    {
+      atomic_store (&server->thread_running, false);
+      fprintf (stderr, "can't create thread for X display %s\n",
+               server->name);
+      return false;
+    }
 
+  server->thread_started = true;
   return true;
 }
 
-typedef bool (* xim_wayland_xim_request_handler_t) (
-  xim_wayland_t *xw,
-  xcb_xim_generic_request_t *request,
-  xcb_xim_transport_t *requestor,
-  xcb_generic_error_t **error);
-
-static const struct
-{
-  uint8_t major_opcode;
-  xim_wayland_xim_request_handler_t handler;
-} xim_request_handlers[] =
-  {
-    { XCB_XIM_OPEN, handle_xim_open_request },
-    { XCB_XIM_CLOSE, handle_xim_close_request },
-    { XCB_XIM_QUERY_EXTENSION, handle_xim_query_extension_request },
-    { XCB_XIM_ENCODING_NEGOTIATION, handle_xim_encoding_negotiation_request },
-    { XCB_XIM_SET_IM_VALUES, handle_xim_set_im_values_request },
-    { XCB_XIM_GET_IM_VALUES, handle_xim_get_im_values_request },
-    { XCB_XIM_CREATE_IC, handle_xim_create_ic_request },
-    { XCB_XIM_DESTROY_IC, handle_xim_destroy_ic_request },
-    { XCB_XIM_SET_IC_VALUES, handle_xim_set_ic_values_request },
-    { XCB_XIM_GET_IC_VALUES, handle_xim_get_ic_values_request },
-    { XCB_XIM_SET_IC_FOCUS, handle_xim_set_ic_focus_request },
-    { XCB_XIM_UNSET_IC_FOCUS, handle_xim_unset_ic_focus_request },
-    { XCB_XIM_PREEDIT_CARET_REPLY, handle_xim_preedit_caret_reply }
-    /* Note that we intentionally ignore XIM_FORWARD_EVENT request,
-       because key press/release events are directly delivered to
-       input method under Wayland.  */
-  };
-
+/* Registers the sources of SERVER, in its own loop if threaded.  */
 static bool
-handle_xim_request (xim_wayland_t *xw,
-                    xcb_xim_generic_request_t *request,
-                    xcb_xim_transport_t *requestor,
-                    xcb_generic_error_t **error)
+setup_server (xim_wayland_server_t *server)
 {
-  int i;
+  xim_wayland_t *xw = server->xw;
 
-  for (i = 0; i < SIZEOF (xim_request_handlers); i++)
+  server->loop = xw->loop;
+
+  if (xw->threaded)
     {
-      if (xim_request_handlers[i].major_opcode == request->major_opcode)
-        return xim_request_handlers[i].handler (xw, request, requestor, error);
+      server->loop = xim_wayland_loop_new ();
+      server->to_x = xim_wayland_queue_new (sizeof (xim_wayland_message_t),
+                                            MESSAGE_QUEUE_CAPACITY);
+      server->to_wayland =
+        xim_wayland_queue_new (sizeof (xim_wayland_message_t),
+                               MESSAGE_QUEUE_CAPACITY);
+      if (!server->loop || !server->to_x || !server->to_wayland)
+        return false;
+
+      server->to_x_source =
+        xim_wayland_loop_add_fd (server->loop,
+                                 xim_wayland_queue_get_fd (server->to_x),
+                                 EPOLLIN,
+                                 handle_to_x_source, server);
+      if (!server->to_x_source)
+        return false;
+
+      server->to_wayland_source =
+        xim_wayland_loop_add_fd (xw->loop,
+                                 xim_wayland_queue_get_fd (server->to_wayland),
+                                 EPOLLIN,
+                                 handle_to_wayland_source, server);
+      if (!server->to_wayland_source)
+        return false;
+
+      server->quit_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (server->quit_fd < 0)
+        return false;
+
+      server->quit_source = xim_wayland_loop_add_fd (server->loop,
+                                                     server->quit_fd,
+                                                     EPOLLIN,
+                                                     handle_quit_source,
+                                                     server);
+      if (!server->quit_source)
+        return false;
+
+      xim_wayland_loop_set_prepare_func (server->loop,
+                                         prepare_x_thread, server);
     }
 
-  return true;
-}
+  server->x_source =
+    xim_wayland_loop_add_fd (server->loop,
+                             xcb_get_file_descriptor (server->connection),
+                             EPOLLIN | EPOLLET,
+                             handle_x_source, server);
+  if (!server->x_source)
+    return false;
 
-static bool
-handle_wayland_events (xim_wayland_t *xw)
-{
-  int ret;
+  server->idle_timer = xim_wayland_loop_add_timer (server->loop,
+                                                   handle_idle_timeout,
+                                                   server);
+  if (!server->idle_timer)
+    return false;
 
-  ret = wl_display_dispatch (xw->display);
-  if (ret < 0)
+  server->rss_timer = xim_wayland_loop_add_timer (server->loop,
+                                                  handle_rss_timeout,
+                                                  server);
+  if (!server->rss_timer)
+    return false;
+
+  server->cursor_timer = xim_wayland_loop_add_timer (server->loop,
+                                                     handle_cursor_timeout,
+                                                     server);
+  if (!server->cursor_timer)
     return false;
 
   return true;
 }
 
-static bool
-handle_x_events (xim_wayland_t *xw)
+static void
+teardown_server (xim_wayland_server_t *server)
 {
-  xcb_generic_event_t *event;
+  xim_wayland_t *xw = server->xw;
 
-  while ((event = xcb_poll_for_event (xw->connection)) != NULL)
-    {
-      xcb_xim_dispatch_result_t result;
-      xcb_xim_request_container_t *container;
-      xcb_generic_error_t *error;
+  if (server->idle_timer)
+    xim_wayland_loop_remove_timer (server->loop, server->idle_timer);
+  server->idle_timer = NULL;
 
-      error = NULL;
-      result = xcb_xim_server_connection_dispatch (xw->xim, event, &error);
+  if (server->rss_timer)
+    xim_wayland_loop_remove_timer (server->loop, server->rss_timer);
+  server->rss_timer = NULL;
 
-      switch (result)
-        {
-        case XCB_XIM_DISPATCH_ERROR:     /* Error in dispatching.  */
-          if (error)
-            {
-              fprintf (stderr, "can't dispatch XIM message: %i\n",
-                       error->error_code);
-              free (error);
-            }
-          else
-            fprintf (stderr, "can't dispatch XIM message\n");
-          free (event);
-          return false;
+  if (server->cursor_timer)
+    xim_wayland_loop_remove_timer (server->loop, server->cursor_timer);
+  server->cursor_timer = NULL;
 
-        case XCB_XIM_DISPATCH_CONTINUE:
-          /* Ignore unrelated events.  */
+  if (server->x_source)
+    xim_wayland_loop_remove_fd (server->loop, server->x_source);
+  server->x_source = NULL;
 
-        case XCB_XIM_DISPATCH_REMOVE:
-          break;
-        }
+  if (server->to_x_source)
+    xim_wayland_loop_remove_fd (server->loop, server->to_x_source);
+  server->to_x_source = NULL;
 
-      while ((container = xcb_xim_server_connection_poll_request (xw->xim))
-             != NULL)
-        {
-          uint8_t major_opcode = container->request.major_opcode;
-          bool success;
+  if (server->to_wayland_source)
+    xim_wayland_loop_remove_fd (xw->loop, server->to_wayland_source);
+  server->to_wayland_source = NULL;
 
-          error = NULL;
-          success = handle_xim_request (xw,
-                                        &container->request,
-                                        container->requestor,
-                                        &error);
-          free (container);
+  if (server->quit_source)
+    xim_wayland_loop_remove_fd (server->loop, server->quit_source);
+  server->quit_source = NULL;
 
-          if (!success)
-            {
-              if (error)
-                {
-                  fprintf (stderr, "can't handle XIM request %i: %i\n",
-                           major_opcode,
-                           error->error_code);
-                  free (error);
-                }
-              else
-                fprintf (stderr, "can't handle XIM request %i\n",
-                         major_opcode);
-              free (event);
-              return false;
-            }
-        }
-      free (event);
-    }
-  return true;
+  if (server->quit_fd >= 0)
+    close (server->quit_fd);
+  server->quit_fd = -1;
+
+  if (server->loop && server->loop != xw->loop)
+    xim_wayland_loop_free (server->loop);
+  server->loop = NULL;
+
+  if (server->to_x)
+    xim_wayland_queue_free (server->to_x);
+  server->to_x = NULL;
+
+  if (server->to_wayland)
+    xim_wayland_queue_free (server->to_wayland);
+  server->to_wayland = NULL;
 }
 
 static bool
 main_loop (xim_wayland_t *xw)
 {
-  struct pollfd fds[2];
+  static const int quit_signals[] = { SIGTERM, SIGINT, SIGHUP };
+  xim_wayland_server_t *server;
+  bool success;
+  int i;
 
-  memset (fds, 0, sizeof (fds));
+  xw->loop = xim_wayland_loop_new ();
+  if (!xw->loop)
+    return false;
 
-  fds[0].fd = wl_display_get_fd (xw->display);
-  fds[0].events = POLLIN | POLLERR | POLLHUP;
+  success = false;
 
-  fds[1].fd = xcb_get_file_descriptor (xw->connection);
-  fds[1].events = POLLIN | POLLERR | POLLHUP;
+  xw->wayland_source =
+    xim_wayland_loop_add_fd (xw->loop,
+                             wl_display_get_fd (xw->display),
+                             EPOLLIN | EPOLLET,
+                             handle_wayland_source, xw);
+  if (!xw->wayland_source)
+    goto out;
 
-  while (true)
+  for (i = 0; i < SIZEOF (quit_signals); i++)
+    if (!xim_wayland_loop_add_signal (xw->loop, quit_signals[i],
+                                      handle_quit_signal, xw))
+      goto out;
+
+  if (!xim_wayland_loop_add_signal (xw->loop, SIGUSR1,
+                                    handle_statistics_signal, xw))
+    goto out;
+
+  wl_list_for_each (server, &xw->server_list, link)
     {
-      if (poll (fds, SIZEOF (fds), -1) < 0)
-        return false;
+      if (!setup_server (server))
+        goto out;
 
-      if ((fds[0].revents & (POLLERR | POLLHUP)) != 0)
-        {
-          fprintf (stderr, "lost connection to Wayland display\n");
-          return false;
-        }
+      mark_activity (server);
+    }
 
-      if ((fds[1].revents & (POLLERR | POLLHUP)) != 0)
-        {
-          fprintf (stderr, "lost connection to X display\n");
-          return false;
-        }
+  xim_wayland_loop_set_prepare_func (xw->loop,
+                                     xw->threaded
+                                     ? prepare_wayland_thread
+                                     : prepare,
+                                     xw);
 
-      if (fds[0].revents)
-        {
-          if (!handle_wayland_events (xw))
-            return false;
-          fds[0].revents = 0;
-        }
+  /* Signals are blocked at this point, and so in the new threads.  */
+  if (xw->threaded)
+    {
+      xw->threads_started = true;
+      wl_list_for_each (server, &xw->server_list, link)
+        if (!start_server_thread (server))
+          goto out;
+    }
 
-      if (fds[1].revents)
-        {
-          if (!handle_x_events (xw))
-            return false;
-          fds[1].revents = 0;
-        }
+  success = xim_wayland_loop_run (xw->loop);
+
+ out:
+  wl_list_for_each (server, &xw->server_list, link)
+    {
+      if (server->thread_started)
+        stop_server_thread (server);
+
+      teardown_server (server);
     }
 
-  return true;
+  if (xw->wayland_source)
+    xim_wayland_loop_remove_fd (xw->loop, xw->wayland_source);
+  xw->wayland_source = NULL;
+
+  xim_wayland_loop_free (xw->loop);
+  xw->loop = NULL;
+
+  return success;
 }
 
 static void
@@ -1429,12 +5869,21 @@ registry_handle_global (void *data,
 {
   xim_wayland_t *xw = data;
 
+  /* Seats come and go; the X threads are told about them.  */
+  if (strcmp (interface, "wl_seat") == 0)
+    {
+      add_seat (xw, registry, id, version);
+      return;
+    }
+
+  /* In threaded mode, the X threads use the other globals once
+     started.  */
+  if (xw->threads_started)
+    return;
+
   if (strcmp (interface, "wl_text_input_manager") == 0)
     xw->text_input_manager =
       wl_registry_bind (registry, id, &wl_text_input_manager_interface, 1);
-  else if (strcmp (interface, "wl_seat") == 0)
-    xw->seat =
-      wl_registry_bind (registry, id, &wl_seat_interface, 1);
   else if (strcmp (interface, "wl_compositor") == 0)
     xw->compositor =
       wl_registry_bind (registry, id, &wl_compositor_interface, 1);
@@ -1445,6 +5894,15 @@ registry_handle_global_remove (void *data,
                                struct wl_registry *registry,
                                uint32_t name)
 {
+  xim_wayland_t *xw = data;
+  xim_wayland_seat_t *seat;
+
+  wl_list_for_each (seat, &xw->seat_list, link)
+    if (seat->global_name == name)
+      {
+        remove_seat (seat);
+        return;
+      }
 }
 
 static const struct wl_registry_listener
@@ -1454,42 +5912,368 @@ registry_listener =
     registry_handle_global_remove
   };
 
+static xim_wayland_server_t *
+xim_wayland_server_new (xim_wayland_t *xw,
+                        const char *display_name,
+                        const char *locale)
+{
+  xim_wayland_server_t *server;
+  const char *seat_name;
+
+  server = calloc (1, sizeof (xim_wayland_server_t));
+  if (!server)
+    return NULL;
+
+  server->xw = xw;
+  server->quit_fd = -1;
+  wl_list_init (&server->input_method_list);
+  wl_list_init (&server->client_list);
+  wl_list_init (&server->seat_list);
+  wl_list_init (&server->cursor_list);
+  wl_list_init (&server->window_list);
+  id_allocator_init (&server->input_method_ids,
+                     &server->statistics.input_method_ids);
+
+  if (!display_name)
+    display_name = getenv ("DISPLAY");
+  if (!display_name)
+    display_name = "";
+
+  /* DISPLAY@SEAT */
+  seat_name = strchr (display_name, '@');
+  if (seat_name)
+    {
+      server->name = strndup (display_name, seat_name - display_name);
+      server->seat_name = strdup (seat_name + 1);
+      if (!server->seat_name)
+        goto error;
+    }
+  else
+    server->name = strdup (display_name);
+  if (!server->name)
+    goto error;
+
+  server->connection = xcb_connect (*server->name ? server->name : NULL,
+                                    NULL);
+  if (!server->connection || xcb_connection_has_error (server->connection))
+    {
+      fprintf (stderr, "cannot open X display %s\n", server->name);
+      goto error;
+    }
+
+  /* Only send the first requests; see setup_servers().  */
+  server->xim = xcb_xim_server_connection_begin (server->connection,
+                                                 "wayland",
+                                                 locale);
+  if (!server->xim)
+    {
+      fprintf (stderr, "can't create XIM server on %s\n", server->name);
+      goto error;
+    }
+
+  return server;
+
+ error:
+  if (server->connection)
+    xcb_disconnect (server->connection);
+  free (server->name);
+  free (server->seat_name);
+  free (server);
+  return NULL;
+}
+
+/* Finishes the setup of all servers.  Each step waits for one round
+   trip, so the round trips to the displays overlap each other.  */
+static bool
+setup_servers (xim_wayland_t *xw)
+{
+  xim_wayland_server_t *server;
+  xcb_generic_error_t *error;
+  bool done, all_done;
+
+  do
+    {
+      all_done = true;
+
+      wl_list_for_each (server, &xw->server_list, link)
+        {
+          error = NULL;
+          if (!xcb_xim_server_connection_setup (server->xim, &done, &error))
+            {
+              if (error)
+                {
+                  fprintf (stderr, "can't create XIM server on %s: %i\n",
+                           server->name,
+                           error->error_code);
+                  free (error);
+                }
+              else
+                fprintf (stderr, "can't create XIM server on %s\n",
+                         server->name);
+              return false;
+            }
+
+          all_done = all_done && done;
+        }
+    }
+  while (!all_done);
+
+  return true;
+}
+
+/* Tells the parent that clients can connect, by writing a newline to
+   FD and closing it.  */
+static void
+notify_ready (int fd)
+{
+  ssize_t ret;
+
+  do
+    ret = write (fd, "\n", 1);
+  while (ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+    fprintf (stderr, "can't write to ready fd %d: %s\n",
+             fd, strerror (errno));
+
+  close (fd);
+}
+
+/* Frees the input methods and seats of SERVER, which need the Wayland
+   connection.  */
+static void
+free_wayland_state (xim_wayland_server_t *server)
+{
+  xim_wayland_client_t *client, *next;
+  xim_wayland_server_seat_t *server_seat, *next_seat;
+
+  /* This frees all input methods.  */
+  wl_list_for_each_safe (client, next, &server->client_list, link)
+    free_client (client);
+
+  wl_list_for_each_safe (server_seat, next_seat, &server->seat_list, link)
+    {
+      wl_list_remove (&server_seat->link);
+      release_seat (server_seat->seat);
+      free (server_seat);
+    }
+}
+
+/* free_wayland_state() must have been called.  */
+static void
+xim_wayland_server_free (xim_wayland_server_t *server)
+{
+  xim_wayland_window_t *window, *next;
+  xcb_generic_error_t *error;
+
+  id_allocator_destroy (&server->input_method_ids);
+
+  /* Deregister, unless the display is gone anyway.  */
+  error = NULL;
+  if (!xcb_connection_has_error (server->connection)
+      && !xcb_xim_server_connection_shutdown (server->xim, &error))
+    {
+      if (error)
+        {
+          fprintf (stderr, "can't deregister XIM server on %s: %i\n",
+                   server->name,
+                   error->error_code);
+          free (error);
+        }
+      else
+        fprintf (stderr, "can't deregister XIM server on %s\n",
+                 server->name);
+    }
+
+  wl_list_for_each_safe (window, next, &server->window_list, link)
+    free_window (server, window);
+
+  xcb_xim_server_connection_free (server->xim);
+  xcb_disconnect (server->connection);
+
+  free (server->name);
+  free (server->seat_name);
+  free (server);
+}
+
+/* Parses a key such as "Control+space" or "Shift+0xff21": modifiers
+   separated by '+', followed by a keysym name, a printable ASCII
+   character, or a numeric keysym.  Only the common names of input
+   method keys are known.  */
+static bool
+parse_trigger_key (const char *spec, xcb_xim_triggerkey_t *key)
+{
+  static const struct
+  {
+    const char *name;
+    uint32_t mask;
+  } modifiers[] =
+    {
+      { "Shift", XCB_MOD_MASK_SHIFT },
+      { "Lock", XCB_MOD_MASK_LOCK },
+      { "Control", XCB_MOD_MASK_CONTROL },
+      { "Alt", XCB_MOD_MASK_1 },
+      { "Mod1", XCB_MOD_MASK_1 },
+      { "Mod2", XCB_MOD_MASK_2 },
+      { "Mod3", XCB_MOD_MASK_3 },
+      { "Mod4", XCB_MOD_MASK_4 },
+      { "Mod5", XCB_MOD_MASK_5 }
+    };
+  static const struct
+  {
+    const char *name;
+    uint32_t keysym;
+  } keysyms[] =
+    {
+      { "space", 0x0020 },
+      { "Multi_key", 0xff20 },
+      { "Kanji", 0xff21 },
+      { "Muhenkan", 0xff22 },
+      { "Henkan", 0xff23 },
+      { "Hiragana_Katakana", 0xff27 },
+      { "Zenkaku_Hankaku", 0xff2a },
+      { "Eisu_toggle", 0xff30 },
+      { "Hangul", 0xff31 },
+      { "Hangul_Hanja", 0xff34 }
+    };
+  const char *start, *end;
+  size_t i;
+
+  memset (key, 0, sizeof (xcb_xim_triggerkey_t));
+
+  for (start = spec; (end = strchr (start, '+')) != NULL; start = end + 1)
+    {
+      for (i = 0; i < SIZEOF (modifiers); i++)
+        if (strlen (modifiers[i].name) == (size_t) (end - start)
+            && strncmp (modifiers[i].name, start, end - start) == 0)
+          break;
+
+      if (i == SIZEOF (modifiers))
+        return false;
+
+      key->modifier |= modifiers[i].mask;
+    }
+
+  key->modifier_mask = key->modifier;
+
+  for (i = 0; i < SIZEOF (keysyms); i++)
+    if (strcmp (keysyms[i].name, start) == 0)
+      {
+        key->keysym = keysyms[i].keysym;
+        return true;
+      }
+
+  if (start[0] > 0x20 && start[0] < 0x7f && start[1] == '\0')
+    {
+      key->keysym = start[0];
+      return true;
+    }
+
+  if (strncmp (start, "0x", 2) == 0)
+    {
+      unsigned long keysym;
+      char *endptr;
+
+      errno = 0;
+      keysym = strtoul (start, &endptr, 16);
+      if (errno == 0 && *endptr == '\0' && keysym > 0
+          && keysym <= UINT32_MAX)
+        {
+          key->keysym = keysym;
+          return true;
+        }
+    }
+
+  return false;
+}
+
 static void
 print_usage (FILE *stream)
 {
   fprintf (stream,
            "Usage: xim-wayland OPTIONS...\n"
            "where OPTIONS are:\n"
+           "  --display, -d=DISPLAY[@SEAT]\n"
+           "                       Serve X DISPLAY, preferably on Wayland\n"
+           "                       SEAT; may be given more than once\n"
+           "                       (default: $DISPLAY)\n"
            "  --locale, -l=LOCALE  Specify locale (default: C,en)\n"
+           "  --idle-timeout, -i=SECONDS\n"
+           "                       Release unused resources after SECONDS of\n"
+           "                       inactivity; 0 disables (default: 60)\n"
+           "  --rss-limit, -r=MEGABYTES\n"
+           "                       Release unused resources whenever the\n"
+           "                       resident set size exceeds MEGABYTES\n"
+           "  --threads, -t        Serve each X display in a separate thread\n"
+           "  --ready-fd=FD        Write a newline to FD and close it once\n"
+           "                       clients can connect and the Wayland\n"
+           "                       globals are known\n"
+           "  --trigger-key=KEY    Let clients turn input on and off with KEY,\n"
+           "                       such as Control+space, and only then use\n"
+           "                       Wayland; may be given more than once\n"
+           "  --statistics, -s     Print statistics on exit\n"
            "  --help, -h           Show this help\n");
 }
 
 #define LOCALES "C,en"
+#define IDLE_TIMEOUT 60
+
+/* Long options without a short form.  */
+#define READY_FD_OPTION 256
+#define TRIGGER_KEY_OPTION 257
 
 int
 main (int argc, char **argv)
 {
   int c;
+  char **opt_displays;
+  size_t opt_displays_length;
   char *opt_locale;
+  bool opt_statistics;
+  long opt_idle_timeout;
+  long opt_rss_limit;
+  long opt_ready_fd;
+  char *endptr;
+  uint64_t start_time;
   xim_wayland_t xw;
-  xim_wayland_input_method_t *input_method, *next;
-  xcb_generic_error_t *error;
+  xim_wayland_server_t *server, *next;
+  xim_wayland_seat_t *seat, *next_seat;
   bool success;
+  size_t i;
 
+  opt_displays = NULL;
+  opt_displays_length = 0;
   opt_locale = NULL;
+  opt_statistics = false;
+  opt_idle_timeout = IDLE_TIMEOUT;
+  opt_rss_limit = 0;
+  opt_ready_fd = -1;
   success = true;
 
+  start_time = get_time_us ();
+
+  memset (&xw, 0, sizeof (xw));
+  wl_list_init (&xw.seat_list);
+  wl_list_init (&xw.server_list);
+
   while (true)
     {
       int option_index;
       static struct option long_options[] =
         {
+          { "display", required_argument, 0, 'd' },
           { "locale", required_argument, 0, 'l' },
+          { "idle-timeout", required_argument, 0, 'i' },
+          { "rss-limit", required_argument, 0, 'r' },
+          { "statistics", no_argument, 0, 's' },
+          { "threads", no_argument, 0, 't' },
+          { "ready-fd", required_argument, 0, READY_FD_OPTION },
+          { "trigger-key", required_argument, 0, TRIGGER_KEY_OPTION },
           { "help", no_argument, 0, 'h' },
           { NULL, 0, 0, 0 }
         };
 
-      c = getopt_long (argc, argv, "hl:", long_options, &option_index);
+      c = getopt_long (argc, argv, "d:hi:l:r:st", long_options, &option_index);
       if (c == -1)
         break;
 
@@ -1500,10 +6284,85 @@ main (int argc, char **argv)
           goto out;
           break;
 
+        case 'd':
+          {
+            char **displays;
+
+            displays = realloc (opt_displays,
+                                sizeof (char *) * (opt_displays_length + 1));
+            if (!displays)
+              {
+                success = false;
+                goto out;
+              }
+            opt_displays = displays;
+            opt_displays[opt_displays_length++] = optarg;
+          }
+          break;
+
         case 'l':
           opt_locale = strdup (optarg);
           break;
 
+        case 'i':
+          errno = 0;
+          opt_idle_timeout = strtol (optarg, &endptr, 10);
+          if (errno != 0 || *endptr != '\0' || opt_idle_timeout < 0)
+            {
+              success = false;
+              fprintf (stderr, "invalid idle timeout: %s\n", optarg);
+              goto out;
+            }
+          break;
+
+        case 'r':
+          errno = 0;
+          opt_rss_limit = strtol (optarg, &endptr, 10);
+          if (errno != 0 || *endptr != '\0' || opt_rss_limit < 0)
+            {
+              success = false;
+              fprintf (stderr, "invalid RSS limit: %s\n", optarg);
+              goto out;
+            }
+          break;
+
+        case 's':
+          opt_statistics = true;
+          break;
+
+        case 't':
+          xw.threaded = true;
+          break;
+
+        case READY_FD_OPTION:
+          errno = 0;
+          opt_ready_fd = strtol (optarg, &endptr, 10);
+          if (errno != 0 || *endptr != '\0'
+              || opt_ready_fd < 0 || opt_ready_fd > INT_MAX)
+            {
+              success = false;
+              fprintf (stderr, "invalid ready fd: %s\n", optarg);
+              goto out;
+            }
+          break;
+
+        case TRIGGER_KEY_OPTION:
+          if (xw.trigger_keys_length == MAX_TRIGGER_KEYS)
+            {
+              success = false;
+              fprintf (stderr, "too many trigger keys\n");
+              goto out;
+            }
+          if (!parse_trigger_key (optarg,
+                                  &xw.trigger_keys[xw.trigger_keys_length]))
+            {
+              success = false;
+              fprintf (stderr, "invalid trigger key: %s\n", optarg);
+              goto out;
+            }
+          xw.trigger_keys_length++;
+          break;
+
         default:
           success = false;
           print_usage (stderr);
@@ -1515,8 +6374,16 @@ main (int argc, char **argv)
   if (!opt_locale)
     opt_locale = strdup (LOCALES);
 
-  memset (&xw, 0, sizeof (xw));
-  wl_list_init (&xw.input_method_list);
+  xw.idle_timeout = (uint64_t) opt_idle_timeout * 1000;
+  xw.rss_limit = (size_t) opt_rss_limit * 1024 * 1024;
+
+  if (!init_handshake (&xw.handshakes[0], 'l')
+      || !init_handshake (&xw.handshakes[1], 'B'))
+    {
+      success = false;
+      fprintf (stderr, "can't initialize XIM replies\n");
+      goto out;
+    }
 
   xw.display = wl_display_connect (NULL);
   if (!xw.display)
@@ -1526,60 +6393,85 @@ main (int argc, char **argv)
       goto out;
     }
 
+  /* Bring up the Wayland and X connections concurrently: send the
+     registry request now and only wait for the globals once the X
+     servers are set up.  */
   xw.registry = wl_display_get_registry (xw.display);
-
   wl_registry_add_listener (xw.registry, &registry_listener, &xw);
-  wl_display_dispatch (xw.display);
+  wl_display_flush (xw.display);
+
+  /* Without --display, serve $DISPLAY.  */
+  for (i = 0; i < (opt_displays_length > 0 ? opt_displays_length : 1); i++)
+    {
+      const char *display_name =
+        opt_displays_length > 0 ? opt_displays[i] : NULL;
+
+      server = xim_wayland_server_new (&xw, display_name, opt_locale);
+      if (!server)
+        {
+          success = false;
+          goto out;
+        }
 
-  xw.connection = xcb_connect (NULL, NULL);
-  if (!xw.connection)
+      wl_list_insert (xw.server_list.prev, &server->link);
+    }
+
+  if (!setup_servers (&xw))
     {
       success = false;
-      fprintf (stderr, "cannot open X display\n");
       goto out;
     }
 
-  error = NULL;
-  xw.xim = xcb_xim_server_connection_new (xw.connection,
-                                          "wayland",
-                                          opt_locale,
-                                          &error);
-  if (!xw.xim)
+  /* Requests from clients connecting from now on queue up in the X
+     connections until the main loop starts.  */
+  xw.startup_ready_time = get_time_us () - start_time;
+
+  /* The servers are already in the list, so the seats are announced
+     to them as they are added.  */
+  if (wl_display_roundtrip (xw.display) < 0)
     {
       success = false;
-      if (error)
-        {
-          fprintf (stderr, "can't create XIM server: %i\n",
-                   error->error_code);
-          free (error);
-        }
-      else
-        fprintf (stderr, "can't create XIM server\n");
-
+      fprintf (stderr, "lost connection to Wayland display\n");
       goto out;
     }
+  xw.startup_time = get_time_us () - start_time;
+
+  /* Only now can input contexts get a text input, so that clients
+     started right away don't come up without input.  */
+  if (opt_ready_fd >= 0)
+    notify_ready (opt_ready_fd);
 
   success = main_loop (&xw);
 
  out:
-  wl_registry_destroy (xw.registry);
+  if (xw.registry)
+    wl_registry_destroy (xw.registry);
 
-  wl_list_for_each_safe (input_method, next,
-                         &xw.input_method_list, link)
+  wl_list_for_each (server, &xw.server_list, link)
+    free_wayland_state (server);
+
+  if (opt_statistics)
+    print_statistics (&xw, stderr);
+
+  wl_list_for_each_safe (seat, next_seat, &xw.seat_list, link)
     {
-      wl_list_remove (&input_method->link);
-      xim_wayland_input_method_free (input_method);
+      wl_list_remove (&seat->link);
+      release_seat (seat);
     }
 
   if (xw.display)
     wl_display_disconnect (xw.display);
 
-  if (xw.xim)
-    xcb_xim_server_connection_free (xw.xim);
+  wl_list_for_each_safe (server, next, &xw.server_list, link)
+    {
+      wl_list_remove (&server->link);
+      xim_wayland_server_free (server);
+    }
 
-  if (xw.connection)
-    xcb_disconnect (xw.connection);
+  free_handshake (&xw.handshakes[0]);
+  free_handshake (&xw.handshakes[1]);
 
+  free (opt_displays);
   free (opt_locale);
 
   return success ? EXIT_SUCCESS : EXIT_FAILURE;
@@ -0,0 +1,159 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Daiki Ueno
+ */
+
+#include "config.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "queue.h"
+
+/* Keep the indices on separate cache lines, so that the producer and
+   the consumer don't invalidate each other's cache on every access.  */
+#define CACHE_LINE_SIZE 64
+
+struct xim_wayland_queue_t
+{
+  size_t element_size;
+  size_t mask;                  /* capacity - 1 */
+  int fd;
+  uint8_t *elements;
+
+  /* Written by the consumer.  */
+  _Alignas (CACHE_LINE_SIZE) atomic_size_t head;
+
+  /* Written by the producer.  */
+  _Alignas (CACHE_LINE_SIZE) atomic_size_t tail;
+};
+
+xim_wayland_queue_t *
+xim_wayland_queue_new (size_t element_size, size_t capacity)
+{
+  xim_wayland_queue_t *queue;
+  size_t size;
+
+  for (size = 1; size < capacity; size <<= 1)
+    ;
+
+  queue = aligned_alloc (CACHE_LINE_SIZE, sizeof (xim_wayland_queue_t));
+  if (!queue)
+    return NULL;
+
+  queue->element_size = element_size;
+  queue->mask = size - 1;
+  atomic_init (&queue->head, 0);
+  atomic_init (&queue->tail, 0);
+
+  queue->elements = malloc (element_size * size);
+  if (!queue->elements)
+    {
+      free (queue);
+      return NULL;
+    }
+
+  queue->fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (queue->fd < 0)
+    {
+      free (queue->elements);
+      free (queue);
+      return NULL;
+    }
+
+  return queue;
+}
+
+void
+xim_wayland_queue_free (xim_wayland_queue_t *queue)
+{
+  close (queue->fd);
+  free (queue->elements);
+  free (queue);
+}
+
+int
+xim_wayland_queue_get_fd (xim_wayland_queue_t *queue)
+{
+  return queue->fd;
+}
+
+bool
+xim_wayland_queue_push (xim_wayland_queue_t *queue, const void *element)
+{
+  size_t head, tail;
+
+  tail = atomic_load_explicit (&queue->tail, memory_order_relaxed);
+  head = atomic_load_explicit (&queue->head, memory_order_acquire);
+
+  if (tail - head > queue->mask)
+    return false;
+
+  memcpy (queue->elements + (tail & queue->mask) * queue->element_size,
+          element,
+          queue->element_size);
+
+  atomic_store_explicit (&queue->tail, tail + 1, memory_order_seq_cst);
+
+  /* Wake up the consumer only if it may have seen the queue empty.  */
+  head = atomic_load_explicit (&queue->head, memory_order_seq_cst);
+  if (head == tail)
+    {
+      uint64_t value = 1;
+      ssize_t ret;
+
+      ret = write (queue->fd, &value, sizeof (value));
+      (void) ret;
+    }
+
+  return true;
+}
+
+bool
+xim_wayland_queue_pop (xim_wayland_queue_t *queue, void *element)
+{
+  size_t head, tail;
+
+  /* Pairs with the store of the tail and the load of the head in
+     xim_wayland_queue_push, so that either this sees the new element
+     or the producer sees the queue drained and writes the eventfd.  */
+  head = atomic_load_explicit (&queue->head, memory_order_relaxed);
+  tail = atomic_load_explicit (&queue->tail, memory_order_seq_cst);
+
+  if (head == tail)
+    return false;
+
+  memcpy (element,
+          queue->elements + (head & queue->mask) * queue->element_size,
+          queue->element_size);
+
+  atomic_store_explicit (&queue->head, head + 1, memory_order_seq_cst);
+
+  return true;
+}
+
+void
+xim_wayland_queue_clear_fd (xim_wayland_queue_t *queue)
+{
+  uint64_t value;
+
+  while (read (queue->fd, &value, sizeof (value)) > 0)
+    ;
+}
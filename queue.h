@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Author: Daiki Ueno
+ */
+
+#ifndef __XIM_WAYLAND_QUEUE_H__
+#define __XIM_WAYLAND_QUEUE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A bounded lock-free queue of fixed-size elements between exactly
+   one producer thread and one consumer thread.  The consumer is woken
+   up through an eventfd, which is written when an element is pushed
+   to an empty queue.  */
+
+typedef struct xim_wayland_queue_t xim_wayland_queue_t;
+
+/* CAPACITY is rounded up to a power of two.  */
+xim_wayland_queue_t *
+xim_wayland_queue_new (size_t element_size, size_t capacity);
+
+void
+xim_wayland_queue_free (xim_wayland_queue_t *queue);
+
+/* Returns the eventfd to wait on in the consumer.  */
+int
+xim_wayland_queue_get_fd (xim_wayland_queue_t *queue);
+
+/* Producer side.  Copies ELEMENT into the queue, or returns false if
+   the queue is full.  */
+bool
+xim_wayland_queue_push (xim_wayland_queue_t *queue, const void *element);
+
+/* Consumer side.  Copies the oldest element into ELEMENT, or returns
+   false if the queue is empty.  */
+bool
+xim_wayland_queue_pop (xim_wayland_queue_t *queue, void *element);
+
+/* Consumer side.  Resets the eventfd; call it before popping.  */
+void
+xim_wayland_queue_clear_fd (xim_wayland_queue_t *queue);
+
+#endif
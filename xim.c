@@ -27,11 +27,11 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <time.h>
 #include "xim.h"
 
 #define XCB_XIM_CONNECT 1
 #define XCB_XIM_CONNECT_REPLY 2
-#define XCB_XIM_DISCONNECT 3
 #define XCB_XIM_DISCONNECT_REPLY 4
 
 #define XCB_XIM_OPEN_REPLY 31
@@ -157,10 +157,59 @@ static const char *atom_names[] =
     "TRANSPORT",
   };
 
-struct xcb_xim_list_t
+/* Request containers are handed out with a private header.  A slot
+   either comes from the pool, with room for a request sent in a
+   ClientMessage, or owns the memory BUFFER points to: either a
+   borrowed xcb_get_property_reply_t the slot lives in, or the slot
+   itself.  */
+struct xcb_xim_request_slot_t
 {
-  void *data;
-  struct xcb_xim_list_t *next;
+  struct xcb_xim_request_slot_t *next; /* request queue or pool */
+  void *buffer;
+  xcb_xim_request_container_t container;
+};
+
+#define REQUEST_SLOT_OFFSET                                     \
+  offsetof (struct xcb_xim_request_slot_t, container.request)
+
+/* Maximum length of a request sent in a ClientMessage.  */
+#define CLIENT_MESSAGE_DATA_LENGTH 20
+
+#define REQUEST_SLOT_SIZE (REQUEST_SLOT_OFFSET + CLIENT_MESSAGE_DATA_LENGTH)
+
+/* Number of unused slots kept in the pool.  */
+#define REQUEST_POOL_MAX 64
+
+/* Number of server windows created ahead of connection requests, so
+   that a burst of clients, such as at login, is accepted without
+   waiting for window creation.  */
+#define WINDOW_POOL_SIZE 16
+
+/* Transport with its queue of requests.  */
+struct xcb_xim_client_t
+{
+  xcb_xim_transport_t transport;
+
+  struct xcb_xim_request_slot_t *requests;
+  struct xcb_xim_request_slot_t *requests_tail;
+
+  /* Link in the round-robin list of clients with queued requests.  */
+  bool ready;
+  struct xcb_xim_client_t *next_ready;
+
+  /* Set on DestroyNotify for the client window.  */
+  bool destroyed;
+
+  /* Reply to the request being handled which the client waits for,
+     or 0, and the ids of that request.  Only messages sent between
+     polling the request and releasing it, which refer to the same
+     ids, count as the reply.  See
+     xcb_xim_server_connection_release_request().  */
+  uint8_t awaited_reply;
+  bool handling;
+  uint8_t awaited_ids;          /* xcb_xim_error_flag_t */
+  uint16_t awaited_input_method_id;
+  uint16_t awaited_input_context_id;
 };
 
 struct xcb_xim_server_connection_t
@@ -169,184 +218,655 @@ struct xcb_xim_server_connection_t
   char *locale;
   xcb_screen_t *screen;
   xcb_atom_t atoms[LAST_ATOM];
+  xcb_atom_t server_atom;
+  int nscreens;
 
   xcb_window_t accept_window;
 
-  xcb_xim_transport_t *clients;
+  /* Connection setup, see xcb_xim_server_connection_setup().  */
+  int setup_state;
+  xcb_intern_atom_cookie_t intern_atom_cookies[LAST_ATOM + 1];
+  xcb_get_selection_owner_cookie_t get_selection_owner_cookie;
+  xcb_get_property_cookie_t *get_property_cookies;
+  xcb_get_property_reply_t **property_replies;
+  xcb_atom_t *other_servers;
+  size_t nother_servers;
+  xcb_get_selection_owner_cookie_t *other_owner_cookies;
+  bool grabbed;
+
+  /* Transports are allocated separately, so that pointers to them
+     stay valid when the table is resized.  */
+  xcb_xim_transport_t **clients;
   size_t nclients;
   size_t maxclients;
 
-  struct xcb_xim_list_t *requests;
-  struct xcb_xim_list_t *requests_tail;
+  struct xcb_xim_client_t *ready;
+  struct xcb_xim_client_t *ready_tail;
+
+  struct xcb_xim_request_slot_t *pool;
+  size_t pool_length;
+
+  xcb_window_t window_pool[WINDOW_POOL_SIZE];
+  size_t window_pool_length;
+
+  /* Windows with StructureNotify selected, by the transports and by
+     xcb_xim_server_connection_watch_window(), which share the event
+     mask of the connection.  */
+  struct xcb_xim_watch_t *watches;
+  size_t nwatches;
+  size_t maxwatches;
+
+  uint64_t closed_transports;
+  uint64_t destroyed_transports;
+  uint64_t malformed_requests;
+
+  /* Default replies sent, by the major opcode of the request.  */
+  uint64_t default_replies[256];
+};
+
+enum
+  {
+    SETUP_ATOMS,
+    SETUP_REGISTRATION,
+    SETUP_PRUNING,
+    SETUP_DONE,
+    SETUP_FAILED,
+    SETUP_SHUTDOWN
+  };
+
+struct xcb_xim_watch_t
+{
+  xcb_window_t window;
+  unsigned int references;
+};
+
+struct xcb_xim_reply_t
+{
+  uint8_t endian;
+  size_t length;
+                                /* n: serialized reply */
 };
 
+static xcb_window_t
+create_server_window (xcb_xim_server_connection_t *xim)
+{
+  xcb_window_t window;
+
+  window = xcb_generate_id (xim->connection);
+  xcb_create_window (xim->connection,
+                     XCB_COPY_FROM_PARENT,
+                     window,
+                     xim->screen->root,
+                     0, 0,
+                     1, 1,
+                     1,
+                     XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                     xim->screen->root_visual,
+                     0,
+                     NULL);
+
+  return window;
+}
+
+static void
+fill_window_pool (xcb_xim_server_connection_t *xim)
+{
+  while (xim->window_pool_length < WINDOW_POOL_SIZE)
+    xim->window_pool[xim->window_pool_length++] =
+      create_server_window (xim);
+}
+
+/* Sends the requests of the first round trip of the setup: the atoms,
+   including the one named after the server.  */
 static bool
-init_atoms (xcb_connection_t *connection,
-            xcb_atom_t *atoms,
-            xcb_generic_error_t **error)
+request_atoms (xcb_xim_server_connection_t *xim, const char *name)
 {
-  xcb_intern_atom_cookie_t intern_atom_cookies[LAST_ATOM];
-  xcb_intern_atom_reply_t *intern_atom_reply;
+  char *atom_name;
   int i;
 
-  for (i = 0; i < SIZEOF (atom_names); i++)
-    intern_atom_cookies[i] =
-      xcb_intern_atom (connection,
+  if (asprintf (&atom_name, "@server=%s", name) < 1)
+    return false;
+
+  for (i = 0; i < (int) SIZEOF (atom_names); i++)
+    xim->intern_atom_cookies[i] =
+      xcb_intern_atom (xim->connection,
                        0,
                        strlen (atom_names[i]),
                        atom_names[i]);
 
-  for (i = 0; i < SIZEOF (atom_names); i++)
+  xim->intern_atom_cookies[LAST_ATOM] =
+    xcb_intern_atom (xim->connection,
+                     0,
+                     strlen (atom_name),
+                     atom_name);
+  free (atom_name);
+
+  return true;
+}
+
+static bool
+receive_atoms (xcb_xim_server_connection_t *xim,
+               xcb_generic_error_t **error)
+{
+  xcb_intern_atom_reply_t *intern_atom_reply;
+  int i;
+
+  for (i = 0; i <= LAST_ATOM; i++)
     {
-      intern_atom_reply = xcb_intern_atom_reply (connection,
-                                                 intern_atom_cookies[i],
-                                                 error);
+      intern_atom_reply =
+        xcb_intern_atom_reply (xim->connection,
+                               xim->intern_atom_cookies[i],
+                               error);
       if (!intern_atom_reply)
-        return false;
+        {
+          for (i++; i <= LAST_ATOM; i++)
+            xcb_discard_reply (xim->connection,
+                               xim->intern_atom_cookies[i].sequence);
+          return false;
+        }
 
-      atoms[i] = intern_atom_reply->atom;
+      if (i < LAST_ATOM)
+        xim->atoms[i] = intern_atom_reply->atom;
+      else
+        xim->server_atom = intern_atom_reply->atom;
       free (intern_atom_reply);
     }
 
   return true;
 }
 
-bool
-init_transport (xcb_xim_server_connection_t *xim,
-                const char *name,
-                xcb_generic_error_t **error)
+/* Returns the atoms in a reply for XIM_SERVERS, or NULL if the
+   property has the wrong type.  */
+static xcb_atom_t *
+get_server_atoms (xcb_get_property_reply_t *get_property_reply,
+                  int *nitems)
+{
+  *nitems = 0;
+
+  if (get_property_reply->type != XCB_NONE
+      && (get_property_reply->type != XCB_ATOM_ATOM
+          || get_property_reply->format != 32))
+    return NULL;
+
+  *nitems = xcb_get_property_value_length (get_property_reply)
+    / sizeof (xcb_atom_t);
+  return xcb_get_property_value (get_property_reply);
+}
+
+static bool
+has_atom (const xcb_atom_t *atoms, size_t natoms, xcb_atom_t atom)
+{
+  size_t i;
+
+  for (i = 0; i < natoms; i++)
+    if (atoms[i] == atom)
+      return true;
+
+  return false;
+}
+
+/* Sends the requests of the second round trip: the current owner of
+   the selection, and XIM_SERVERS on the root window of every screen,
+   since clients look up XIM_SERVERS on the root of their own screen.
+   The selection and the accept window are per display.  The server
+   is grabbed until XIM_SERVERS is rewritten, so that concurrent
+   updates from other servers are not lost.  */
+static void
+request_registration (xcb_xim_server_connection_t *xim)
 {
-  const xcb_setup_t *setup;
   xcb_screen_iterator_t iter;
-  xcb_intern_atom_cookie_t intern_atom_cookie;
-  xcb_intern_atom_reply_t *intern_atom_reply;
-  xcb_get_property_cookie_t get_property_cookie;
-  xcb_get_property_reply_t *get_property_reply;
-  xcb_atom_t *data = NULL;
-  int nitems;
-  char *atom_name;
-  xcb_atom_t atom;
   int i;
 
-  /* Create a window that accepts incoming connections.  */
-  setup = xcb_get_setup (xim->connection);
-  iter = xcb_setup_roots_iterator (setup);
-  xim->screen = iter.data;
+  xcb_grab_server (xim->connection);
+  xim->grabbed = true;
 
-  xim->accept_window = xcb_generate_id (xim->connection);
-  xcb_create_window (xim->connection,
-                     XCB_COPY_FROM_PARENT,
-                     xim->accept_window,
-                     xim->screen->root,
-                     0, 0,
-                     1, 1,
-                     1,
-                     XCB_WINDOW_CLASS_INPUT_OUTPUT,
-                     xim->screen->root_visual,
-                     0,
-                     NULL);
+  xim->get_selection_owner_cookie =
+    xcb_get_selection_owner (xim->connection, xim->server_atom);
 
-  /* Advertise server name through window property.  */
-  if (asprintf (&atom_name, "@server=%s", name) < 1)
-    return false;
+  iter = xcb_setup_roots_iterator (xcb_get_setup (xim->connection));
+  for (i = 0; iter.rem > 0; i++, xcb_screen_next (&iter))
+    xim->get_property_cookies[i] =
+      xcb_get_property (xim->connection,
+                        0,
+                        iter.data->root,
+                        xim->atoms[XIM_SERVERS],
+                        XCB_ATOM_ATOM,
+                        0,
+                        UINT_MAX);
+}
 
-  intern_atom_cookie = xcb_intern_atom (xim->connection,
-                                        false,
-                                        strlen (atom_name),
-                                        atom_name);
-  free (atom_name);
+static void
+end_registration (xcb_xim_server_connection_t *xim)
+{
+  int i;
+
+  if (xim->property_replies)
+    for (i = 0; i < xim->nscreens; i++)
+      free (xim->property_replies[i]);
+  free (xim->property_replies);
+  xim->property_replies = NULL;
+
+  free (xim->other_servers);
+  xim->other_servers = NULL;
+  xim->nother_servers = 0;
 
-  intern_atom_reply = xcb_intern_atom_reply (xim->connection,
-                                             intern_atom_cookie,
-                                             error);
-  if (!intern_atom_reply)
+  free (xim->other_owner_cookies);
+  xim->other_owner_cookies = NULL;
+
+  if (xim->grabbed)
+    {
+      xcb_ungrab_server (xim->connection);
+      xim->grabbed = false;
+    }
+
+  xcb_flush (xim->connection);
+}
+
+/* Takes the selection and puts the server atom first in XIM_SERVERS,
+   leaving out other_servers which are not running.  Changing the
+   property also lets clients notice the new owner if the atom was
+   already there.  */
+static bool
+finish_registration (xcb_xim_server_connection_t *xim)
+{
+  xcb_screen_iterator_t iter;
+  xcb_atom_t *atoms, *data;
+  int nitems, natoms;
+  int i, j;
+
+  xcb_set_selection_owner (xim->connection,
+                           xim->accept_window,
+                           xim->server_atom,
+                           XCB_CURRENT_TIME);
+
+  iter = xcb_setup_roots_iterator (xcb_get_setup (xim->connection));
+  for (i = 0; i < xim->nscreens; i++, xcb_screen_next (&iter))
+    {
+      data = get_server_atoms (xim->property_replies[i], &nitems);
+
+      atoms = malloc (sizeof (xcb_atom_t) * (nitems + 1));
+      if (!atoms)
+        return false;
+
+      natoms = 0;
+      atoms[natoms++] = xim->server_atom;
+      for (j = 0; j < nitems; j++)
+        if (has_atom (xim->other_servers, xim->nother_servers, data[j])
+            && !has_atom (atoms, natoms, data[j]))
+          atoms[natoms++] = data[j];
+
+      xcb_change_property (xim->connection,
+                           XCB_PROP_MODE_REPLACE,
+                           iter.data->root,
+                           xim->atoms[XIM_SERVERS],
+                           XCB_ATOM_ATOM,
+                           32,
+                           natoms,
+                           (const void *) atoms);
+      free (atoms);
+    }
+
+  return true;
+}
+
+/* Receives the replies of the second round trip.  Returns with *DONE
+   unset if the third round trip is needed, to find out which of the
+   other servers in XIM_SERVERS are still running.  */
+static bool
+check_registration (xcb_xim_server_connection_t *xim,
+                    bool *done,
+                    xcb_generic_error_t **error)
+{
+  xcb_get_selection_owner_reply_t *get_selection_owner_reply;
+  xcb_atom_t *data;
+  int nitems, total;
+  int i, j;
+  bool success;
+
+  *done = false;
+
+  /* Don't take over the selection from a running server.  */
+  get_selection_owner_reply =
+    xcb_get_selection_owner_reply (xim->connection,
+                                   xim->get_selection_owner_cookie,
+                                   error);
+  success = get_selection_owner_reply
+    && (get_selection_owner_reply->owner == XCB_WINDOW_NONE
+        || get_selection_owner_reply->owner == xim->accept_window);
+  free (get_selection_owner_reply);
+
+  xim->property_replies =
+    calloc (xim->nscreens, sizeof (xcb_get_property_reply_t *));
+  if (!xim->property_replies)
+    success = false;
+
+  total = 0;
+  for (i = 0; i < xim->nscreens; i++)
+    {
+      if (!success)
+        {
+          xcb_discard_reply (xim->connection,
+                             xim->get_property_cookies[i].sequence);
+          continue;
+        }
+
+      xim->property_replies[i] =
+        xcb_get_property_reply (xim->connection,
+                                xim->get_property_cookies[i],
+                                error);
+      if (!xim->property_replies[i]
+          || !get_server_atoms (xim->property_replies[i], &nitems))
+        {
+          success = false;
+          continue;
+        }
+
+      total += nitems;
+    }
+
+  if (!success)
     return false;
 
-  atom = intern_atom_reply->atom;
-  free (intern_atom_reply);
-
-  /* Register server through the window property.  */
-  get_property_cookie = xcb_get_property (xim->connection,
-                                          0,
-                                          xim->screen->root,
-                                          xim->atoms[XIM_SERVERS],
-                                          XCB_ATOM_ATOM,
-                                          0,
-                                          UINT_MAX);
-  get_property_reply = xcb_get_property_reply (xim->connection,
-                                               get_property_cookie,
-                                               error);
-
-  if (!get_property_reply
-      || (get_property_reply->type != XCB_NONE
-          && (get_property_reply->type != XCB_ATOM_ATOM
-              || get_property_reply->format != 32)))
+  if (total > 0)
     {
-      free (get_property_reply);
-      return false;
+      xim->other_servers = malloc (sizeof (xcb_atom_t) * total);
+      if (!xim->other_servers)
+        return false;
     }
 
-  data = xcb_get_property_value (get_property_reply);
-  nitems = xcb_get_property_value_length (get_property_reply);
-  for (i = 0; i < nitems && data[i] != atom; i++)
-    ;
+  for (i = 0; i < xim->nscreens; i++)
+    {
+      data = get_server_atoms (xim->property_replies[i], &nitems);
+      for (j = 0; j < nitems; j++)
+        if (data[j] != xim->server_atom
+            && !has_atom (xim->other_servers, xim->nother_servers, data[j]))
+          xim->other_servers[xim->nother_servers++] = data[j];
+    }
 
-  if (i != nitems)
+  if (xim->nother_servers == 0)
     {
-      xcb_get_selection_owner_cookie_t get_selection_owner_cookie;
-      xcb_get_selection_owner_reply_t *get_selection_owner_reply;
+      *done = true;
+      return finish_registration (xim);
+    }
 
-      get_selection_owner_cookie =
-        xcb_get_selection_owner (xim->connection, atom);
+  xim->other_owner_cookies =
+    malloc (sizeof (xcb_get_selection_owner_cookie_t)
+            * xim->nother_servers);
+  if (!xim->other_owner_cookies)
+    return false;
+
+  for (i = 0; i < (int) xim->nother_servers; i++)
+    xim->other_owner_cookies[i] =
+      xcb_get_selection_owner (xim->connection, xim->other_servers[i]);
+
+  return true;
+}
+
+/* Receives the replies of the third round trip.  A server atom whose
+   selection has no owner was left by a server which didn't exit
+   cleanly; clients trying it would wait for a reply until they time
+   out.  */
+static bool
+prune_registration (xcb_xim_server_connection_t *xim,
+                    xcb_generic_error_t **error)
+{
+  xcb_get_selection_owner_reply_t *get_selection_owner_reply;
+  size_t i, nrunning;
+  bool success = true;
+
+  nrunning = 0;
+  for (i = 0; i < xim->nother_servers; i++)
+    {
+      if (!success)
+        {
+          xcb_discard_reply (xim->connection,
+                             xim->other_owner_cookies[i].sequence);
+          continue;
+        }
 
       get_selection_owner_reply =
         xcb_get_selection_owner_reply (xim->connection,
-                                       get_selection_owner_cookie, error);
-      if (get_selection_owner_reply->owner != XCB_WINDOW_NONE
-          && get_selection_owner_reply->owner != xim->accept_window)
+                                       xim->other_owner_cookies[i],
+                                       error);
+      if (!get_selection_owner_reply)
         {
-          free (get_property_reply);
-          free (get_selection_owner_reply);
-          return false;
+          success = false;
+          continue;
         }
 
+      if (get_selection_owner_reply->owner != XCB_WINDOW_NONE)
+        xim->other_servers[nrunning++] = xim->other_servers[i];
       free (get_selection_owner_reply);
+    }
 
-      xcb_set_selection_owner (xim->connection,
-                               xim->accept_window,
-                               atom,
-                               XCB_CURRENT_TIME);
+  if (!success)
+    return false;
 
-      xcb_change_property (xim->connection,
-                           XCB_PROP_MODE_PREPEND,
-                           xim->screen->root,
-                           xim->atoms[XIM_SERVERS],
-                           XCB_ATOM_ATOM,
-                           32,
-                           0,
-                           (const void *) data);
+  xim->nother_servers = nrunning;
+  return finish_registration (xim);
+}
+
+xcb_xim_server_connection_t *
+xcb_xim_server_connection_begin (xcb_connection_t *connection,
+                                 const char *name,
+                                 const char *locale)
+{
+  xcb_xim_server_connection_t *xim;
+  xcb_screen_iterator_t iter;
+
+  xim = malloc (sizeof (xcb_xim_server_connection_t));
+  if (!xim)
+    return NULL;
+
+  memset (xim, 0, sizeof (xcb_xim_server_connection_t));
+
+  xim->locale = strdup (locale);
+  if (!xim->locale)
+    {
+      free (xim);
+      return NULL;
+    }
+  xim->connection = connection;
+
+  iter = xcb_setup_roots_iterator (xcb_get_setup (connection));
+  xim->screen = iter.data;
+  xim->nscreens = iter.rem;
+
+  xim->get_property_cookies =
+    malloc (sizeof (xcb_get_property_cookie_t) * xim->nscreens);
+  if (!xim->get_property_cookies)
+    {
+      free (xim->locale);
+      free (xim);
+      return NULL;
+    }
+
+  if (!request_atoms (xim, name))
+    {
+      free (xim->get_property_cookies);
+      free (xim->locale);
+      free (xim);
+      return NULL;
+    }
+
+  /* Create a window that accepts incoming connections.  */
+  xim->accept_window = create_server_window (xim);
+  fill_window_pool (xim);
+
+  xcb_flush (connection);
+
+  xim->setup_state = SETUP_ATOMS;
+
+  return xim;
+}
+
+bool
+xcb_xim_server_connection_setup (xcb_xim_server_connection_t *xim,
+                                 bool *done,
+                                 xcb_generic_error_t **error)
+{
+  bool success;
+
+  *done = false;
+
+  switch (xim->setup_state)
+    {
+    case SETUP_ATOMS:
+      if (!receive_atoms (xim, error))
+        {
+          xim->setup_state = SETUP_FAILED;
+          return false;
+        }
+      request_registration (xim);
+      xcb_flush (xim->connection);
+      xim->setup_state = SETUP_REGISTRATION;
+      return true;
+
+    case SETUP_REGISTRATION:
+      success = check_registration (xim, done, error);
+      if (success && !*done)
+        {
+          xcb_flush (xim->connection);
+          xim->setup_state = SETUP_PRUNING;
+          return true;
+        }
+      break;
+
+    case SETUP_PRUNING:
+      success = prune_registration (xim, error);
+      *done = success;
+      break;
+
+    case SETUP_DONE:
+      *done = true;
+      return true;
+
+    default:
+      return false;
+    }
+
+  end_registration (xim);
+  xim->setup_state = success ? SETUP_DONE : SETUP_FAILED;
+  return success;
+}
+
+/* Undoes the registration, so that clients don't try to connect to
+   the server after it exits.  */
+bool
+xcb_xim_server_connection_shutdown (xcb_xim_server_connection_t *xim,
+                                    xcb_generic_error_t **error)
+{
+  xcb_screen_iterator_t iter;
+  xcb_get_property_reply_t *get_property_reply;
+  xcb_get_selection_owner_reply_t *get_selection_owner_reply;
+  xcb_atom_t *atoms, *data;
+  int nitems, natoms;
+  int i, j;
+  size_t k;
+  bool success = true;
+
+  if (xim->setup_state != SETUP_DONE)
+    return true;
+
+  xim->setup_state = SETUP_SHUTDOWN;
+
+  /* Same as request_registration().  */
+  xcb_grab_server (xim->connection);
+  xim->get_selection_owner_cookie =
+    xcb_get_selection_owner (xim->connection, xim->server_atom);
+
+  iter = xcb_setup_roots_iterator (xcb_get_setup (xim->connection));
+  for (i = 0; iter.rem > 0; i++, xcb_screen_next (&iter))
+    xim->get_property_cookies[i] =
+      xcb_get_property (xim->connection,
+                        0,
+                        iter.data->root,
+                        xim->atoms[XIM_SERVERS],
+                        XCB_ATOM_ATOM,
+                        0,
+                        UINT_MAX);
+
+  /* Leave the selection alone if another server has taken it over;
+     setting the owner to None works regardless of the owner.  */
+  get_selection_owner_reply =
+    xcb_get_selection_owner_reply (xim->connection,
+                                   xim->get_selection_owner_cookie,
+                                   error);
+  if (get_selection_owner_reply)
+    {
+      if (get_selection_owner_reply->owner == xim->accept_window)
+        xcb_set_selection_owner (xim->connection,
+                                 XCB_WINDOW_NONE,
+                                 xim->server_atom,
+                                 XCB_CURRENT_TIME);
+      free (get_selection_owner_reply);
     }
   else
+    success = false;
+
+  iter = xcb_setup_roots_iterator (xcb_get_setup (xim->connection));
+  for (i = 0; i < xim->nscreens; i++, xcb_screen_next (&iter))
     {
-      xcb_set_selection_owner (xim->connection,
-                               xim->accept_window,
-                               atom,
-                               XCB_CURRENT_TIME);
+      get_property_reply =
+        xcb_get_property_reply (xim->connection,
+                                xim->get_property_cookies[i],
+                                success ? error : NULL);
+      if (!get_property_reply)
+        {
+          success = false;
+          continue;
+        }
 
-      xcb_change_property (xim->connection,
-                           XCB_PROP_MODE_PREPEND,
-                           xim->screen->root,
-                           xim->atoms[XIM_SERVERS],
-                           XCB_ATOM_ATOM,
-                           32,
-                           1,
-                           (const void *) &atom);
+      data = get_server_atoms (get_property_reply, &nitems);
+      if (!data || !has_atom (data, nitems, xim->server_atom))
+        {
+          free (get_property_reply);
+          continue;
+        }
+
+      atoms = malloc (sizeof (xcb_atom_t) * nitems);
+      if (!atoms)
+        {
+          free (get_property_reply);
+          success = false;
+          continue;
+        }
+
+      natoms = 0;
+      for (j = 0; j < nitems; j++)
+        if (data[j] != xim->server_atom)
+          atoms[natoms++] = data[j];
+
+      if (natoms > 0)
+        xcb_change_property (xim->connection,
+                             XCB_PROP_MODE_REPLACE,
+                             iter.data->root,
+                             xim->atoms[XIM_SERVERS],
+                             XCB_ATOM_ATOM,
+                             32,
+                             natoms,
+                             (const void *) atoms);
+      else
+        xcb_delete_property (xim->connection,
+                             iter.data->root,
+                             xim->atoms[XIM_SERVERS]);
+      free (atoms);
+      free (get_property_reply);
     }
 
+  /* Disconnect the clients; their requests now fail with BadWindow
+     instead of waiting for replies which never come.  */
+  for (k = 0; k < xim->nclients; k++)
+    xcb_destroy_window (xim->connection, xim->clients[k]->server_window);
+  for (k = 0; k < xim->window_pool_length; k++)
+    xcb_destroy_window (xim->connection, xim->window_pool[k]);
+  xim->window_pool_length = 0;
+  xcb_destroy_window (xim->connection, xim->accept_window);
+
+  xcb_ungrab_server (xim->connection);
   xcb_flush (xim->connection);
-  free (get_property_reply);
 
-  return true;
+  return success;
 }
 
 xcb_xim_server_connection_t *
@@ -356,53 +876,184 @@ xcb_xim_server_connection_new (xcb_connection_t *connection,
                                xcb_generic_error_t **error)
 {
   xcb_xim_server_connection_t *xim;
+  bool done;
+
+  xim = xcb_xim_server_connection_begin (connection, name, locale);
+  if (!xim)
+    return NULL;
+
+  do
+    if (!xcb_xim_server_connection_setup (xim, &done, error))
+      {
+        xcb_xim_server_connection_free (xim);
+        return NULL;
+      }
+  while (!done);
+
+  return xim;
+}
+
+static void
+free_request_slot (struct xcb_xim_request_slot_t *slot)
+{
+  free (slot->buffer ? slot->buffer : slot);
+}
+
+void
+xcb_xim_server_connection_free (xcb_xim_server_connection_t *xim)
+{
+  struct xcb_xim_request_slot_t *slot;
+  size_t i;
+
+  /* Replies to an unfinished setup would otherwise stay queued in the
+     connection.  */
+  switch (xim->setup_state)
+    {
+    case SETUP_ATOMS:
+      for (i = 0; i <= LAST_ATOM; i++)
+        xcb_discard_reply (xim->connection,
+                           xim->intern_atom_cookies[i].sequence);
+      break;
+
+    case SETUP_REGISTRATION:
+      xcb_discard_reply (xim->connection,
+                         xim->get_selection_owner_cookie.sequence);
+      for (i = 0; i < (size_t) xim->nscreens; i++)
+        xcb_discard_reply (xim->connection,
+                           xim->get_property_cookies[i].sequence);
+      end_registration (xim);
+      break;
+
+    case SETUP_PRUNING:
+      for (i = 0; i < xim->nother_servers; i++)
+        xcb_discard_reply (xim->connection,
+                           xim->other_owner_cookies[i].sequence);
+      end_registration (xim);
+      break;
+
+    default:
+      break;
+    }
+  free (xim->get_property_cookies);
+
+  free (xim->locale);
+
+  for (i = 0; i < xim->nclients; i++)
+    {
+      struct xcb_xim_client_t *client = NULL;
+
+      client = xcb_xim_container_of (xim->clients[i], client, transport);
+
+      slot = client->requests;
+      while (slot)
+        {
+          struct xcb_xim_request_slot_t *next = slot->next;
+          free_request_slot (slot);
+          slot = next;
+        }
+
+      free (client);
+    }
+  free (xim->clients);
+  free (xim->watches);
+
+  slot = xim->pool;
+  while (slot)
+    {
+      struct xcb_xim_request_slot_t *next = slot->next;
+      free (slot);
+      slot = next;
+    }
+
+  free (xim);
+}
+
+static struct xcb_xim_watch_t *
+find_watch (xcb_xim_server_connection_t *xim, xcb_window_t window)
+{
+  size_t i;
 
-  xim = malloc (sizeof (xcb_xim_server_connection_t));
-  if (!xim)
-    return NULL;
+  for (i = 0; i < xim->nwatches; i++)
+    if (xim->watches[i].window == window)
+      return &xim->watches[i];
 
-  memset (xim, 0, sizeof (xcb_xim_server_connection_t));
+  return NULL;
+}
 
-  xim->locale = strdup (locale);
-  if (!xim->locale)
-    {
-      free (xim);
-      return NULL;
-    }
-  xim->connection = connection;
+static bool
+watch_window (xcb_xim_server_connection_t *xim, xcb_window_t window)
+{
+  uint32_t event_mask = XCB_EVENT_MASK_STRUCTURE_NOTIFY;
+  struct xcb_xim_watch_t *watch;
 
-  if (!init_atoms (connection, xim->atoms, error))
+  watch = find_watch (xim, window);
+  if (watch)
     {
-      free (xim);
-      return NULL;
+      watch->references++;
+      return true;
     }
 
-  if (!init_transport (xim, name, error))
+  if (xim->nwatches == xim->maxwatches)
     {
-      free (xim);
-      return NULL;
+      size_t maxwatches = xim->maxwatches * 2 + 10;
+      struct xcb_xim_watch_t *watches;
+
+      watches = realloc (xim->watches,
+                         sizeof (struct xcb_xim_watch_t) * maxwatches);
+      if (!watches)
+        return false;
+
+      xim->watches = watches;
+      xim->maxwatches = maxwatches;
     }
 
-  return xim;
+  watch = &xim->watches[xim->nwatches++];
+  watch->window = window;
+  watch->references = 1;
+
+  xcb_change_window_attributes (xim->connection,
+                                window,
+                                XCB_CW_EVENT_MASK,
+                                &event_mask);
+  return true;
 }
 
-void
-xcb_xim_server_connection_free (xcb_xim_server_connection_t *xim)
+static void
+remove_watch (xcb_xim_server_connection_t *xim, struct xcb_xim_watch_t *watch)
 {
-  struct xcb_xim_list_t *requests;
+  *watch = xim->watches[--xim->nwatches];
+}
 
-  free (xim->locale);
-  free (xim->clients);
+static void
+unwatch_window (xcb_xim_server_connection_t *xim, xcb_window_t window)
+{
+  uint32_t event_mask = XCB_EVENT_MASK_NO_EVENT;
+  struct xcb_xim_watch_t *watch;
 
-  requests = xim->requests;
-  while (requests)
-    {
-      struct xcb_xim_list_t *next = requests->next;
-      free (requests->data);
-      requests = next;
-    }
+  /* Destroyed windows are forgotten.  */
+  watch = find_watch (xim, window);
+  if (!watch || --watch->references > 0)
+    return;
 
-  free (xim);
+  remove_watch (xim, watch);
+  xcb_change_window_attributes (xim->connection,
+                                window,
+                                XCB_CW_EVENT_MASK,
+                                &event_mask);
+}
+
+bool
+xcb_xim_server_connection_watch_window (xcb_xim_server_connection_t *xim,
+                                        xcb_window_t window)
+{
+  return watch_window (xim, window);
+}
+
+void
+xcb_xim_server_connection_unwatch_window (xcb_xim_server_connection_t *xim,
+                                          xcb_window_t window)
+{
+  unwatch_window (xim, window);
 }
 
 static bool
@@ -411,31 +1062,43 @@ accept_connection (xcb_xim_server_connection_t *xim,
                    xcb_generic_error_t **error)
 {
   xcb_client_message_event_t reply;
+  struct xcb_xim_client_t *_client;
   xcb_xim_transport_t *client;
 
+  (void) error;
+
   if (xim->nclients == xim->maxclients)
     {
-      xim->maxclients = xim->maxclients * 2 + 10;
-      xim->clients = realloc (xim->clients,
-                              sizeof (xcb_xim_transport_t) * xim->maxclients);
-      if (!xim->clients)
+      size_t maxclients = xim->maxclients * 2 + 10;
+      xcb_xim_transport_t **clients;
+
+      clients = realloc (xim->clients,
+                         sizeof (xcb_xim_transport_t *) * maxclients);
+      if (!clients)
         return false;
+
+      xim->clients = clients;
+      xim->maxclients = maxclients;
     }
 
-  client = &xim->clients[xim->nclients++];
+  _client = calloc (1, sizeof (struct xcb_xim_client_t));
+  if (!_client)
+    return false;
+
+  client = &_client->transport;
   client->client_window = request->data.data32[0];
-  client->server_window = xcb_generate_id (xim->connection);
-  xcb_create_window (xim->connection,
-                     XCB_COPY_FROM_PARENT,
-                     client->server_window,
-                     xim->screen->root,
-                     0, 0,
-                     1, 1,
-                     1,
-                     XCB_WINDOW_CLASS_INPUT_OUTPUT,
-                     xim->screen->root_visual,
-                     0,
-                     NULL);
+
+  /* Notice clients which go away without XIM_DISCONNECT.  */
+  if (!watch_window (xim, client->client_window))
+    {
+      free (_client);
+      return false;
+    }
+
+  xim->clients[xim->nclients++] = client;
+  client->server_window = xim->window_pool_length > 0
+    ? xim->window_pool[--xim->window_pool_length]
+    : create_server_window (xim);
 
   memset (&reply, 0, sizeof (reply));
   reply.response_type = XCB_CLIENT_MESSAGE;
@@ -453,8 +1116,6 @@ accept_connection (xcb_xim_server_connection_t *xim,
                   XCB_EVENT_MASK_NO_EVENT,
                   (const char *) &reply);
 
-  xcb_flush (xim->connection);
-
   return true;
 }
 
@@ -464,26 +1125,82 @@ find_transport (xcb_xim_server_connection_t *xim, xcb_window_t server_window)
   int i;
 
   for (i = xim->nclients - 1; i >= 0; i--)
-    if (xim->clients[i].server_window == server_window)
-      return &xim->clients[i];
+    if (xim->clients[i]->server_window == server_window)
+      return xim->clients[i];
+
+  return NULL;
+}
+
+static xcb_xim_transport_t *
+find_transport_by_client_window (xcb_xim_server_connection_t *xim,
+                                 xcb_window_t client_window)
+{
+  int i;
+
+  for (i = xim->nclients - 1; i >= 0; i--)
+    if (xim->clients[i]->client_window == client_window)
+      return xim->clients[i];
 
   return NULL;
 }
 
-static uint8_t *
-read_data (xcb_xim_server_connection_t *xim,
-           xcb_xim_transport_t *client,
-           xcb_client_message_event_t *event,
-           size_t *length,
-           xcb_generic_error_t **error)
+static struct xcb_xim_request_slot_t *
+alloc_request_slot (xcb_xim_server_connection_t *xim)
+{
+  struct xcb_xim_request_slot_t *slot;
+
+  if (xim->pool)
+    {
+      slot = xim->pool;
+      xim->pool = slot->next;
+      xim->pool_length--;
+    }
+  else
+    {
+      slot = malloc (REQUEST_SLOT_SIZE);
+      if (!slot)
+        return NULL;
+    }
+
+  slot->next = NULL;
+  slot->buffer = NULL;
+
+  return slot;
+}
+
+static void
+release_request_slot (xcb_xim_server_connection_t *xim,
+                      struct xcb_xim_request_slot_t *slot)
+{
+  if (slot->buffer || xim->pool_length >= REQUEST_POOL_MAX)
+    {
+      free_request_slot (slot);
+      return;
+    }
+
+  slot->next = xim->pool;
+  xim->pool = slot;
+  xim->pool_length++;
+}
+
+/* Reads a request into a slot.  Requests sent in a ClientMessage are
+   copied once into a pooled slot; requests sent through a property
+   stay in the property reply, which the slot takes over.  */
+static struct xcb_xim_request_slot_t *
+read_request (xcb_xim_server_connection_t *xim,
+              xcb_xim_transport_t *client,
+              xcb_client_message_event_t *event,
+              size_t *length,
+              xcb_generic_error_t **error)
 {
+  struct xcb_xim_request_slot_t *slot;
+
   if (event->format == 32)
     {
       xcb_atom_t atom = event->data.data32[1];
-      uint8_t *data;
       uint32_t value_length = event->data.data32[0];
-      int actual_value_length;
-      int request_length;
+      uint32_t actual_value_length;
+      uint32_t request_length;
       uint16_t nitems;
       uint8_t *value;
 
@@ -521,54 +1238,109 @@ read_data (xcb_xim_server_connection_t *xim,
           return NULL;
         }
 
-      data = malloc (request_length);
-      if (!data)
+      hexdump ("> ", value, request_length);
+      *length = request_length;
+
+      /* The slot header overwrites the reply header, which is no
+         longer needed.  */
+      if (REQUEST_SLOT_OFFSET
+          <= (size_t) (value - (uint8_t *) get_property_reply))
+        {
+          slot = (struct xcb_xim_request_slot_t *)
+            (value - REQUEST_SLOT_OFFSET);
+          slot->next = NULL;
+          slot->buffer = get_property_reply;
+          return slot;
+        }
+
+      slot = malloc (REQUEST_SLOT_OFFSET + request_length);
+      if (!slot)
         {
           free (get_property_reply);
           return NULL;
         }
 
-      memcpy (data, value, request_length);
-      *length = request_length;
-
+      /* Not a pooled slot; it owns itself.  */
+      slot->next = NULL;
+      slot->buffer = slot;
+      memcpy (&slot->container.request, value, request_length);
       free (get_property_reply);
 
-      hexdump ("> ", data, *length);
-      return data;
+      return slot;
     }
   else
     {
       uint16_t nitems;
       int request_length;
-      uint8_t *data;
 
       nitems = *(uint16_t *) &event->data.data8[2];
       request_length = nitems * 4 + 4;
-      if (request_length > sizeof (event->data.data8))
+      if (request_length > CLIENT_MESSAGE_DATA_LENGTH)
         return NULL;
 
-      data = malloc (request_length);
-      if (!data)
+      slot = alloc_request_slot (xim);
+      if (!slot)
         return NULL;
 
-      memcpy (data, event->data.data8, request_length);
+      memcpy (&slot->container.request, event->data.data8, request_length);
       *length = request_length;
 
-      hexdump ("> ", data, *length);
-      return data;
+      hexdump ("> ", event->data.data8, *length);
+      return slot;
     }
 
   return NULL;
 }
 
+/* Whether a reply or an error refers to the ids of the request being
+   handled.  Both start with the input method and input context ids;
+   a reply may carry ids the request didn't, as XIM_OPEN_REPLY or
+   XIM_CREATE_IC_REPLY do, so only those of the request are
+   compared.  */
 static bool
-write_data (xcb_xim_server_connection_t *xim,
-            xcb_xim_transport_t *client,
-            size_t length,
-            const uint8_t *data,
-            xcb_generic_error_t **error)
+is_current_reply (xcb_xim_transport_t *transport,
+                  struct xcb_xim_client_t *client,
+                  size_t length,
+                  const uint8_t *data)
+{
+  uint16_t id;
+
+  if ((client->awaited_ids & XCB_XIM_ERROR_FLAG_INPUT_METHOD) != 0)
+    {
+      if (length < 6)
+        return false;
+      memcpy (&id, data + 4, 2);
+      if (HO16 (transport, id) != client->awaited_input_method_id)
+        return false;
+    }
+
+  if ((client->awaited_ids & XCB_XIM_ERROR_FLAG_INPUT_CONTEXT) != 0)
+    {
+      if (length < 8)
+        return false;
+      memcpy (&id, data + 6, 2);
+      if (HO16 (transport, id) != client->awaited_input_context_id)
+        return false;
+    }
+
+  return true;
+}
+
+/* Sends the message made of HEADER followed by BODY, so that a shared
+   body can be sent without being copied.  HEADER holds at least the
+   XIM header and the ids which follow it, if any.  */
+static bool
+write_data_split (xcb_xim_server_connection_t *xim,
+                  xcb_xim_transport_t *client,
+                  size_t header_length,
+                  const uint8_t *header,
+                  size_t body_length,
+                  const uint8_t *body,
+                  xcb_generic_error_t **error)
 {
   xcb_client_message_event_t event;
+  struct xcb_xim_client_t *_client = NULL;
+  size_t length = header_length + body_length;
 
   memset (&event, 0, sizeof (event));
   event.response_type = XCB_CLIENT_MESSAGE;
@@ -620,8 +1392,17 @@ write_data (xcb_xim_server_connection_t *xim,
                            atom,
                            XCB_ATOM_STRING,
                            8,
-                           length,
-                           data);
+                           header_length,
+                           header);
+      if (body_length > 0)
+        xcb_change_property (xim->connection,
+                             XCB_PROP_MODE_APPEND,
+                             client->client_window,
+                             atom,
+                             XCB_ATOM_STRING,
+                             8,
+                             body_length,
+                             body);
 
       event.data.data32[0] = length;
       event.data.data32[1] = atom;
@@ -629,7 +1410,9 @@ write_data (xcb_xim_server_connection_t *xim,
   else
     {
       event.format = 8;
-      memcpy (event.data.data8, data, length);
+      memcpy (event.data.data8, header, header_length);
+      if (body_length > 0)
+        memcpy (event.data.data8 + header_length, body, body_length);
     }
 
   xcb_send_event (xim->connection,
@@ -639,11 +1422,33 @@ write_data (xcb_xim_server_connection_t *xim,
                   (const char *) &event);
   xcb_flush (xim->connection);
 
-  hexdump ("< ", data, length);
+  hexdump ("< ", header, header_length);
+  if (body_length > 0)
+    {
+      hexdump ("< ", body, body_length);
+    }
+
+  /* An error also ends the wait of the client.  */
+  _client = xcb_xim_container_of (client, _client, transport);
+  if (_client->handling
+      && _client->awaited_reply != 0
+      && (header[0] == _client->awaited_reply || header[0] == XCB_XIM_ERROR)
+      && is_current_reply (client, _client, header_length, header))
+    _client->awaited_reply = 0;
 
   return true;
 }
 
+static bool
+write_data (xcb_xim_server_connection_t *xim,
+            xcb_xim_transport_t *client,
+            size_t length,
+            const uint8_t *data,
+            xcb_generic_error_t **error)
+{
+  return write_data_split (xim, client, length, data, 0, NULL, error);
+}
+
 uint16_t
 xcb_xim_card16 (xcb_xim_transport_t *transport, uint16_t value)
 {
@@ -945,7 +1750,7 @@ xcb_xim_attribute_point_new (xcb_xim_transport_t *transport,
 xcb_xim_attribute_t *
 xcb_xim_attribute_font_set_new (xcb_xim_transport_t *transport,
                                 uint16_t attribute_id,
-                                uint8_t value_length,
+                                uint16_t value_length,
                                 const char *value)
 {
   xcb_xim_attribute_t *attribute;
@@ -954,6 +1759,8 @@ xcb_xim_attribute_font_set_new (xcb_xim_transport_t *transport,
   uint8_t *p;
 
   value_byte_length = 2 + value_length + PAD (2 + value_length);
+  if (value_byte_length > UINT16_MAX)
+    return NULL;
   length = 4 + value_byte_length;
 
   attribute = malloc (length);
@@ -1080,6 +1887,95 @@ xcb_xim_attribute_nested_list_new (xcb_xim_transport_t *transport,
   return attribute;
 }
 
+bool
+xcb_xim_attribute_get_card32 (xcb_xim_transport_t *transport,
+                              const xcb_xim_attribute_t *attribute,
+                              uint32_t *value)
+{
+  uint8_t *p;
+
+  if (HO16 (transport, attribute->value_byte_length) < 4)
+    return false;
+
+  p = (uint8_t *) (attribute + 1);
+  UNPACK32 (transport, p, value);
+
+  return true;
+}
+
+bool
+xcb_xim_attribute_get_rectangle (xcb_xim_transport_t *transport,
+                                 const xcb_xim_attribute_t *attribute,
+                                 xcb_rectangle_t *value)
+{
+  uint8_t *p;
+
+  if (HO16 (transport, attribute->value_byte_length) < 8)
+    return false;
+
+  p = (uint8_t *) (attribute + 1);
+  UNPACK16 (transport, p, &value->x);
+  UNPACK16 (transport, p, &value->y);
+  UNPACK16 (transport, p, &value->width);
+  UNPACK16 (transport, p, &value->height);
+
+  return true;
+}
+
+bool
+xcb_xim_attribute_get_point (xcb_xim_transport_t *transport,
+                             const xcb_xim_attribute_t *attribute,
+                             xcb_point_t *value)
+{
+  uint8_t *p;
+
+  if (HO16 (transport, attribute->value_byte_length) < 4)
+    return false;
+
+  p = (uint8_t *) (attribute + 1);
+  UNPACK16 (transport, p, &value->x);
+  UNPACK16 (transport, p, &value->y);
+
+  return true;
+}
+
+bool
+xcb_xim_attribute_get_font_set (xcb_xim_transport_t *transport,
+                                const xcb_xim_attribute_t *attribute,
+                                uint16_t *value_length,
+                                const char **value)
+{
+  uint16_t value_byte_length;
+  uint8_t *p;
+
+  value_byte_length = HO16 (transport, attribute->value_byte_length);
+  if (value_byte_length < 2)
+    return false;
+
+  p = (uint8_t *) (attribute + 1);
+  UNPACK16 (transport, p, value_length);
+  if (2 + *value_length > value_byte_length)
+    return false;
+
+  *value = (const char *) p;
+
+  return true;
+}
+
+xcb_xim_attribute_iterator_t
+xcb_xim_attribute_nested_list_iterator (xcb_xim_transport_t *transport,
+                                        xcb_xim_attribute_t *a)
+{
+  xcb_xim_attribute_iterator_t i;
+
+  i.transport = transport;
+  i.data = (xcb_xim_attribute_t *) (a + 1);
+  i.index = 0;
+  i.remainder = HO16 (transport, a->value_byte_length);
+
+  return i;
+}
+
 xcb_xim_attribute_iterator_t
 xcb_xim_attribute_nested_list_attribute_iterator (xcb_xim_generic_request_t *r,
                                                   xcb_xim_attribute_t *a)
@@ -1168,30 +2064,77 @@ xcb_xim_error (xcb_xim_server_connection_t *xim,
   PACK16 (transport, p, error_code);
   PACK16 (transport, p, detail_length);
   PACK16 (transport, p, detail_type);
-  memcpy (p, detail, detail_length);
+  if (detail_length > 0)
+    memcpy (p, detail, detail_length);
 
-  success = write_data (xim, transport, p - data, data, error);
+  success = write_data (xim, transport, length, data, error);
   free (data);
 
   return success;
 }
 
+static xcb_xim_reply_t *
+xcb_xim_reply_new (xcb_xim_transport_t *transport, size_t length)
+{
+  xcb_xim_reply_t *reply;
+
+  reply = malloc (sizeof (xcb_xim_reply_t) + length);
+  if (!reply)
+    return NULL;
+
+  memset (reply, 0, sizeof (xcb_xim_reply_t) + length);
+  reply->endian = transport->endian;
+  reply->length = length;
+
+  return reply;
+}
+
 bool
-xcb_xim_open_reply (xcb_xim_server_connection_t *xim,
+xcb_xim_reply_send (xcb_xim_server_connection_t *xim,
                     xcb_xim_transport_t *transport,
+                    const xcb_xim_reply_t *reply,
                     uint16_t input_method_id,
-                    uint16_t im_attrs_length,
-                    xcb_xim_attribute_spec_t **im_attrs,
-                    uint16_t ic_attrs_length,
-                    xcb_xim_attribute_spec_t **ic_attrs,
                     xcb_generic_error_t **error)
 {
-  uint8_t *data, *p;
+  const uint8_t *data = (const uint8_t *) (reply + 1);
+  uint8_t header[8], *p;
+  size_t header_length;
+
+  /* The reply is shared, so it can't be converted in place.  */
+  if (reply->endian != transport->endian)
+    return false;
+
+  /* Only the header with the input method ID is patched; the rest is
+     sent from the shared reply.  */
+  header_length = reply->length < sizeof (header)
+    ? reply->length : sizeof (header);
+  if (header_length < 6)
+    return false;
+  memcpy (header, data, header_length);
+
+  p = header + 4;
+  PACK16 (transport, p, input_method_id);
+
+  return write_data_split (xim, transport,
+                           header_length, header,
+                           reply->length - header_length,
+                           data + header_length,
+                           error);
+}
+
+xcb_xim_reply_t *
+xcb_xim_open_reply_new (xcb_xim_transport_t *transport,
+                        uint16_t im_attrs_length,
+                        xcb_xim_attribute_spec_t **im_attrs,
+                        uint16_t ic_attrs_length,
+                        xcb_xim_attribute_spec_t **ic_attrs)
+{
+  xcb_xim_reply_t *reply;
+  uint8_t *p;
   size_t length;
   uint16_t i;
   uint16_t im_attrs_byte_length;
   uint16_t ic_attrs_byte_length;
-  bool success;
 
   im_attrs_byte_length = 0;
   for (i = 0; i < im_attrs_length; i++)
@@ -1211,17 +2154,17 @@ xcb_xim_open_reply (xcb_xim_server_connection_t *xim,
 
   length = 4 + 4 + im_attrs_byte_length + 4 + ic_attrs_byte_length;
 
-  p = data = malloc (length);
-  if (!data)
-    return false;
+  reply = xcb_xim_reply_new (transport, length);
+  if (!reply)
+    return NULL;
 
-  memset (data, 0, length);
+  p = (uint8_t *) (reply + 1);
 
   PACK8 (transport, p, XCB_XIM_OPEN_REPLY);
   PACK8 (transport, p, 0);
   PACK16 (transport, p, (length - 4) / 4);
 
-  PACK16 (transport, p, input_method_id);
+  PACK16 (transport, p, 0);     /* input_method_id */
   PACK16 (transport, p, im_attrs_byte_length);
 
   for (i = 0; i < im_attrs_length; i++)
@@ -1245,8 +2188,32 @@ xcb_xim_open_reply (xcb_xim_server_connection_t *xim,
       p += spec_length;
     }
 
-  success = write_data (xim, transport, length, data, error);
-  free (data);
+  return reply;
+}
+
+bool
+xcb_xim_open_reply (xcb_xim_server_connection_t *xim,
+                    xcb_xim_transport_t *transport,
+                    uint16_t input_method_id,
+                    uint16_t im_attrs_length,
+                    xcb_xim_attribute_spec_t **im_attrs,
+                    uint16_t ic_attrs_length,
+                    xcb_xim_attribute_spec_t **ic_attrs,
+                    xcb_generic_error_t **error)
+{
+  xcb_xim_reply_t *reply;
+  bool success;
+
+  reply = xcb_xim_open_reply_new (transport,
+                                  im_attrs_length,
+                                  im_attrs,
+                                  ic_attrs_length,
+                                  ic_attrs);
+  if (!reply)
+    return false;
+
+  success = xcb_xim_reply_send (xim, transport, reply, input_method_id, error);
+  free (reply);
 
   return success;
 }
@@ -1301,14 +2268,16 @@ xcb_xim_register_triggerkeys (xcb_xim_server_connection_t *xim,
   PACK32 (transport, p, 12 * on_keys_length);
   for (i = 0; i < on_keys_length; i++)
     {
-      memcpy (p, on_keys[i], 12);
-      p += 12;
+      PACK32 (transport, p, on_keys[i]->keysym);
+      PACK32 (transport, p, on_keys[i]->modifier);
+      PACK32 (transport, p, on_keys[i]->modifier_mask);
     }
   PACK32 (transport, p, 12 * off_keys_length);
   for (i = 0; i < off_keys_length; i++)
     {
-      memcpy (p, off_keys[i], 12);
-      p += 12;
+      PACK32 (transport, p, off_keys[i]->keysym);
+      PACK32 (transport, p, off_keys[i]->modifier);
+      PACK32 (transport, p, off_keys[i]->modifier_mask);
     }
 
   success = write_data (xim, transport, p - data, data, error);
@@ -1381,20 +2350,17 @@ xcb_xim_query_extension_request_extension_iterator (
 
   return i;
 }
-
-bool
-xcb_xim_query_extension_reply (xcb_xim_server_connection_t *xim,
-                               xcb_xim_transport_t *transport,
-                               uint16_t input_method_id,
-                               uint16_t extensions_length,
-                               xcb_xim_extension_t **extensions,
-                               xcb_generic_error_t **error)
+
+xcb_xim_reply_t *
+xcb_xim_query_extension_reply_new (xcb_xim_transport_t *transport,
+                                   uint16_t extensions_length,
+                                   xcb_xim_extension_t **extensions)
 {
-  uint8_t *data, *p;
+  xcb_xim_reply_t *reply;
+  uint8_t *p;
   size_t length;
   uint16_t extensions_byte_length;
   uint16_t i;
-  bool success;
 
   extensions_byte_length = 0;
   for (i = 0; i < extensions_length; i++)
@@ -1405,17 +2371,17 @@ xcb_xim_query_extension_reply (xcb_xim_server_connection_t *xim,
 
   length = 4 + 4 + extensions_byte_length;
 
-  p = data = malloc (length);
-  if (!data)
-    return false;
+  reply = xcb_xim_reply_new (transport, length);
+  if (!reply)
+    return NULL;
 
-  memset (data, 0, length);
+  p = (uint8_t *) (reply + 1);
 
   PACK8 (transport, p, XCB_XIM_QUERY_EXTENSION_REPLY);
   PACK8 (transport, p, 0);
   PACK16 (transport, p, (length - 4) / 4);
 
-  PACK16 (transport, p, input_method_id);
+  PACK16 (transport, p, 0);     /* input_method_id */
   PACK16 (transport, p, extensions_byte_length);
 
   for (i = 0; i < extensions_length; i++)
@@ -1426,8 +2392,28 @@ xcb_xim_query_extension_reply (xcb_xim_server_connection_t *xim,
       p += extension_byte_length;
     }
 
-  success = write_data (xim, transport, p - data, data, error);
-  free (data);
+  return reply;
+}
+
+bool
+xcb_xim_query_extension_reply (xcb_xim_server_connection_t *xim,
+                               xcb_xim_transport_t *transport,
+                               uint16_t input_method_id,
+                               uint16_t extensions_length,
+                               xcb_xim_extension_t **extensions,
+                               xcb_generic_error_t **error)
+{
+  xcb_xim_reply_t *reply;
+  bool success;
+
+  reply = xcb_xim_query_extension_reply_new (transport,
+                                             extensions_length,
+                                             extensions);
+  if (!reply)
+    return false;
+
+  success = xcb_xim_reply_send (xim, transport, reply, input_method_id, error);
+  free (reply);
 
   return success;
 }
@@ -1580,19 +2566,16 @@ xcb_xim_get_im_values_request_attribute_id_iterator (
   return i;
 }
 
-bool
-xcb_xim_get_im_values_reply (xcb_xim_server_connection_t *xim,
-                             xcb_xim_transport_t *transport,
-                             uint16_t input_method_id,
-                             uint16_t attributes_length,
-                             xcb_xim_attribute_t **attributes,
-                             xcb_generic_error_t **error)
+xcb_xim_reply_t *
+xcb_xim_get_im_values_reply_new (xcb_xim_transport_t *transport,
+                                 uint16_t attributes_length,
+                                 xcb_xim_attribute_t **attributes)
 {
-  uint8_t *data, *p;
+  xcb_xim_reply_t *reply;
+  uint8_t *p;
   size_t length;
   uint16_t attributes_byte_length;
   uint16_t i;
-  bool success;
 
   attributes_byte_length = 0;
   for (i = 0; i < attributes_length; i++)
@@ -1605,17 +2588,17 @@ xcb_xim_get_im_values_reply (xcb_xim_server_connection_t *xim,
 
   length = 4 + 4 + attributes_byte_length;
 
-  p = data = malloc (length);
-  if (!data)
-    return false;
+  reply = xcb_xim_reply_new (transport, length);
+  if (!reply)
+    return NULL;
 
-  memset (data, 0, length);
+  p = (uint8_t *) (reply + 1);
 
   PACK8 (transport, p, XCB_XIM_GET_IM_VALUES_REPLY);
   PACK8 (transport, p, 0);
   PACK16 (transport, p, (length - 4) / 4);
 
-  PACK16 (transport, p, input_method_id);
+  PACK16 (transport, p, 0);     /* input_method_id */
   PACK16 (transport, p, attributes_byte_length);
 
   for (i = 0; i < attributes_length; i++)
@@ -1629,8 +2612,28 @@ xcb_xim_get_im_values_reply (xcb_xim_server_connection_t *xim,
       p += attribute_byte_length;
     }
 
-  success = write_data (xim, transport, p - data, data, error);
-  free (data);
+  return reply;
+}
+
+bool
+xcb_xim_get_im_values_reply (xcb_xim_server_connection_t *xim,
+                             xcb_xim_transport_t *transport,
+                             uint16_t input_method_id,
+                             uint16_t attributes_length,
+                             xcb_xim_attribute_t **attributes,
+                             xcb_generic_error_t **error)
+{
+  xcb_xim_reply_t *reply;
+  bool success;
+
+  reply = xcb_xim_get_im_values_reply_new (transport,
+                                           attributes_length,
+                                           attributes);
+  if (!reply)
+    return false;
+
+  success = xcb_xim_reply_send (xim, transport, reply, input_method_id, error);
+  free (reply);
 
   return success;
 }
@@ -2011,7 +3014,9 @@ xcb_xim_str_conversion (xcb_xim_server_connection_t *xim,
                         int16_t byte_length,
                         xcb_generic_error_t **error)
 {
-  uint8_t data[26], *p = data;
+  uint8_t data[24], *p = data;
+
+  memset (data, 0, sizeof (data));
 
   PACK8 (transport, p, XCB_XIM_STR_CONVERSION);
   PACK8 (transport, p, 0);
@@ -2020,6 +3025,7 @@ xcb_xim_str_conversion (xcb_xim_server_connection_t *xim,
   PACK16 (transport, p, input_method_id);
   PACK16 (transport, p, input_context_id);
   PACK16 (transport, p, position);
+  p += 2;                       /* unused */
   PACK32 (transport, p, direction);
   PACK16 (transport, p, factor);
   PACK16 (transport, p, operation);
@@ -2028,6 +3034,32 @@ xcb_xim_str_conversion (xcb_xim_server_connection_t *xim,
   return write_data (xim, transport, sizeof (data), data, error);
 }
 
+bool
+xcb_xim_str_conversion_reply_get_string (
+  xcb_xim_str_conversion_reply_t *reply,
+  uint16_t *string_byte_length,
+  const uint8_t **string)
+{
+  xcb_xim_request_container_t *container = NULL;
+  xcb_xim_str_conv_text_t *text;
+  size_t request_byte_length;
+
+  container = xcb_xim_container_of (reply, container, request);
+
+  request_byte_length = HO16 (container->requestor, reply->length) * 4 + 4;
+  if (request_byte_length < sizeof (*reply) + sizeof (*text))
+    return false;
+
+  text = (xcb_xim_str_conv_text_t *) (reply + 1);
+  *string_byte_length = HO16 (container->requestor, text->string_byte_length);
+  if (*string_byte_length
+      > request_byte_length - sizeof (*reply) - sizeof (*text))
+    return false;
+
+  *string = (const uint8_t *) (text + 1);
+  return true;
+}
+
 bool
 xcb_xim_preedit_start (xcb_xim_server_connection_t *xim,
                        xcb_xim_transport_t *transport,
@@ -2280,48 +3312,543 @@ xcb_xim_status_done (xcb_xim_server_connection_t *xim,
   return write_data (xim, transport, sizeof (data), data, error);
 }
 
+bool
+xcb_xim_ext_set_event_mask (xcb_xim_server_connection_t *xim,
+                            xcb_xim_transport_t *transport,
+                            uint16_t input_method_id,
+                            uint16_t input_context_id,
+                            uint32_t filter_event_mask,
+                            uint32_t intercept_event_mask,
+                            uint32_t select_event_mask,
+                            uint32_t forward_event_mask,
+                            uint32_t synchronous_event_mask,
+                            xcb_generic_error_t **error)
+{
+  uint8_t data[28], *p = data;
+
+  PACK8 (transport, p, XCB_XIM_EXTENSION);
+  PACK8 (transport, p, XCB_XIM_EXT_SET_EVENT_MASK);
+  PACK16 (transport, p, (sizeof (data) - 4) / 4);
+
+  PACK16 (transport, p, input_method_id);
+  PACK16 (transport, p, input_context_id);
+  PACK32 (transport, p, filter_event_mask);
+  PACK32 (transport, p, intercept_event_mask);
+  PACK32 (transport, p, select_event_mask);
+  PACK32 (transport, p, forward_event_mask);
+  PACK32 (transport, p, synchronous_event_mask);
+
+  return write_data (xim, transport, sizeof (data), data, error);
+}
+
+bool
+xcb_xim_ext_forward_keyevent (xcb_xim_server_connection_t *xim,
+                              xcb_xim_transport_t *transport,
+                              uint16_t input_method_id,
+                              uint16_t input_context_id,
+                              uint16_t flag,
+                              uint16_t sequence,
+                              uint8_t type,
+                              uint8_t keycode,
+                              uint16_t state,
+                              uint32_t time,
+                              uint32_t window,
+                              xcb_generic_error_t **error)
+{
+  uint8_t data[24], *p = data;
+
+  PACK8 (transport, p, XCB_XIM_EXTENSION);
+  PACK8 (transport, p, XCB_XIM_EXT_FORWARD_KEYEVENT);
+  PACK16 (transport, p, (sizeof (data) - 4) / 4);
+
+  PACK16 (transport, p, input_method_id);
+  PACK16 (transport, p, input_context_id);
+  PACK16 (transport, p, flag);
+  PACK16 (transport, p, sequence);
+  PACK8 (transport, p, type);
+  PACK8 (transport, p, keycode);
+  PACK16 (transport, p, state);
+  PACK32 (transport, p, time);
+  PACK32 (transport, p, window);
+
+  return write_data (xim, transport, sizeof (data), data, error);
+}
+
+static uint64_t
+get_time (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* What a request from a client refers to, and the reply the client
+   waits for after sending it, if any.  */
+static const struct
+{
+  uint8_t ids;                  /* xcb_xim_error_flag_t */
+  uint8_t reply_opcode;
+} request_infos[256] =
+  {
+    [XCB_XIM_OPEN] =
+    { 0, XCB_XIM_OPEN_REPLY },
+    [XCB_XIM_CLOSE] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD, XCB_XIM_CLOSE_REPLY },
+    [XCB_XIM_TRIGGER_NOTIFY] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_TRIGGER_NOTIFY_REPLY },
+    [XCB_XIM_ENCODING_NEGOTIATION] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD, XCB_XIM_ENCODING_NEGOTIATION_REPLY },
+    [XCB_XIM_QUERY_EXTENSION] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD, XCB_XIM_QUERY_EXTENSION_REPLY },
+    [XCB_XIM_SET_IM_VALUES] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD, XCB_XIM_SET_IM_VALUES_REPLY },
+    [XCB_XIM_GET_IM_VALUES] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD, XCB_XIM_GET_IM_VALUES_REPLY },
+    [XCB_XIM_CREATE_IC] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD, XCB_XIM_CREATE_IC_REPLY },
+    [XCB_XIM_DESTROY_IC] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_DESTROY_IC_REPLY },
+    [XCB_XIM_SET_IC_VALUES] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_SET_IC_VALUES_REPLY },
+    [XCB_XIM_GET_IC_VALUES] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_GET_IC_VALUES_REPLY },
+    [XCB_XIM_SET_IC_FOCUS] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT, 0 },
+    [XCB_XIM_UNSET_IC_FOCUS] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT, 0 },
+    /* Only with XCB_XIM_FORWARD_EVENT_FLAG_SYNCHRONOUS.  */
+    [XCB_XIM_FORWARD_EVENT] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_SYNC_REPLY },
+    [XCB_XIM_SYNC] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_SYNC_REPLY },
+    [XCB_XIM_SYNC_REPLY] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT, 0 },
+    [XCB_XIM_RESET_IC] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_RESET_IC_REPLY },
+    [XCB_XIM_STR_CONVERSION_REPLY] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT, 0 },
+    [XCB_XIM_PREEDIT_START_REPLY] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT, 0 },
+    [XCB_XIM_PREEDIT_CARET_REPLY] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT, 0 },
+    /* Only XIM_EXT_FORWARD_KEYEVENT with
+       XCB_XIM_FORWARD_EVENT_FLAG_SYNCHRONOUS.  */
+    [XCB_XIM_EXTENSION] =
+    { XCB_XIM_ERROR_FLAG_INPUT_METHOD | XCB_XIM_ERROR_FLAG_INPUT_CONTEXT,
+      XCB_XIM_SYNC_REPLY }
+  };
+
+xcb_xim_error_flag_t
+xcb_xim_request_get_ids (xcb_xim_transport_t *transport,
+                         xcb_xim_generic_request_t *request,
+                         uint16_t *input_method_id,
+                         uint16_t *input_context_id)
+{
+  uint16_t *body = (uint16_t *) (request + 1);
+  xcb_xim_error_flag_t ids = request_infos[request->major_opcode].ids;
+
+  *input_method_id = 0;
+  *input_context_id = 0;
+
+  if (HO16 (transport, request->length) < 1)
+    return XCB_XIM_ERROR_FLAG_NONE;
+
+  if ((ids & XCB_XIM_ERROR_FLAG_INPUT_METHOD) != 0)
+    *input_method_id = HO16 (transport, body[0]);
+  if ((ids & XCB_XIM_ERROR_FLAG_INPUT_CONTEXT) != 0)
+    *input_context_id = HO16 (transport, body[1]);
+
+  return ids;
+}
+
+static uint8_t
+get_awaited_reply (xcb_xim_transport_t *transport,
+                   xcb_xim_generic_request_t *request)
+{
+  if (request->major_opcode == XCB_XIM_FORWARD_EVENT)
+    {
+      xcb_xim_forward_event_request_t *forward_event =
+        (xcb_xim_forward_event_request_t *) request;
+
+      if (HO16 (transport, request->length) < 2
+          || (HO16 (transport, forward_event->flag)
+              & XCB_XIM_FORWARD_EVENT_FLAG_SYNCHRONOUS) == 0)
+        return 0;
+    }
+  else if (request->major_opcode == XCB_XIM_EXTENSION)
+    {
+      xcb_xim_ext_forward_keyevent_request_t *forward_keyevent =
+        (xcb_xim_ext_forward_keyevent_request_t *) request;
+
+      if (request->minor_opcode != XCB_XIM_EXT_FORWARD_KEYEVENT
+          || HO16 (transport, request->length) < 2
+          || (HO16 (transport, forward_keyevent->flag)
+              & XCB_XIM_FORWARD_EVENT_FLAG_SYNCHRONOUS) == 0)
+        return 0;
+    }
+
+  return request_infos[request->major_opcode].reply_opcode;
+}
+
+/* Sends the reply a client waits for, when the handler of its request
+   didn't.  Requests which only need an acknowledgement get it; the
+   others get XIM_ERROR.  */
 static bool
+send_default_reply (xcb_xim_server_connection_t *xim,
+                    xcb_xim_request_container_t *container,
+                    uint8_t reply_opcode)
+{
+  xcb_xim_transport_t *transport = container->requestor;
+  xcb_xim_error_flag_t ids;
+  uint16_t input_method_id, input_context_id;
+
+  ids = xcb_xim_request_get_ids (transport,
+                                 &container->request,
+                                 &input_method_id,
+                                 &input_context_id);
+  if (ids != request_infos[container->request.major_opcode].ids)
+    reply_opcode = XCB_XIM_ERROR;
+
+  switch (reply_opcode)
+    {
+    case XCB_XIM_CLOSE_REPLY:
+      return xcb_xim_close_reply (xim, transport, input_method_id, NULL);
+
+    case XCB_XIM_SET_IM_VALUES_REPLY:
+      return xcb_xim_set_im_values_reply (xim, transport, input_method_id,
+                                          NULL);
+
+    case XCB_XIM_TRIGGER_NOTIFY_REPLY:
+      return xcb_xim_trigger_notify_reply (xim, transport,
+                                           input_method_id, input_context_id,
+                                           NULL);
+
+    case XCB_XIM_DESTROY_IC_REPLY:
+      return xcb_xim_destroy_ic_reply (xim, transport,
+                                       input_method_id, input_context_id,
+                                       NULL);
+
+    case XCB_XIM_SET_IC_VALUES_REPLY:
+      return xcb_xim_set_ic_values_reply (xim, transport,
+                                          input_method_id, input_context_id,
+                                          NULL);
+
+    case XCB_XIM_SYNC_REPLY:
+      return xcb_xim_sync_reply (xim, transport,
+                                 input_method_id, input_context_id,
+                                 NULL);
+
+    case XCB_XIM_RESET_IC_REPLY:
+      return xcb_xim_reset_ic_reply (xim, transport,
+                                     input_method_id, input_context_id,
+                                     0, NULL,
+                                     NULL);
+
+    default:
+      return xcb_xim_error (xim, transport,
+                            input_method_id, input_context_id,
+                            ids,
+                            XCB_XIM_ERROR_BAD_SOMETHING,
+                            0, 0, NULL,
+                            NULL);
+    }
+}
+
+static void
 queue_request (xcb_xim_server_connection_t *xim,
-               xcb_xim_request_container_t *container)
+               struct xcb_xim_request_slot_t *slot)
 {
-  struct xcb_xim_list_t *list;
+  struct xcb_xim_client_t *client = NULL;
 
-  list = malloc (sizeof (*list));
-  if (!list)
-    return false;
+  client = xcb_xim_container_of (slot->container.requestor,
+                                 client, transport);
 
-  list->data = container;
-  list->next = NULL;
+  slot->next = NULL;
+  slot->container.queue_time = get_time ();
 
-  if (!xim->requests)
-    xim->requests = xim->requests_tail = list;
+  if (!client->requests)
+    client->requests = client->requests_tail = slot;
   else
     {
-      xim->requests_tail->next = list;
-      xim->requests_tail = list;
+      client->requests_tail->next = slot;
+      client->requests_tail = slot;
     }
 
-  return true;
+  if (!client->ready)
+    {
+      client->ready = true;
+      client->next_ready = NULL;
+      if (!xim->ready)
+        xim->ready = xim->ready_tail = client;
+      else
+        {
+          xim->ready_tail->next_ready = client;
+          xim->ready_tail = client;
+        }
+    }
+}
+
+xcb_xim_transport_t *
+xcb_xim_server_connection_next_ready_transport (
+  xcb_xim_server_connection_t *xim)
+{
+  while (xim->ready)
+    {
+      struct xcb_xim_client_t *client = xim->ready;
+
+      xim->ready = client->next_ready;
+      if (!xim->ready)
+        xim->ready_tail = NULL;
+
+      if (!client->requests)
+        {
+          client->ready = false;
+          continue;
+        }
+
+      /* Move it to the end.  */
+      client->next_ready = NULL;
+      if (!xim->ready)
+        xim->ready = xim->ready_tail = client;
+      else
+        {
+          xim->ready_tail->next_ready = client;
+          xim->ready_tail = client;
+        }
+
+      return &client->transport;
+    }
+
+  return NULL;
+}
+
+xcb_xim_request_container_t *
+xcb_xim_server_connection_poll_transport_request (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_transport_t *transport)
+{
+  struct xcb_xim_client_t *client = NULL;
+  struct xcb_xim_request_slot_t *slot;
+
+  (void) xim;
+
+  client = xcb_xim_container_of (transport, client, transport);
+
+  if (!client->requests)
+    return NULL;
+
+  slot = client->requests;
+  client->requests = slot->next;
+  if (!client->requests)
+    client->requests_tail = NULL;
+
+  client->awaited_reply = get_awaited_reply (transport,
+                                             &slot->container.request);
+  client->awaited_ids =
+    xcb_xim_request_get_ids (transport,
+                             &slot->container.request,
+                             &client->awaited_input_method_id,
+                             &client->awaited_input_context_id);
+  client->handling = client->awaited_reply != 0;
+
+  return &slot->container;
 }
 
 xcb_xim_request_container_t *
 xcb_xim_server_connection_poll_request (xcb_xim_server_connection_t *xim)
 {
-  xcb_xim_request_container_t *container;
-  struct xcb_xim_list_t *list;
+  xcb_xim_transport_t *transport;
 
-  if (!xim->requests)
+  transport = xcb_xim_server_connection_next_ready_transport (xim);
+  if (!transport)
     return NULL;
 
-  list = xim->requests;
-  xim->requests = xim->requests->next;
-  if (!xim->requests)
-    xim->requests_tail = NULL;
+  return xcb_xim_server_connection_poll_transport_request (xim, transport);
+}
+
+bool
+xcb_xim_server_connection_has_requests (xcb_xim_server_connection_t *xim)
+{
+  struct xcb_xim_client_t *client;
+
+  for (client = xim->ready; client; client = client->next_ready)
+    if (client->requests)
+      return true;
+
+  return false;
+}
+
+void
+xcb_xim_server_connection_release_request (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_request_container_t *container)
+{
+  struct xcb_xim_request_slot_t *slot = NULL;
+  uint8_t major_opcode = container->request.major_opcode;
+
+  /* Only look at the transport if a reply may be due, since it is
+     gone after XIM_DISCONNECT.  */
+  if (request_infos[major_opcode].reply_opcode != 0)
+    {
+      struct xcb_xim_client_t *client = NULL;
+
+      client = xcb_xim_container_of (container->requestor,
+                                     client, transport);
+      if (client->awaited_reply != 0)
+        {
+          send_default_reply (xim, container, client->awaited_reply);
+          client->awaited_reply = 0;
+          xim->default_replies[major_opcode]++;
+        }
+      client->handling = false;
+    }
+
+  slot = xcb_xim_container_of (container, slot, container);
+  release_request_slot (xim, slot);
+}
+
+bool
+xcb_xim_server_connection_reply_pending (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_request_container_t *container)
+{
+  struct xcb_xim_client_t *client = NULL;
+
+  (void) xim;
+
+  /* The transport is gone after XIM_DISCONNECT.  */
+  if (request_infos[container->request.major_opcode].reply_opcode == 0)
+    return false;
+
+  client = xcb_xim_container_of (container->requestor, client, transport);
+  return client->handling && client->awaited_reply != 0;
+}
+
+uint64_t
+xcb_xim_server_connection_get_default_replies (
+  xcb_xim_server_connection_t *xim,
+  uint8_t major_opcode)
+{
+  return xim->default_replies[major_opcode];
+}
+
+bool
+xcb_xim_server_connection_close_transport (xcb_xim_server_connection_t *xim,
+                                           xcb_xim_transport_t *transport,
+                                           xcb_generic_error_t **error)
+{
+  struct xcb_xim_client_t *client = NULL, **prev;
+  struct xcb_xim_request_slot_t *slot;
+  bool success = true;
+  size_t i;
+
+  client = xcb_xim_container_of (transport, client, transport);
+
+  if (!client->destroyed)
+    {
+      success = xcb_xim_disconnect_reply (xim, transport, error);
+      unwatch_window (xim, transport->client_window);
+    }
+  xcb_destroy_window (xim->connection, transport->server_window);
+
+  /* Unlink it from the round-robin list.  */
+  if (client->ready)
+    {
+      struct xcb_xim_client_t *last = NULL;
+
+      for (prev = &xim->ready; *prev; prev = &(*prev)->next_ready)
+        {
+          if (*prev == client)
+            {
+              *prev = client->next_ready;
+              break;
+            }
+          last = *prev;
+        }
+      if (xim->ready_tail == client)
+        xim->ready_tail = last;
+    }
+
+  while (client->requests)
+    {
+      slot = client->requests;
+      client->requests = slot->next;
+      release_request_slot (xim, slot);
+    }
+
+  for (i = 0; i < xim->nclients; i++)
+    if (xim->clients[i] == transport)
+      {
+        xim->clients[i] = xim->clients[--xim->nclients];
+        break;
+      }
+
+  xim->closed_transports++;
+  if (client->destroyed)
+    xim->destroyed_transports++;
+  free (client);
 
-  container = list->data;
-  free (list);
+  return success;
+}
+
+void
+xcb_xim_server_connection_get_transport_statistics (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_transport_statistics_t *statistics)
+{
+  statistics->open = xim->nclients;
+  statistics->closed = xim->closed_transports;
+  statistics->destroyed = xim->destroyed_transports;
+  statistics->malformed_requests = xim->malformed_requests;
+}
+
+void
+xcb_xim_server_connection_refill_windows (xcb_xim_server_connection_t *xim)
+{
+  if (xim->setup_state == SETUP_DONE)
+    fill_window_pool (xim);
+}
+
+void
+xcb_xim_server_connection_trim (xcb_xim_server_connection_t *xim)
+{
+  while (xim->pool)
+    {
+      struct xcb_xim_request_slot_t *next = xim->pool->next;
+      free (xim->pool);
+      xim->pool = next;
+    }
+  xim->pool_length = 0;
 
-  return container;
+  if (xim->maxclients > xim->nclients)
+    {
+      if (xim->nclients == 0)
+        {
+          free (xim->clients);
+          xim->clients = NULL;
+          xim->maxclients = 0;
+        }
+      else
+        {
+          xcb_xim_transport_t **clients;
+
+          clients = realloc (xim->clients,
+                             sizeof (xcb_xim_transport_t *) * xim->nclients);
+          if (clients)
+            {
+              xim->clients = clients;
+              xim->maxclients = xim->nclients;
+            }
+        }
+    }
 }
 
 static xcb_xim_dispatch_result_t
@@ -2332,6 +3859,8 @@ do_selection_request (xcb_xim_server_connection_t *xim,
   xcb_selection_notify_event_t reply;
   char *buffer;
 
+  (void) error;
+
   memset (&reply, 0, sizeof (reply));
 
   reply.response_type = XCB_SELECTION_NOTIFY;
@@ -2374,6 +3903,53 @@ do_selection_request (xcb_xim_server_connection_t *xim,
   return XCB_XIM_DISPATCH_REMOVE;
 }
 
+/* Drops the requests of a client which has gone away, and queues an
+   XIM_DISCONNECT in their place, so that the user of the connection
+   releases what the client owns.  */
+static xcb_xim_dispatch_result_t
+do_destroy_notify (xcb_xim_server_connection_t *xim,
+                   xcb_destroy_notify_event_t *event)
+{
+  xcb_xim_transport_t *transport;
+  struct xcb_xim_client_t *client = NULL;
+  struct xcb_xim_request_slot_t *slot;
+  struct xcb_xim_watch_t *watch;
+
+  /* Whoever watched it, the window is gone.  */
+  watch = find_watch (xim, event->window);
+  if (watch)
+    remove_watch (xim, watch);
+
+  transport = find_transport_by_client_window (xim, event->window);
+  if (!transport)
+    return XCB_XIM_DISPATCH_CONTINUE;
+
+  client = xcb_xim_container_of (transport, client, transport);
+  if (client->destroyed)
+    return XCB_XIM_DISPATCH_REMOVE;
+  client->destroyed = true;
+
+  while (client->requests)
+    {
+      slot = client->requests;
+      client->requests = slot->next;
+      release_request_slot (xim, slot);
+    }
+  client->requests_tail = NULL;
+
+  slot = alloc_request_slot (xim);
+  if (!slot)
+    return XCB_XIM_DISPATCH_ERROR;
+
+  slot->container.requestor = transport;
+  slot->container.request.major_opcode = XCB_XIM_DISCONNECT;
+  slot->container.request.minor_opcode = 0;
+  slot->container.request.length = 0;
+  queue_request (xim, slot);
+
+  return XCB_XIM_DISPATCH_REMOVE;
+}
+
 static xcb_xim_dispatch_result_t
 do_client_message (xcb_xim_server_connection_t *xim,
                    xcb_client_message_event_t *event,
@@ -2387,54 +3963,69 @@ do_client_message (xcb_xim_server_connection_t *xim,
   else if (event->type == xim->atoms[_XIM_PROTOCOL])
     {
       xcb_xim_transport_t *transport;
+      struct xcb_xim_request_slot_t *slot;
       xcb_xim_request_container_t *container;
-      uint8_t *data;
       size_t length;
 
+      /* The transport may have been closed while the message was in
+         flight.  */
       transport = find_transport (xim, event->window);
       if (!transport)
-        return XCB_XIM_DISPATCH_ERROR;
-
-      data = read_data (xim, transport, event, &length, error);
-      if (!data)
-        return XCB_XIM_DISPATCH_ERROR;
+        return XCB_XIM_DISPATCH_REMOVE;
 
-      container = malloc (sizeof (xcb_xim_transport_t *) + length);
-      if (!container)
-        return XCB_XIM_DISPATCH_ERROR;
+      /* A malformed request is the client's problem, not a reason
+         to stop serving the others.  */
+      slot = read_request (xim, transport, event, &length, error);
+      if (!slot)
+        {
+          xim->malformed_requests++;
+          if (error)
+            {
+              free (*error);
+              *error = NULL;
+            }
+          xcb_xim_error (xim, transport, 0, 0,
+                         XCB_XIM_ERROR_FLAG_NONE,
+                         XCB_XIM_ERROR_BAD_PROTOCOL,
+                         0, 0, NULL,
+                         NULL);
+          return XCB_XIM_DISPATCH_REMOVE;
+        }
 
+      container = &slot->container;
       container->requestor = transport;
-      memcpy (&container->request, data, length);
-      free (data);
 
       switch (container->request.major_opcode)
         {
         case XCB_XIM_CONNECT:
+          /* Answer, or XOpenIM would wait forever.  */
           if (length < 8)
-            goto error;
+            {
+              xim->malformed_requests++;
+              release_request_slot (xim, slot);
+              xcb_xim_error (xim, transport, 0, 0,
+                             XCB_XIM_ERROR_FLAG_NONE,
+                             XCB_XIM_ERROR_BAD_PROTOCOL,
+                             0, 0, NULL,
+                             NULL);
+              return XCB_XIM_DISPATCH_REMOVE;
+            }
 
           transport->endian = ((uint8_t *) &container->request)[4];
           if (!xcb_xim_connect_reply (xim, transport, 1, 0, error))
             goto error;
-          free (container);
-          break;
-
-        case XCB_XIM_DISCONNECT:
-          if (!xcb_xim_disconnect_reply (xim, transport, error))
-            goto error;
-          free (container);
+          release_request_slot (xim, slot);
           break;
 
         default:
-          if (!queue_request (xim, container))
-            goto error;
+          queue_request (xim, slot);
           break;
         }
 
       return XCB_XIM_DISPATCH_REMOVE;
 
     error:
-      free (container);
+      release_request_slot (xim, slot);
       return XCB_XIM_DISPATCH_ERROR;
     }
 
@@ -2458,6 +4049,9 @@ xcb_xim_server_connection_dispatch (xcb_xim_server_connection_t *xim,
                                 (xcb_client_message_event_t *) event,
                                 error);
 
+    case XCB_DESTROY_NOTIFY:
+      return do_destroy_notify (xim, (xcb_destroy_notify_event_t *) event);
+
     default:
       return XCB_XIM_DISPATCH_CONTINUE;
     }
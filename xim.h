@@ -68,6 +68,8 @@ struct xcb_xim_transport_t
   xcb_window_t server_window;
 
   uint8_t endian;      /* 'B' for big endian, 'l' for little endian */
+
+  void *user_data;     /* for the user of the connection; NULL at first */
 };
 
 typedef struct xcb_xim_transport_t xcb_xim_transport_t;
@@ -283,7 +285,7 @@ xcb_xim_attribute_point_new (xcb_xim_transport_t *transport,
 xcb_xim_attribute_t *
 xcb_xim_attribute_font_set_new (xcb_xim_transport_t *transport,
                                 uint16_t attribute_id,
-                                uint8_t value_length,
+                                uint16_t value_length,
                                 const char *value);
 
 xcb_xim_attribute_t *
@@ -305,6 +307,30 @@ xcb_xim_attribute_nested_list_new (xcb_xim_transport_t *transport,
                                    uint16_t value_length,
                                    const xcb_xim_attribute_t **value);
 
+/* Accessors of attribute values.  They return false if the value is
+   too short for the type.  */
+
+bool
+xcb_xim_attribute_get_card32 (xcb_xim_transport_t *transport,
+                              const xcb_xim_attribute_t *attribute,
+                              uint32_t *value);
+
+bool
+xcb_xim_attribute_get_rectangle (xcb_xim_transport_t *transport,
+                                 const xcb_xim_attribute_t *attribute,
+                                 xcb_rectangle_t *value);
+
+bool
+xcb_xim_attribute_get_point (xcb_xim_transport_t *transport,
+                             const xcb_xim_attribute_t *attribute,
+                             xcb_point_t *value);
+
+bool
+xcb_xim_attribute_get_font_set (xcb_xim_transport_t *transport,
+                                const xcb_xim_attribute_t *attribute,
+                                uint16_t *value_length,
+                                const char **value);
+
 /* Iterators.  */
 
 struct xcb_xim_attribute_id_iterator_t
@@ -423,6 +449,13 @@ xcb_xim_error (xcb_xim_server_connection_t *xim,
 
 #define XCB_XIM_ERROR 20
 
+/* XIM_DISCONNECT */
+
+/* Also queued, without a body, when the client window is destroyed
+   without XIM_DISCONNECT.  After releasing what the client owns,
+   handle it with xcb_xim_server_connection_close_transport().  */
+#define XCB_XIM_DISCONNECT 3
+
 /* XIM_OPEN */
 
 struct xcb_xim_open_request_t
@@ -508,6 +541,9 @@ struct xcb_xim_trigger_notify_request_t
   uint32_t mask;                   /* 4: event mask */
 };
 
+typedef struct xcb_xim_trigger_notify_request_t
+  xcb_xim_trigger_notify_request_t;
+
 bool
 xcb_xim_trigger_notify_reply (xcb_xim_server_connection_t *xim,
                               xcb_xim_transport_t *transport,
@@ -605,6 +641,12 @@ xcb_xim_attribute_iterator_t
 xcb_xim_attribute_nested_list_attribute_iterator (xcb_xim_generic_request_t *r,
                                                   xcb_xim_attribute_t *a);
 
+/* Same as above, but for an attribute that has been copied out of the
+   request.  */
+xcb_xim_attribute_iterator_t
+xcb_xim_attribute_nested_list_iterator (xcb_xim_transport_t *transport,
+                                        xcb_xim_attribute_t *a);
+
 bool
 xcb_xim_set_im_values_reply (xcb_xim_server_connection_t *xim,
                              xcb_xim_transport_t *transport,
@@ -692,7 +734,7 @@ xcb_xim_destroy_ic_reply (xcb_xim_server_connection_t *xim,
                           uint16_t input_context_id,
                           xcb_generic_error_t **error);
 
-#define XCB_XIM_DESTROY_IC 53
+#define XCB_XIM_DESTROY_IC 52
 
 /* XIM_GET_IC_VALUES */
 
@@ -923,6 +965,32 @@ xcb_xim_str_conversion (xcb_xim_server_connection_t *xim,
                         int16_t byte_length,
                         xcb_generic_error_t **error);
 
+/* XIMStringConversionOperation */
+#define XCB_XIM_STRING_CONVERSION_SUBSTITUTION 1
+#define XCB_XIM_STRING_CONVERSION_RETRIEVAL 2
+
+struct xcb_xim_str_conversion_reply_t
+{
+  uint8_t major_opcode;
+  uint8_t minor_opcode;
+  uint16_t length;
+
+  uint16_t input_method_id;     /* 2: input_method_id */
+  uint16_t input_context_id;    /* 2: input_context_id */
+  uint32_t feedback;            /* 4: XIMStringConversionFeedback */
+                                /* x: XIMSTRCONVTEXT */
+};
+
+typedef struct xcb_xim_str_conversion_reply_t
+  xcb_xim_str_conversion_reply_t;
+
+/* Returns false if the text doesn't fit in the request.  */
+bool
+xcb_xim_str_conversion_reply_get_string (
+  xcb_xim_str_conversion_reply_t *reply,
+  uint16_t *string_byte_length,
+  const uint8_t **string);
+
 #define XCB_XIM_STR_CONVERSION_REPLY 72
 
 /* XIM_PREEDIT_START */
@@ -1047,11 +1115,130 @@ xcb_xim_status_done (xcb_xim_server_connection_t *xim,
                      uint16_t input_context_id,
                      xcb_generic_error_t **error);
 
+/* Extensions.
+
+   The standard extensions are sent with XIM_EXTENSION as the major
+   opcode and the following minor opcodes, which is what
+   XIM_QUERY_EXTENSION_REPLY should advertise.  */
+
+#define XCB_XIM_EXTENSION 128
+
+/* XIM_EXT_SET_EVENT_MASK */
+
+bool
+xcb_xim_ext_set_event_mask (xcb_xim_server_connection_t *xim,
+                            xcb_xim_transport_t *transport,
+                            uint16_t input_method_id,
+                            uint16_t input_context_id,
+                            uint32_t filter_event_mask,
+                            uint32_t intercept_event_mask,
+                            uint32_t select_event_mask,
+                            uint32_t forward_event_mask,
+                            uint32_t synchronous_event_mask,
+                            xcb_generic_error_t **error);
+
+#define XCB_XIM_EXT_SET_EVENT_MASK 0x30
+
+/* XIM_EXT_FORWARD_KEYEVENT */
+
+struct xcb_xim_ext_forward_keyevent_request_t
+{
+  uint8_t major_opcode;
+  uint8_t minor_opcode;
+  uint16_t length;
+
+  uint16_t input_method_id;     /* 2: input_method_id */
+  uint16_t input_context_id;    /* 2: input_context_id */
+  uint16_t flag;                /* 2: flag */
+  uint16_t sequence;            /* 2: sequence number */
+  uint8_t type;                 /* 1: xEvent.u.u.type */
+  uint8_t keycode;              /* 1: keycode */
+  uint16_t state;               /* 2: state */
+  uint32_t time;                /* 4: time */
+  uint32_t window;              /* 4: window */
+};
+
+typedef struct xcb_xim_ext_forward_keyevent_request_t
+  xcb_xim_ext_forward_keyevent_request_t;
+
+bool
+xcb_xim_ext_forward_keyevent (xcb_xim_server_connection_t *xim,
+                              xcb_xim_transport_t *transport,
+                              uint16_t input_method_id,
+                              uint16_t input_context_id,
+                              uint16_t flag,
+                              uint16_t sequence,
+                              uint8_t type,
+                              uint8_t keycode,
+                              uint16_t state,
+                              uint32_t time,
+                              uint32_t window,
+                              xcb_generic_error_t **error);
+
+#define XCB_XIM_EXT_FORWARD_KEYEVENT 0x32
+
+/* XIM_EXT_MOVE */
+
+struct xcb_xim_ext_move_request_t
+{
+  uint8_t major_opcode;
+  uint8_t minor_opcode;
+  uint16_t length;
+
+  uint16_t input_method_id;     /* 2: input_method_id */
+  uint16_t input_context_id;    /* 2: input_context_id */
+  int16_t x;                    /* 2: X */
+  int16_t y;                    /* 2: Y */
+};
+
+typedef struct xcb_xim_ext_move_request_t xcb_xim_ext_move_request_t;
+
+#define XCB_XIM_EXT_MOVE 0x33
+
+/* Pre-serialized replies.
+
+   Some replies do not depend on the request except for the input
+   method ID, which is always the first field after the header.  Such
+   replies can be serialized once per byte order and then sent to any
+   number of clients with xcb_xim_reply_send(), which patches in the
+   input method ID.  A reply is allocated as a single chunk and can be
+   freed with free().  */
+
+typedef struct xcb_xim_reply_t xcb_xim_reply_t;
+
+xcb_xim_reply_t *
+xcb_xim_open_reply_new (xcb_xim_transport_t *transport,
+                        uint16_t im_attrs_length,
+                        xcb_xim_attribute_spec_t **im_attrs,
+                        uint16_t ic_attrs_length,
+                        xcb_xim_attribute_spec_t **ic_attrs);
+
+xcb_xim_reply_t *
+xcb_xim_query_extension_reply_new (xcb_xim_transport_t *transport,
+                                   uint16_t extensions_length,
+                                   xcb_xim_extension_t **extensions);
+
+xcb_xim_reply_t *
+xcb_xim_get_im_values_reply_new (xcb_xim_transport_t *transport,
+                                 uint16_t attributes_length,
+                                 xcb_xim_attribute_t **attributes);
+
+/* Sends REPLY to TRANSPORT with INPUT_METHOD_ID.  REPLY must have been
+   serialized for the byte order of TRANSPORT; otherwise this returns
+   false without setting ERROR, as it does for a malformed reply.  */
+bool
+xcb_xim_reply_send (xcb_xim_server_connection_t *xim,
+                    xcb_xim_transport_t *transport,
+                    const xcb_xim_reply_t *reply,
+                    uint16_t input_method_id,
+                    xcb_generic_error_t **error);
+
 /* Server connection.  */
 
 struct xcb_xim_request_container_t
 {
   xcb_xim_transport_t *requestor;
+  uint64_t queue_time;          /* CLOCK_MONOTONIC, in microseconds */
   xcb_xim_generic_request_t request;
 };
 
@@ -1070,6 +1257,33 @@ xcb_xim_server_connection_new (xcb_connection_t *connection,
                                const char *locale,
                                xcb_generic_error_t **error);
 
+/* Setting up a server connection takes two round trips, or three if
+   XIM_SERVERS lists other servers, which are removed unless they are
+   still running.  To overlap
+   them with other work, such as the setup of other connections, start
+   it with xcb_xim_server_connection_begin(), which only sends the
+   first requests, and call xcb_xim_server_connection_setup() until it
+   sets *DONE.  Each call waits for the replies to the requests sent
+   by the previous one and sends the next ones.  Once *DONE is set,
+   the server owns the selection and clients can connect.  */
+xcb_xim_server_connection_t *
+xcb_xim_server_connection_begin (xcb_connection_t *connection,
+                                 const char *name,
+                                 const char *locale);
+
+bool
+xcb_xim_server_connection_setup (xcb_xim_server_connection_t *xim,
+                                 bool *done,
+                                 xcb_generic_error_t **error);
+
+/* Removes the server from XIM_SERVERS, releases the selection and
+   destroys the windows clients talk to, so that new clients don't
+   wait for a server which has gone away.  Call it before exiting;
+   it waits for one round trip.  */
+bool
+xcb_xim_server_connection_shutdown (xcb_xim_server_connection_t *xim,
+                                    xcb_generic_error_t **error);
+
 void
 xcb_xim_server_connection_free (xcb_xim_server_connection_t *xim);
 
@@ -1079,7 +1293,106 @@ xcb_xim_server_connection_dispatch (xcb_xim_server_connection_t *xim,
                                     xcb_generic_event_t *event,
                                     xcb_generic_error_t **error);
 
+/* Requests are queued per transport.  This returns the next request,
+   taking transports in round-robin order.  */
 xcb_xim_request_container_t *
 xcb_xim_server_connection_poll_request (xcb_xim_server_connection_t *xim);
 
+bool
+xcb_xim_server_connection_has_requests (xcb_xim_server_connection_t *xim);
+
+/* Returns a transport with queued requests and moves it to the end of
+   the round-robin order, or NULL if no requests are queued.  */
+xcb_xim_transport_t *
+xcb_xim_server_connection_next_ready_transport (
+  xcb_xim_server_connection_t *xim);
+
+/* Returns the next request from TRANSPORT, or NULL.  */
+xcb_xim_request_container_t *
+xcb_xim_server_connection_poll_transport_request (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_transport_t *transport);
+
+/* Returns a container obtained from
+   xcb_xim_server_connection_poll_request() to the connection.  If the
+   client waits for a reply to the request and none was sent since it
+   was polled, this sends a default one: an empty acknowledgement
+   where the protocol allows it, XIM_ERROR otherwise.  */
+void
+xcb_xim_server_connection_release_request (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_request_container_t *container);
+
+/* Selects StructureNotify on WINDOW until the same number of calls to
+   xcb_xim_server_connection_unwatch_window(), or until it is
+   destroyed.  The event mask is shared with the transports, whose
+   client windows are watched the same way, so use this rather than
+   changing it directly.  The events go through
+   xcb_xim_server_connection_dispatch() like the others.  */
+bool
+xcb_xim_server_connection_watch_window (xcb_xim_server_connection_t *xim,
+                                        xcb_window_t window);
+
+void
+xcb_xim_server_connection_unwatch_window (xcb_xim_server_connection_t *xim,
+                                          xcb_window_t window);
+
+/* Whether the client waits for a reply to a polled request which was
+   not sent yet.  */
+bool
+xcb_xim_server_connection_reply_pending (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_request_container_t *container);
+
+/* Number of default replies sent for requests with MAJOR_OPCODE, that
+   is, of clients which would have waited for a reply until timing
+   out.  */
+uint64_t
+xcb_xim_server_connection_get_default_replies (
+  xcb_xim_server_connection_t *xim,
+  uint8_t major_opcode);
+
+/* Stores the IDs a request refers to, and returns which of them are
+   valid, as in XIM_ERROR.  */
+xcb_xim_error_flag_t
+xcb_xim_request_get_ids (xcb_xim_transport_t *transport,
+                         xcb_xim_generic_request_t *request,
+                         uint16_t *input_method_id,
+                         uint16_t *input_context_id);
+
+/* Replies to XIM_DISCONNECT unless the client is gone, and frees
+   TRANSPORT along with its queued requests.  */
+bool
+xcb_xim_server_connection_close_transport (xcb_xim_server_connection_t *xim,
+                                           xcb_xim_transport_t *transport,
+                                           xcb_generic_error_t **error);
+
+/* Counts of transports, to check that clients are cleaned up.  */
+struct xcb_xim_transport_statistics_t
+{
+  size_t open;
+  uint64_t closed;
+  uint64_t destroyed;           /* closed without XIM_DISCONNECT */
+  uint64_t malformed_requests;  /* dropped with XIM_ERROR */
+};
+
+typedef struct xcb_xim_transport_statistics_t xcb_xim_transport_statistics_t;
+
+void
+xcb_xim_server_connection_get_transport_statistics (
+  xcb_xim_server_connection_t *xim,
+  xcb_xim_transport_statistics_t *statistics);
+
+/* Creates the server windows used up by connection requests since
+   the last call.  Replies to connection requests are not flushed, so
+   that a burst of them goes out at once; call this once per main loop
+   iteration, before flushing the connection.  */
+void
+xcb_xim_server_connection_refill_windows (xcb_xim_server_connection_t *xim);
+
+/* Releases memory cached by the connection, which is not needed to
+   process the next request.  */
+void
+xcb_xim_server_connection_trim (xcb_xim_server_connection_t *xim);
+
 #endif